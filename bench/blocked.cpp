@@ -0,0 +1,77 @@
+#include <getopt.h>
+#include <chrono>
+#include <random>
+#include "kfreq.h"
+
+// Compares direct and cache-blocked max-k counting throughput at each k.
+
+using namespace kf;
+using clk = std::chrono::steady_clock;
+
+void usage(char **argv) {
+    std::fprintf(stderr, "Usage: %s [flags] [seqs.fa ...]\n"
+                         "Flags:\n"
+                         "-k\tMin k [6]\n"
+                         "-K\tMax k [14]\n"
+                         "-n\tBases of random sequence to generate if no files are given [50000000]\n"
+                         "-l\tRecord length for random sequence [10000]\n"
+                         "-r\tRepetitions per measurement; the best is reported [3]\n"
+                 , *argv);
+    std::exit(EXIT_FAILURE);
+}
+
+template<typename KFType>
+double time_count(KFType &kf, const SeqBatch &batch) {
+    kf.clear();
+    const auto start = clk::now();
+    for(size_t i = 0; i < batch.size(); ++i) kf.process_seq(batch.seq(i), batch.len(i));
+    kf.flush();
+    return std::chrono::duration<double>(clk::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+    unsigned mink = 6, maxk = 14, reps = 3;
+    size_t nbases = 50000000, reclen = 10000;
+    int c;
+    while((c = getopt(argc, argv, "k:K:n:l:r:h?")) >= 0) {
+        switch(c) {
+            case 'k': mink = std::atoi(optarg); break;
+            case 'K': maxk = std::atoi(optarg); break;
+            case 'n': nbases = std::strtoull(optarg, nullptr, 10); break;
+            case 'l': reclen = std::strtoull(optarg, nullptr, 10); break;
+            case 'r': reps = std::atoi(optarg); break;
+            case 'h': case '?': usage(argv);
+        }
+    }
+    if(maxk > 15 || mink < 1 || mink > maxk || !reps || !reclen) usage(argv);
+    SeqBatch batch;
+    if(optind < argc) {
+        SeqBatch tmp;
+        for(char **p(argv + optind); *p; ++p) {
+            KSeqBatchReader reader(*p);
+            while(reader.next(tmp))
+                for(size_t i = 0; i < tmp.size(); ++i) batch.add(tmp.seq(i), tmp.len(i));
+        }
+    } else {
+        std::mt19937_64 mt(137);
+        std::string rec(reclen, 'A');
+        for(size_t done = 0; done < nbases; done += reclen) {
+            for(auto &ch: rec) ch = "ACGT"[mt() & 3];
+            batch.add(rec.data(), rec.size());
+        }
+    }
+    std::fprintf(stdout, "#k\tbuckets\tdirect_bases_per_sec\tblocked_bases_per_sec\tspeedup\n");
+    for(unsigned k = mink; k <= maxk; ++k) {
+        freq::KFreqArray<u32> direct(k, true), blocked(k, true);
+        direct.set_blocked(false);
+        blocked.set_blocked(true);
+        double td = 1e300, tb = 1e300;
+        for(unsigned r = 0; r < reps; ++r) {
+            td = std::min(td, time_count(direct, batch));
+            tb = std::min(tb, time_count(blocked, batch));
+        }
+        std::fprintf(stdout, "%u\t%u\t%0.4g\t%0.4g\t%0.3f\n", k, BlockedCounter<u32>(k).nbuckets(),
+                     batch.bases() / td, batch.bases() / tb, td / tb);
+        std::fflush(stdout);
+    }
+}
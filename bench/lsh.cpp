@@ -0,0 +1,96 @@
+#include <getopt.h>
+#include <chrono>
+#include <random>
+#include "lsh.h"
+
+// Recall and latency of LSH index queries, at a range of probe counts, against brute force over
+// the same profiles. Profiles are synthetic: clusters of noisy copies of random centres, roughly
+// like genomes within and between species, queried with fresh noisy copies.
+
+using namespace kf;
+using namespace kf::freq;
+using clk = std::chrono::steady_clock;
+
+void usage(char **argv) {
+    std::fprintf(stderr, "Usage: %s [flags]\n"
+                         "Flags:\n"
+                         "-n\tIndexed profiles [20000]\n"
+                         "-K\tk of the canonical z-scores profiled, setting their length [6: 2080 values]\n"
+                         "-c\tProfiles per cluster [20]\n"
+                         "-s\tNoise relative to cluster centres [0.5]\n"
+                         "-q\tQueries [200]\n"
+                         "-k\tNeighbours per query [10]\n"
+                         "-t\tTables [%u]\n"
+                         "-b\tBits per table [%u]\n"
+                         "-o\tIndex path [lsh_bench.idx]\n"
+                 , *argv, KF_LSH_TABLES, KF_LSH_BITS);
+    std::exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    size_t n = 20000, csize = 20, nq = 200, topk = 10;
+    unsigned k = 6, tables = KF_LSH_TABLES, bits = KF_LSH_BITS;
+    double noise = .5;
+    std::string path = "lsh_bench.idx";
+    int c;
+    while((c = getopt(argc, argv, "n:K:c:s:q:k:t:b:o:h?")) >= 0) {
+        switch(c) {
+            case 'n': n = std::strtoull(optarg, nullptr, 10); break;
+            case 'K': k = std::atoi(optarg); break;
+            case 'c': csize = std::strtoull(optarg, nullptr, 10); break;
+            case 's': noise = std::atof(optarg); break;
+            case 'q': nq = std::strtoull(optarg, nullptr, 10); break;
+            case 'k': topk = std::strtoull(optarg, nullptr, 10); break;
+            case 't': tables = std::atoi(optarg); break;
+            case 'b': bits = std::atoi(optarg); break;
+            case 'o': path = optarg; break;
+            case 'h': case '?': usage(argv);
+        }
+    }
+    if(!n || k < 3 || k > 16 || !csize || !nq || !topk) usage(argv);
+    const size_t d = zscore_size(k, true);
+    std::mt19937_64 mt(137);
+    std::normal_distribution<float> nd;
+    std::vector<float> centres(((n + csize - 1) / csize) * d);
+    for(auto &v: centres) v = nd(mt);
+    auto noisy = [&](size_t cluster, float *out) {
+        for(size_t j = 0; j < d; ++j) out[j] = centres[cluster * d + j] + noise * nd(mt);
+    };
+    std::vector<std::string> names(n);
+    for(size_t i = 0; i < n; ++i) names[i] = std::to_string(i);
+    auto start = clk::now();
+    {
+        auto pfile = profile_file<float>(path + ".profiles", n, d, PEARSON, 0, [&](ProfileMatrix<float> &m) {
+            for(size_t i = 0; i < n; ++i) noisy(i / csize, m.row(i));
+        });
+        build_lsh_index(path, ProfileMatrix<float>(n, d, pfile->row(0)), names, k, k, true, PEARSON, 0, tables, bits);
+    }
+    const double tbuild = std::chrono::duration<double>(clk::now() - start).count();
+    LSHIndex<float> index(path);
+    ProfileMatrix<float> queries(nq, d);
+    for(size_t i = 0; i < nq; ++i) noisy(mt() % centres.size() / d, queries.row(i));
+    standardize(queries, PEARSON);
+
+    std::vector<std::vector<Neighbour>> truth(nq);
+    start = clk::now();
+    for(size_t i = 0; i < nq; ++i) truth[i] = index.exact(queries.row(i), topk);
+    const double texact = std::chrono::duration<double>(clk::now() - start).count() / nq;
+    std::fprintf(stdout, "#n=%zu d=%zu tables=%u bits=%u build=%0.3fs\n", n, d, tables, bits, tbuild);
+    std::fprintf(stdout, "#method\trecall@%zu\tus_per_query\tspeedup\n", topk);
+    std::fprintf(stdout, "exact\t1.000\t%0.1f\t1.00\n", texact * 1e6);
+    for(unsigned probes: {0u, 1u, 2u, 4u, 8u}) {
+        if(probes > bits) break;
+        size_t found = 0;
+        start = clk::now();
+        for(size_t i = 0; i < nq; ++i) {
+            const auto hits = index.query(queries.row(i), topk, probes);
+            for(const auto &h: hits)
+                found += std::any_of(truth[i].begin(), truth[i].end(), [&h](const Neighbour &t) {return t.id == h.id;});
+        }
+        const double t = std::chrono::duration<double>(clk::now() - start).count() / nq;
+        std::fprintf(stdout, "lsh:probes=%u\t%0.3f\t%0.1f\t%0.2f\n", probes, double(found) / (nq * topk), t * 1e6, texact / t);
+        std::fflush(stdout);
+    }
+    std::remove(path.data());
+    std::remove((path + ".profiles").data());
+}
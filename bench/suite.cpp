@@ -0,0 +1,254 @@
+#include <getopt.h>
+#include <chrono>
+#include <ctime>
+#include <random>
+#include <sstream>
+#include <thread>
+#include "kfprofile.h"
+
+// Throughput of counting, scoring, collapsing, writing and comparing tables, as JSON on stdout so
+// that runs from different releases can be diffed. Inputs are synthetic and deterministic: every
+// file is generated from a fixed seed and its parameters, so the same flags always time the same
+// bases.
+// Each factor is swept on its own around a baseline (the first value of each list): k, then the
+// thread count, then the shape of the input (size, N density, record length, FASTA or FASTQ, plain
+// or gzipped). Every measurement is the best of -r repetitions.
+
+using namespace kf;
+using namespace kf::freq;
+using clk = std::chrono::steady_clock;
+
+void usage(char **argv) {
+    std::fprintf(stderr, "Usage: %s [flags]\n"
+                         "Flags:\n"
+                         "-k\tMin k [2]\n"
+                         "-K\tMax k [12]; up to 16, needing 4^k * 4 bytes per table\n"
+                         "-b\tBaseline k for thread and input sweeps [8]\n"
+                         "-p\tThread counts, comma-separated [1,2,4]\n"
+                         "-n\tBases per input, comma-separated [10000000]\n"
+                         "-N\tFraction of bases that are N, comma-separated [0,0.01]\n"
+                         "-l\tRecord lengths, comma-separated [100000,150]\n"
+                         "-P\tProfiles compared in the pairwise benchmark [256]\n"
+                         "-r\tRepetitions per measurement; the best is reported [3]\n"
+                         "-d\tDirectory for generated inputs and written tables [.]\n"
+                         "-s\tSeed [137]\n"
+                 , *argv);
+    std::exit(EXIT_FAILURE);
+}
+
+template<typename T>
+std::vector<T> parse_list(const char *s) {
+    std::vector<T> ret;
+    std::istringstream is(s);
+    for(std::string tok; std::getline(is, tok, ',');) ret.push_back(std::stod(tok));
+    if(ret.empty()) throw std::runtime_error(std::string("Empty list ") + s);
+    return ret;
+}
+
+struct InputSpec {
+    size_t bases, reclen;
+    double ndensity;
+    bool fastq, gzip;
+    std::string path(const std::string &dir) const {
+        return dir + "/kfbench_" + std::to_string(bases) + '_' + std::to_string(reclen) + '_' + std::to_string(ndensity) +
+               (fastq ? ".fq": ".fa") + (gzip ? ".gz": "");
+    }
+};
+
+// Writes spec's input, seeded from the seed and the spec's sequence parameters, so that the
+// plain and gzipped FASTA and FASTQ forms of an input hold the same bases.
+void generate(const InputSpec &spec, const std::string &path, u64 seed) {
+    std::mt19937_64 mt(seed ^ (spec.bases * 0x9E3779B97F4A7C15ull) ^ (spec.reclen << 20) ^ u64(spec.ndensity * 1e9));
+    const u64 nthresh = spec.ndensity * 18446744073709551615.;
+    gzFile fp = gzopen(path.data(), spec.gzip ? "wb6": "wbT");
+    if(fp == nullptr) throw std::runtime_error(std::string("Could not open file at ") + path);
+    std::string rec;
+    for(size_t done = 0, i = 0; done < spec.bases; done += rec.size(), ++i) {
+        rec.resize(std::min(spec.reclen, spec.bases - done));
+        for(auto &c: rec) {
+            const u64 r = mt();
+            c = r < nthresh ? 'N': "ACGT"[r >> 62];
+        }
+        gzprintf(fp, "%c%zu\n", spec.fastq ? '@': '>', i);
+        gzwrite(fp, rec.data(), rec.size());
+        if(spec.fastq) {
+            gzputs(fp, "\n+\n");
+            const std::string qual(rec.size(), 'I');
+            gzwrite(fp, qual.data(), qual.size());
+        }
+        gzputc(fp, '\n');
+    }
+    gzclose(fp);
+}
+
+// One result as a single-line JSON object.
+class Record {
+    std::string s_;
+    void key(const char *k) {s_ += s_.empty() ? "{\"": ", \""; s_ += k; s_ += "\": ";}
+public:
+    Record &add(const char *k, const std::string &v) {key(k); s_ += '"' + v + '"'; return *this;}
+    Record &add(const char *k, const char *v) {return add(k, std::string(v));}
+    Record &add(const char *k, bool v) {key(k); s_ += v ? "true": "false"; return *this;}
+    Record &add(const char *k, unsigned v) {key(k); s_ += std::to_string(v); return *this;}
+    Record &add(const char *k, size_t v) {key(k); s_ += std::to_string(v); return *this;}
+    Record &add(const char *k, double v) {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.6g", v);
+        key(k); s_ += buf; return *this;
+    }
+    Record &add(const char *k, const InputSpec &in) {
+        key(k);
+        s_ += Record().add("bases", in.bases).add("record_length", in.reclen).add("n_density", in.ndensity)
+                      .add("format", in.fastq ? "fastq": "fasta").add("gzip", in.gzip).str();
+        return *this;
+    }
+    std::string str() const {return s_ + '}';}
+};
+
+class Results {
+    bool first_ = true;
+public:
+    Results(const Record &meta) {std::fprintf(stdout, "{\"meta\": %s,\n \"results\": [", meta.str().data());}
+    ~Results() {std::fputs("\n ]}\n", stdout);}
+    void emit(const Record &r) {
+        std::fprintf(stdout, "%s\n  %s", first_ ? "": ",", r.str().data());
+        first_ = false;
+        std::fflush(stdout);
+    }
+};
+
+// Best time of reps runs of f, each after setup (untimed).
+template<typename Setup, typename F>
+double best_of(unsigned reps, const Setup &setup, const F &f) {
+    double ret = 1e300;
+    for(unsigned r = 0; r < reps; ++r) {
+        setup();
+        const auto start = clk::now();
+        f();
+        ret = std::min(ret, std::chrono::duration<double>(clk::now() - start).count());
+    }
+    return ret;
+}
+template<typename F>
+double best_of(unsigned reps, const F &f) {return best_of(reps, []() {}, f);}
+
+template<typename KFType>
+KFType make_counter(unsigned k, bool canonical);
+template<>
+KFC make_counter<KFC>(unsigned k, bool canonical) {return KFC(k, true, canonical);}
+template<>
+KFL make_counter<KFL>(unsigned k, bool canonical) {return KFL(k, std::min(k, 3u), true, canonical);}
+
+template<typename KFType>
+void bench_count(Results &res, const char *backend, unsigned k, unsigned nthreads, const InputSpec &in, const std::string &path, unsigned reps) {
+    KFType kf = make_counter<KFType>(k, true);
+    const double t = best_of(reps, [&]() {kf.clear();}, [&]() {kf.add(path.data(), nullptr, nthreads);});
+    res.emit(Record().add("bench", "count").add("backend", backend).add("k", k).add("threads", nthreads).add("input", in)
+                     .add("seconds", t).add("bases_per_sec", in.bases / t));
+}
+
+int main(int argc, char *argv[]) {
+    unsigned mink = 2, maxk = 12, basek = 8, reps = 3;
+    size_t nprofiles = 256;
+    u64 seed = 137;
+    std::vector<unsigned> threads{1, 2, 4};
+    std::vector<size_t> sizes{10000000}, reclens{100000, 150};
+    std::vector<double> ndensities{0., .01};
+    std::string dir = ".";
+    int c;
+    while((c = getopt(argc, argv, "k:K:b:p:n:N:l:P:r:d:s:h?")) >= 0) {
+        switch(c) {
+            case 'k': mink = std::atoi(optarg); break;
+            case 'K': maxk = std::atoi(optarg); break;
+            case 'b': basek = std::atoi(optarg); break;
+            case 'p': threads = parse_list<unsigned>(optarg); break;
+            case 'n': sizes = parse_list<size_t>(optarg); break;
+            case 'N': ndensities = parse_list<double>(optarg); break;
+            case 'l': reclens = parse_list<size_t>(optarg); break;
+            case 'P': nprofiles = std::strtoull(optarg, nullptr, 10); break;
+            case 'r': reps = std::atoi(optarg); break;
+            case 'd': dir = optarg; break;
+            case 's': seed = std::strtoull(optarg, nullptr, 10); break;
+            case 'h': case '?': usage(argv);
+        }
+    }
+    if(mink < 2 || maxk > 16 || mink > maxk || basek < 2 || basek > 16 || !reps || !nprofiles) usage(argv);
+    for(const auto n: ndensities) if(n < 0. || n > 1.) usage(argv);
+    for(const auto l: reclens) if(!l) usage(argv);
+
+    // The baseline input comes first, then every other combination of the lists.
+    std::vector<InputSpec> inputs;
+    for(const int gzip: {0, 1})
+        for(const int fastq: {0, 1})
+            for(const auto l: reclens)
+                for(const auto n: ndensities)
+                    for(const auto b: sizes) inputs.push_back(InputSpec{b, l, n, bool(fastq), bool(gzip)});
+    std::swap(inputs.front(), *std::find_if(inputs.begin(), inputs.end(), [&](const InputSpec &in) {
+        return in.bases == sizes[0] && in.reclen == reclens[0] && in.ndensity == ndensities[0] && !in.fastq && !in.gzip;
+    }));
+    std::vector<std::string> paths;
+    for(const auto &in: inputs) {
+        paths.push_back(in.path(dir));
+        generate(in, paths.back(), seed);
+    }
+    const InputSpec &base = inputs.front();
+    const std::string &bpath = paths.front();
+
+    Results res(Record().add("seed", size_t(seed)).add("reps", reps).add("hardware_threads", std::thread::hardware_concurrency())
+                        .add("batch_bases", size_t(KF_BATCH_BASES)).add("compiler", __VERSION__).add("time", size_t(std::time(nullptr))));
+    for(unsigned k = mink; k <= maxk; ++k) {
+        bench_count<KFC>(res, "KFreqArray", k, 1, base, bpath, reps);
+        bench_count<KFL>(res, "KFreqList", k, 1, base, bpath, reps);
+    }
+    for(const auto t: threads) {
+        bench_count<KFC>(res, "KFreqArray", basek, t, base, bpath, reps);
+        bench_count<KFL>(res, "KFreqList", basek, t, base, bpath, reps);
+    }
+    for(size_t i = 1; i < inputs.size(); ++i) {
+        bench_count<KFC>(res, "KFreqArray", basek, 1, inputs[i], paths[i], reps);
+        bench_count<KFL>(res, "KFreqList", basek, 1, inputs[i], paths[i], reps);
+    }
+
+    // Table operations, on the baseline input's tables.
+    const std::string out = dir + "/kfbench_table";
+    for(unsigned k = std::max(mink, 3u); k <= maxk; ++k) {
+        for(const bool canonical: {true, false}) {
+            KFC kf = make_counter<KFC>(k, canonical);
+            kf.add(bpath.data());
+            std::vector<double> zs(zscore_size(k, canonical));
+            const double tz = best_of(reps, [&]() {calc_zscores(kf, k, k, zs.data());});
+            res.emit(Record().add("bench", "calc_zscores").add("k", k).add("canonical", canonical).add("seconds", tz)
+                             .add("kmers_per_sec", zs.size() / tz));
+            if(!canonical) {
+                std::unique_ptr<KFC> copy;
+                const double tc = best_of(reps, [&]() {copy.reset(new KFC(kf));}, [&]() {rc_collapse(*copy);});
+                res.emit(Record().add("bench", "rc_collapse").add("k", k).add("seconds", tc).add("kmers_per_sec", (size_t(1) << (2 * k)) / tc));
+            }
+            // Text tables past k = 10 take too long to be worth timing repeatedly.
+            for(const bool binary: {true, false}) {
+                if(!binary && k > 10) continue;
+                const double tw = best_of(reps, [&]() {kf.write(out.data(), binary);});
+                res.emit(Record().add("bench", "write").add("k", k).add("canonical", canonical).add("format", binary ? "binary": "text")
+                                 .add("seconds", tw).add("kmers_per_sec", (size_t(1) << (2 * k)) / tw));
+            }
+        }
+    }
+    std::remove(out.data());
+
+    // All-pairs Pearson over random profiles the length of canonical z-score vectors, up to k = 8.
+    std::mt19937_64 mt(seed);
+    std::normal_distribution<double> nd;
+    for(unsigned k = std::max(mink, 3u); k <= std::min(maxk, 8u); ++k) {
+        const size_t d = zscore_size(k, true);
+        ProfileMatrix<double> src(nprofiles, d);
+        for(size_t i = 0; i < nprofiles; ++i) for(size_t j = 0; j < d; ++j) src.row(i)[j] = nd(mt);
+        std::unique_ptr<ProfileMatrix<double>> m;
+        const double tp = best_of(reps, [&]() {
+            m.reset(new ProfileMatrix<double>(nprofiles, d));
+            std::copy(src.row(0), src.row(0) + ProfileMatrix<double>::padded_rows(nprofiles) * src.stride(), m->row(0));
+        }, [&]() {pairwise(*m, PEARSON);});
+        res.emit(Record().add("bench", "pairwise_pearson").add("k", k).add("profiles", nprofiles).add("dim", d).add("seconds", tp)
+                         .add("pairs_per_sec", nprofiles * (nprofiles + 1) / 2 / tp));
+    }
+    for(const auto &p: paths) std::remove(p.data());
+}
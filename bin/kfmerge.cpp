@@ -0,0 +1,106 @@
+#include <getopt.h>
+#include <thread>
+#include <omp.h>
+#include "kfmerge.h"
+
+using namespace kf;
+
+void usage(char **argv) {
+    std::fprintf(stderr, "Usage: %s [flags] -o out counts1 counts2 ...\n"
+                         "Sums count files (as written by KFreqArray/KFreqList::write) into one, as if their inputs had been counted together.\n"
+                         "All must hold the same k range and strandedness; mapped (binary) files must share one count width.\n"
+                         "Flags:\n"
+                         "-o\tOutput count file. Required.\n"
+                         "-p\tSet number of threads [1]. Using -1 will result in all available cores being used\n"
+                         "-w\tOutput count width in bits, 32 or 64. [The mapped inputs' width, else 32]\n"
+                         "-t\tWrite text instead of the mapped binary format.\n"
+                         "-z\tAlso write the merged counts' z-scores to this path, one per line, as kfreq does.\n"
+                         "-K\tScore every k from this up to the max k, each k's z-scores after the last. [max k]\n"
+                 , *argv);
+    std::fflush(stderr);
+    std::exit(EXIT_FAILURE);
+}
+
+template<typename KFType>
+void merge(KFType &kf, const std::vector<std::string> &paths, const std::string &out, bool text, unsigned nthreads,
+           const std::string &zpath, unsigned zmink) {
+    freq::merge_counts(paths, kf, nthreads);
+    kf.write(out.data(), !text, nthreads);
+    if(zpath.empty()) return;
+    if(!zmink) zmink = kf.maxk();
+    std::vector<double> zs;
+    for(unsigned k = zmink; k <= kf.maxk(); ++k) zs.resize(zs.size() + freq::zscore_size(k, kf.canonical()));
+    freq::calc_zscores(kf, zmink, kf.maxk(), zs.data());
+    std::FILE *ofp = std::fopen(zpath.data(), "wb");
+    if(ofp == nullptr) throw std::runtime_error(std::string("Could not open file at ") + zpath);
+    TextBuffer tb(ofp);
+    for(const double z: zs) tb.put_fixed6(z), tb.put('\n');
+    tb.flush();
+    std::fclose(ofp);
+}
+
+// Tables spanning k = 1 to maxk are merged as a KFreqArray, others as a KFreqList, so that
+// text output keeps the inputs' format.
+template<typename SizeType>
+void merge_as(unsigned mink, unsigned maxk, bool canonical, const std::vector<std::string> &paths, const std::string &out, bool text,
+              unsigned nthreads, const std::string &zpath, unsigned zmink) {
+    if(mink == 1) {
+        freq::KFreqArray<SizeType> kf(maxk, false, canonical);
+        merge(kf, paths, out, text, nthreads, zpath, zmink);
+    } else {
+        freq::KFreqList<SizeType> kf(maxk, maxk - mink + 1, false, canonical);
+        merge(kf, paths, out, text, nthreads, zpath, zmink);
+    }
+}
+
+int main(int argc, char **argv) {
+    std::string out, zpath;
+    unsigned width = 0, zmink = 0;
+    bool text = false;
+    int c, nthreads = 1;
+    while((c = getopt(argc, argv, "o:p:w:z:K:th?")) >= 0) {
+        switch(c) {
+            case 'o': out = optarg; break;
+            case 'p': nthreads = std::atoi(optarg); break;
+            case 'w': width = std::atoi(optarg); break;
+            case 't': text = true; break;
+            case 'z': zpath = optarg; break;
+            case 'K': zmink = std::atoi(optarg); break;
+            case 'h': case '?': usage(argv);
+        }
+    }
+    if(nthreads < 0) nthreads = std::thread::hardware_concurrency();
+    omp_set_num_threads(nthreads);
+    std::vector<std::string> paths;
+    for(char **p(argv + optind); *p; paths.emplace_back(*p++));
+    if(out.empty() || paths.empty()) usage(argv);
+    if(width && width != 32 && width != 64) {
+        std::fprintf(stderr, "Unsupported count width %u.\n", width);
+        usage(argv);
+    }
+    // The first input sets the k range, and the first mapped input, if any, the default width.
+    unsigned mink, maxk;
+    bool canonical;
+    {
+        const freq::CountFile first(paths[0].data());
+        mink = first.mink, maxk = first.maxk, canonical = first.canonical;
+    }
+    if(!width) {
+        width = 32;
+        for(const auto &path: paths) {
+            if(!freq::is_mapped_file(path.data())) continue;
+            width = freq::MappedFile(path.data()).header().count_bytes * CHAR_BIT;
+            break;
+        }
+    }
+    if(!zpath.empty() && zmink && (zmink < std::max(3u, mink + 2) || zmink > maxk)) {
+        std::fprintf(stderr, "-K must be between %u and the max k, %u.\n", std::max(3u, mink + 2), maxk);
+        usage(argv);
+    }
+    if(!zpath.empty() && !zmink && maxk < std::max(3u, mink + 2)) {
+        std::fprintf(stderr, "-z needs a max k of at least %u, not %u.\n", std::max(3u, mink + 2), maxk);
+        usage(argv);
+    }
+    if(width == 32) merge_as<u32>(mink, maxk, canonical, paths, out, text, nthreads, zpath, zmink);
+    else            merge_as<u64>(mink, maxk, canonical, paths, out, text, nthreads, zpath, zmink);
+}
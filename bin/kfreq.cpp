@@ -1,7 +1,11 @@
 #include <getopt.h>
 #include <thread>
 #include <omp.h>
-#include "kfreq.h"
+#include "hashfreq.h"
+#include "kfprofile.h"
+#include "lsh.h"
+#include "profiledb.h"
+#include "recprofile.h"
 
 #ifndef FLOAT_TYPE
 #define FLOAT_TYPE double
@@ -12,12 +16,39 @@ using namespace kf;
 void usage(char **argv) {
     std::fprintf(stderr, "Usage: %s [flags] [genome1] [genome2] ...\n"
                          "Flags:\n"
-                         "-k\tSet kmer size [4]\n"
-                         "-b\tEmit binary [false]\n"
+                         "-k\tSet kmer size [4]. Up to 16 for profiles; up to 32 with -c, which then writes each input's counts for every k\n"
+                         "  \tfrom -K to -k, as sparse tables, to <input>.k[K-]k.kfh (gzipped) instead.\n"
+                         "-K\tProfile every k from this up to -k, each k's z-scores after the last (multi-scale). [-k]\n"
+                         "-b\tWrite count tables (-k past 16) in binary rather than as text. [false]\n"
                          "-p\tSet number of threads [1]. Using -1 will result in all available cores being used\n"
                          "-o\tSet output file for distance table, if produced.\n"
                          "-c\tSketch only, don't calculate distances.\n"
-                         "-R\tDo not reverse complement. [Default: always reverse complement.]\n"
+                         "-m\tSimilarity metric for the distance table: pearson, cosine or euclidean (a distance). [pearson]\n"
+                         "-R\tDo not reverse complement. [Default: count both strands into canonical tables, scoring each reverse-complement pair once.]\n"
+                         "-A\tCount every k directly. [Default: count only the max k and derive lower orders from it.]\n"
+                         "-w\tCounter cell width in bits (8, 16 or 32). Narrow cells spill large counts to a side table. [16]\n"
+                         "-s\tPrint time spent inflating, parsing, counting, scoring and comparing, and each thread's busy and idle time, to stderr.\n"
+                         "--stats path\tWrite each thread's stage times and counts to path, as JSON if it ends in .json, else TSV.\n"
+                         "--progress secs\tPrint a progress line to stderr every secs seconds.\n"
+                         "-O, --matrix path\tCompute the distance table block by block into a binary matrix at path, keeping profiles in path.profiles.\n"
+                         "                 \tA killed run resumes where it stopped. Text is only written if -o is also given.\n"
+                         "                 \tA finished matrix of other inputs is updated: only inputs new to it are profiled and compared,\n"
+                         "                 \tand rows of inputs no longer given are dropped. Row names are kept in path.names.\n"
+                         "--shard i/N\tWith -O, compute only shard i (from 0) of N into path.iofN.\n"
+                         "--merge N\tWith -O, assemble path from the N shards computed into it, then exit.\n"
+                         "--index path\tBuild a nearest-neighbour index over the inputs at path (profiles in path.profiles), then exit.\n"
+                         "--query path\tList each input's nearest neighbours in the index at path, counted with the index's k and strandedness.\n"
+                         "--top N\tNeighbours to list per query. [10]\n"
+                         "--probes N\tExtra buckets to probe per index table; more finds more true neighbours, more slowly. [2]\n"
+                         "--exact\tAnswer queries by brute force over every indexed profile.\n"
+                         "--db path\tAppend the inputs' profiles to the database at path instead of writing a text file per input,\n"
+                         "         \tthen compare (or index, or query) every profile in it. k, -K and -R come from an existing database.\n"
+                         "--half\tStore a new database's profiles as float16.\n"
+                         "--records path\tProfile every record of the inputs, rather than each input, then exit: one row per record,\n"
+                         "              \tnamed as in its input, appended to the profile database at path (see --db),\n"
+                         "              \tor as text if path ends in .tsv (each record's name, then its values, tab-separated).\n"
+                         "              \tk, -K, -R and --values come from an existing database.\n"
+                         "--values name\tWhat --records profiles hold: zscores, counts, or freqs (each k's counts over their sum). [zscores]\n"
                  , *argv);
     std::fflush(stderr);
     std::exit(EXIT_FAILURE);
@@ -29,82 +60,338 @@ std::string canonicalize(const char *str) {
     return str;
 }
 
-std::vector<std::vector<FLOAT_TYPE>> pairwise_pearson(const std::vector<std::vector<FLOAT_TYPE>> &profiles) {
-    std::vector<std::vector<FLOAT_TYPE>> ret;
-    ret.reserve(profiles.size());
-    while(ret.size() < profiles.size()) ret.emplace_back(profiles.size());
-    for(size_t i(0); i < profiles.size(); ++i)
-        for(size_t j(i); j < profiles.size(); ++j)
-            ret[i][j] = ret[j][i] = freq::pearsonr_naive(profiles[i], profiles[j]);
-    return ret;
-}
-
-void print_distmat(std::FILE *ofp, const std::vector<std::vector<FLOAT_TYPE>> &profiles, const std::vector<std::string> &paths) {
-    std::fprintf(ofp, "#Path");
-    for(const auto &path: paths) std::fprintf(ofp, "\t%s", path.data());
-    std::fputc('\n', ofp);
-    for(size_t i(0); i < profiles.size(); ++i) {
-        std::fputs(paths[i].data(), ofp);
-        for(const auto &val: profiles[i]) std::fprintf(ofp, "\t%f", val);
-        std::fputc('\n', ofp);
+void print_distmat(std::FILE *ofp, const FLOAT_TYPE *dists, const std::vector<std::string> &paths) {
+    TextBuffer tb(ofp);
+    tb.put("#Path", 5);
+    for(const auto &path: paths) tb.put('\t'), tb.put(path.data(), path.size());
+    tb.put('\n');
+    for(size_t i(0); i < paths.size(); ++i) {
+        tb.put(paths[i].data(), paths[i].size());
+        for(size_t j(0); j < paths.size(); ++j) tb.put('\t'), tb.put_fixed6(dists[i * paths.size() + j]);
+        tb.put('\n');
     }
+    tb.flush();
 }
 
-void emit_zscores(const std::string &path, const std::vector<FLOAT_TYPE> &data) {
+// Returns the number of bytes written.
+size_t emit_zscores(const std::string &path, const FLOAT_TYPE *data, size_t n) {
     std::FILE *ofp = std::fopen(path.data(), "wb");
     if(ofp == nullptr) throw std::runtime_error(std::string("Could not open file at ") + path);
-    for(const auto &val: data) std::fprintf(ofp, "%f\n", val);
+    TextBuffer tb(ofp);
+    for(size_t i = 0; i < n; ++i) tb.put_fixed6(data[i]), tb.put('\n');
+    tb.flush();
     std::fclose(ofp);
+    return tb.written();
+}
+
+// Writes each input's z-scores to a text file unless emit is false. Adds each thread's statistics to stats, if given.
+void profile_inputs(const std::vector<std::string> &paths, unsigned mink, unsigned ks, unsigned nthreads, bool rc, bool maxk_only,
+                    unsigned cell_bits, freq::ProfileMatrix<FLOAT_TYPE> *profiles, std::vector<PipelineStats> *stats, bool emit=true) {
+    const std::string suffix = ".k" + (mink < ks ? std::to_string(mink) + '-': std::string()) + std::to_string(ks) + ".txt";
+    std::vector<PipelineStats> local;
+    freq::profile_files(paths, mink, ks, nthreads, rc, maxk_only, cell_bits, profiles,
+                        [&](size_t i, const FLOAT_TYPE *zs, size_t dim) -> size_t {
+                            return emit ? emit_zscores(canonicalize(paths[i].data()) + suffix, zs, dim): 0;
+                        }, stats ? &local: nullptr);
+    if(!stats) return;
+    if(stats->size() < local.size()) stats->resize(local.size());
+    for(size_t i = 0; i < local.size(); ++i) (*stats)[i] += local[i];
+}
+
+// Counts each input into sparse tables for every k from mink to ks, past 16 (where 4^k cells would not fit),
+// folded onto canonical k-mers if rc, and writes them to <input>.k[mink-]ks.kfh. Adds statistics to stats, if given.
+void count_hashed(const std::vector<std::string> &paths, unsigned mink, unsigned ks, unsigned nthreads, bool rc, bool emit_binary,
+                  PipelineStats *stats) {
+    const std::string suffix = ".k" + (mink < ks ? std::to_string(mink) + '-': std::string()) + std::to_string(ks) + ".kfh";
+    freq::KFH kf(ks, ks - mink + 1);
+    for(const auto &path: paths) {
+        PipelineStats ps;
+        kf.add(path.data(), nullptr, nthreads, stats ? &ps: nullptr);
+        if(rc) kf.rc_collapse();
+        const std::string out = canonicalize(path.data()) + suffix;
+        {
+            StageTimer t(stats ? &ps.emit_time: nullptr);
+            kf.write(out.data(), emit_binary, nthreads);
+        }
+        KF_STAT(struct stat st; if(stats && ::stat(out.data(), &st) == 0) ps.bytes_out += st.st_size);
+        if(stats) *stats += ps;
+        kf.clear();
+        KF_STAT(Progress::get().add_file());
+    }
+}
+
+// Identifies the inputs and settings profiles were computed from, so that on-disk files from another run are not reused.
+u64 inputs_tag(const std::vector<std::string> &paths, unsigned mink, unsigned ks, bool rc) {
+    u64 h = 14695981039346656037ull;
+    auto add = [&h](const char *p, size_t n) {for(size_t i = 0; i < n; ++i) h = (h ^ uint8_t(p[i])) * 1099511628211ull;};
+    for(const auto &path: paths) add(path.data(), path.size() + 1);
+    add(reinterpret_cast<const char *>(&ks), sizeof(ks)), add(reinterpret_cast<const char *>(&rc), sizeof(rc));
+    if(mink < ks) add(reinterpret_cast<const char *>(&mink), sizeof(mink));
+    return h;
 }
 
 int main(int argc, char *argv[]) {
     if(argc == 1) usage(argv);
 
-    using KFType = freq::KFC;
+    static const option long_options[] {
+        {"matrix", required_argument, nullptr, 'O'},
+        {"shard",  required_argument, nullptr, 'S'},
+        {"merge",  required_argument, nullptr, 'M'},
+        {"index",  required_argument, nullptr, 'I'},
+        {"query",  required_argument, nullptr, 'Q'},
+        {"top",    required_argument, nullptr, 'T'},
+        {"probes", required_argument, nullptr, 'P'},
+        {"exact",  no_argument,       nullptr, 'E'},
+        {"stats",    required_argument, nullptr, 'X'},
+        {"progress", required_argument, nullptr, 'G'},
+        {"db",       required_argument, nullptr, 'D'},
+        {"half",     no_argument,       nullptr, 'H'},
+        {"records",  required_argument, nullptr, 'C'},
+        {"values",   required_argument, nullptr, 'V'},
+        {"help",   no_argument,       nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
     std::vector<std::string> paths;
-    bool rc = true, calculate_distances = true;
-    unsigned ks = 4;
+    bool rc = true, calculate_distances = true, maxk_only = true, print_stats = false, exact = false, emit_binary = false;
+    freq::Metric metric = freq::PEARSON;
+    freq::ProfileValues values = freq::ZSCORES;
+    unsigned ks = 4, mink = 0, cell_bits = 16, shard = 0, nshards = 1, nmerge = 0, topk = 10, probes = 2;
     int c, nthreads = 1;
     std::FILE *ofp = stdout;
-    while((c = getopt(argc, argv, "Rcbo:k:h?")) >= 0) {
+    std::string matpath, indexpath, querypath, statspath, dbpath, recpath;
+    bool half = false;
+    double progress = 0.;
+    while((c = getopt_long(argc, argv, "ARcbsm:o:O:k:K:p:w:h?", long_options, nullptr)) >= 0) {
         switch(c) {
             case 'o': ofp = std::fopen(optarg, "wb"); break;
+            case 'O': matpath = optarg; break;
+            case 'S': if(std::sscanf(optarg, "%u/%u", &shard, &nshards) != 2 || shard >= nshards) usage(argv); break;
+            case 'M': nmerge = std::atoi(optarg); if(!nmerge) usage(argv); break;
+            case 'I': indexpath = optarg; break;
+            case 'Q': querypath = optarg; break;
+            case 'T': topk = std::atoi(optarg); break;
+            case 'P': probes = std::atoi(optarg); break;
+            case 'E': exact = true; break;
+            case 'X': statspath = optarg; break;
+            case 'G': progress = std::atof(optarg); break;
+            case 'D': dbpath = optarg; break;
+            case 'H': half = true; break;
+            case 'C': recpath = optarg; break;
+            case 'V': values = freq::values_from_name(optarg); break;
             case 'k': ks = std::atoi(optarg); break;
+            case 'K': mink = std::atoi(optarg); break;
             case 'p': nthreads = std::atoi(optarg); break;
             case 'c': calculate_distances = false; break;
+            case 'b': emit_binary = true; break;
             case 'R': rc = false; break;
+            case 'A': maxk_only = false; break;
+            case 'w': cell_bits = std::atoi(optarg); break;
+            case 's': print_stats = true; break;
+            case 'm': metric = freq::metric_from_name(optarg); break;
             case 'h': case '?': usage(argv);
         }
     }
     if(nthreads < 0) nthreads = std::thread::hardware_concurrency();
     omp_set_num_threads(nthreads);
-    if(ks > 16 || ks < 2) {
-        std::fprintf(stderr, "ks: %u. Max supported: 16. Min: 2. Setting to 4.\n", ks);
+    if(ks > 32 || ks < 3) {
+        std::fprintf(stderr, "ks: %u. Max supported: 32. Min: 3.\n", ks);
+        usage(argv);
+    }
+    if(ks > 16 && (calculate_distances || !matpath.empty() || !indexpath.empty() || !querypath.empty() || !dbpath.empty() || !recpath.empty())) {
+        std::fprintf(stderr, "ks: %u. Profiles support k up to 16; larger k is only counted (-c).\n", ks);
+        usage(argv);
+    }
+    if(!mink) mink = ks;
+    if(mink < 3 || mink > ks) {
+        std::fprintf(stderr, "Multi-scale profiles need 3 <= -K <= -k.\n");
         usage(argv);
     }
     for(char **p(argv + optind); *p; paths.emplace_back(*p++));
-    std::vector<std::vector<FLOAT_TYPE>> profiles;
-    if(calculate_distances) profiles.resize(paths.size());
-    std::vector<KFType> kfcs; kfcs.reserve(nthreads);
-    std::vector<kseq_t> kseqs; kseqs.reserve(nthreads);
-    while(kseqs.size() < (unsigned)nthreads) kseqs.emplace_back(kseq_init_stack());
-    while(kfcs.size() < (unsigned)nthreads) kfcs.emplace_back(ks);
-    #pragma omp parallel for
-    for(unsigned i = 0; i < paths.size(); ++i) {
-        const auto tid =  omp_get_thread_num();
-        assert(tid <= kfcs.size());
-        auto &kfc = kfcs[tid];
-        kfc.add(paths[i].data(), kseqs.data() + tid);
-        if(rc) rc_collapse(kfc);
-        auto zs = calc_zscores(kfc);
-        emit_zscores(canonicalize(paths[i].data()) + ".k" + std::to_string(ks) + ".txt", zs);
-        if(calculate_distances) profiles[i] = zs;
-        kfc.clear();
-    }
-    for(auto &ks: kseqs) kseq_destroy_stack(ks);
-    if(calculate_distances) {
-        std::fprintf(stderr, "calculating distances\n");
-        print_distmat(ofp, pairwise_pearson(profiles), paths);
+    if(matpath.empty() && (nmerge || nshards > 1)) {
+        std::fprintf(stderr, "--shard and --merge need a matrix path (-O).\n");
+        usage(argv);
+    }
+    if(cell_bits != 8 && cell_bits != 16 && cell_bits != 32) {
+        std::fprintf(stderr, "Unsupported cell width %u.\n", cell_bits);
+        usage(argv);
+    }
+    if(!indexpath.empty() && metric == freq::EUCLIDEAN) {
+        std::fprintf(stderr, "Indexes support Pearson and cosine similarity only.\n");
+        usage(argv);
+    }
+    if(!recpath.empty() && (!dbpath.empty() || !matpath.empty() || !indexpath.empty() || !querypath.empty())) {
+        std::fprintf(stderr, "--records cannot be combined with --db, -O, --index or --query.\n");
+        usage(argv);
+    }
+    if(nmerge) {
+        freq::merge_shards<FLOAT_TYPE>(matpath, nmerge);
+        freq::DiskMatrix<FLOAT_TYPE> mat(matpath, freq::KF_DMAT);
+        // Naming the rows lets later runs update the matrix.
+        if(mat.rows() == paths.size() && mat.header().tag == inputs_tag(paths, mink, ks, rc)) freq::write_names(matpath, paths, mat.header().tag);
+        if(ofp != stdout) {
+            if(mat.rows() != paths.size()) throw std::runtime_error("Pass the same inputs as the shards to write the table as text.");
+            print_distmat(ofp, mat.row(0), paths);
+            std::fclose(ofp);
+        }
+        return EXIT_SUCCESS;
+    }
+    std::unique_ptr<freq::LSHIndex<FLOAT_TYPE>> index;
+    if(!querypath.empty()) {
+        index.reset(new freq::LSHIndex<FLOAT_TYPE>(querypath));
+        mink = index->mink(), ks = index->k(), rc = index->canonical(), metric = index->metric();
+    }
+    if(!dbpath.empty() && paths.empty() && ::access(dbpath.data(), F_OK)) {
+        std::fprintf(stderr, "No inputs, and no database at %s.\n", dbpath.data());
+        usage(argv);
+    }
+    if(!dbpath.empty() && ::access(dbpath.data(), F_OK) == 0) {
+        const freq::ProfileDB db(dbpath);
+        if(index && (db.mink() != mink || db.maxk() != ks || db.canonical() != rc))
+            throw std::runtime_error("The database's profiles do not match the index's.");
+        mink = db.mink(), ks = db.maxk(), rc = db.canonical(), half = db.half();
+    }
+    const bool records_tsv = recpath.size() >= 4 && recpath.compare(recpath.size() - 4, 4, ".tsv") == 0;
+    if(!recpath.empty() && !records_tsv && ::access(recpath.data(), F_OK) == 0) {
+        const freq::ProfileDB db(recpath);
+        mink = db.mink(), ks = db.maxk(), rc = db.canonical(), half = db.half(), values = db.values();
+    }
+    // Canonical tables score each reverse-complement pair once.
+    const size_t dim = ks <= 16 ? freq::profile_dim(mink, ks, rc): 0;
+#if !KF_STATS
+    if(print_stats || !statspath.empty() || progress > 0.) {
+        std::fprintf(stderr, "Built with KF_STATS=0: no statistics are gathered.\n");
+        print_stats = false, statspath.clear(), progress = 0.;
+    }
+#endif
+    // Per-thread statistics are only gathered if asked for, since they route every input through a SeqPipeline.
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<PipelineStats> thread_stats;
+    PipelineStats run_stats;
+    const bool gather = print_stats || !statspath.empty() || progress > 0.;
+    if(progress > 0.) Progress::get().start(progress, paths.size());
+    std::unique_ptr<freq::ProfileDB> db;
+    if(!dbpath.empty()) {
+        // Inputs are profiled and appended a batch at a time, so memory does not grow with their number.
+        for(size_t b = 0; b < paths.size(); b += KF_PDB_APPEND) {
+            const std::vector<std::string> batch(paths.begin() + b, paths.begin() + std::min(paths.size(), b + KF_PDB_APPEND));
+            freq::ProfileMatrix<FLOAT_TYPE> m(batch.size(), dim);
+            profile_inputs(batch, mink, ks, nthreads, rc, maxk_only, cell_bits, &m, gather ? &thread_stats: nullptr, false);
+            freq::append_profiles(dbpath, m, batch, mink, ks, rc, half);
+        }
+        db.reset(new freq::ProfileDB(dbpath));
+        paths = db->names();
+    }
+    auto fill = [&](freq::ProfileMatrix<FLOAT_TYPE> *pp) {
+        if(db) {if(pp) db->load(*pp);}
+        else   profile_inputs(paths, mink, ks, nthreads, rc, maxk_only, cell_bits, pp, gather ? &thread_stats: nullptr);
+    };
+    if(!recpath.empty()) {
+        std::FILE *rfp = records_tsv ? std::fopen(recpath.data(), "wb"): nullptr;
+        if(records_tsv && rfp == nullptr) throw std::runtime_error(std::string("Could not open file at ") + recpath);
+        std::unique_ptr<TextBuffer> tb(rfp ? new TextBuffer(rfp): nullptr);
+        std::vector<std::string> names;
+        size_t db_bytes = 0;
+        const size_t n = freq::profile_records<FLOAT_TYPE>(paths, mink, ks, rc, values, nthreads,
+                                                           [&](const SeqBatch &batch, size_t first, const freq::ProfileMatrix<FLOAT_TYPE> &rows) {
+            if(tb) {
+                for(size_t i = 0; i < rows.size(); ++i) {
+                    tb->put(batch.name(first + i), batch.name_len(first + i));
+                    for(const FLOAT_TYPE *r = rows.row(i), *e = r + rows.dim(); r < e; ++r) {
+                        tb->put('\t');
+                        if(values == freq::COUNTS) tb->commit(u64toa(u64(*r), tb->reserve(20)));
+                        else                       tb->put_fixed6(*r);
+                    }
+                    tb->put('\n');
+                }
+                return;
+            }
+            names.clear();
+            for(size_t i = 0; i < rows.size(); ++i) names.emplace_back(batch.name(first + i), batch.name_len(first + i));
+            freq::append_profiles(recpath, rows, names, mink, ks, rc, half, values);
+            db_bytes += rows.size() * rows.dim() * (half ? 2: 4);
+        }, gather ? &run_stats: nullptr);
+        run_stats.bytes_out += tb ? tb->written(): db_bytes;
+        if(tb) {
+            tb->flush();
+            if(std::fclose(rfp)) throw std::runtime_error(std::string("Could not write to ") + recpath);
+        }
+        std::fprintf(stderr, "profiled %zu records into %s\n", n, recpath.data());
+    } else if(ks > 16) {
+        count_hashed(paths, mink, ks, nthreads, rc, emit_binary, gather ? &run_stats: nullptr);
+    } else if(index) {
+        freq::ProfileMatrix<FLOAT_TYPE> queries(paths.size(), dim);
+        fill(&queries);
+        freq::standardize(queries, metric);
+        std::fprintf(ofp, "#Query\tRank\tReference\tSimilarity\n");
+        for(size_t i = 0; i < paths.size(); ++i) {
+            const auto hits = exact ? index->exact(queries.row(i), topk): index->query(queries.row(i), topk, probes);
+            for(size_t r = 0; r < hits.size(); ++r)
+                std::fprintf(ofp, "%s\t%zu\t%s\t%f\n", paths[i].data(), r + 1, index->name(hits[r].id), hits[r].sim);
+        }
+    } else if(!indexpath.empty()) {
+        const u64 tag = inputs_tag(paths, mink, ks, rc);
+        auto pfile = freq::profile_file<FLOAT_TYPE>(indexpath + ".profiles", paths.size(), dim, metric, tag,
+                                                    [&](freq::ProfileMatrix<FLOAT_TYPE> &view) {fill(&view);});
+        std::fprintf(stderr, "building index at %s\n", indexpath.data());
+        freq::build_lsh_index(indexpath, freq::ProfileMatrix<FLOAT_TYPE>(paths.size(), dim, pfile->row(0)), paths, mink, ks, rc, metric, tag);
+    } else if(!matpath.empty()) {
+        // Out of core: profiles and the matrix live in mapped files, so memory stays bounded however many inputs there are.
+        const u64 tag = inputs_tag(paths, mink, ks, rc);
+        // A finished matrix of other inputs, with the same settings, is updated: only inputs new to it are profiled and compared.
+        std::vector<size_t> prev;
+        if(calculate_distances && nshards == 1 &&
+           !freq::disk_matrix_matches<FLOAT_TYPE>(matpath, freq::KF_DMAT, paths.size(), paths.size(), metric, tag, KF_DISTMAT_BLOCK))
+            prev = freq::previous_rows<FLOAT_TYPE>(matpath, paths, dim, metric,
+                                                   [&](const std::vector<std::string> &names) {return inputs_tag(names, mink, ks, rc);});
+        std::unique_ptr<freq::DiskMatrix<FLOAT_TYPE>> pfile;
+        if(prev.empty()) {
+            pfile = freq::profile_file<FLOAT_TYPE>(freq::profiles_path(matpath), paths.size(), dim, metric, tag,
+                                                   [&](freq::ProfileMatrix<FLOAT_TYPE> &view) {fill(&view);});
+        } else {
+            std::vector<std::string> added;
+            std::vector<size_t> rows;
+            for(size_t i = 0; i < paths.size(); ++i)
+                if(prev[i] == freq::KF_NEW_ROW) added.push_back(paths[i]), rows.push_back(i);
+            std::fprintf(stderr, "updating %s: %zu of %zu inputs are new\n", matpath.data(), added.size(), paths.size());
+            pfile = freq::update_profile_file<FLOAT_TYPE>(matpath, prev, dim, metric, tag, [&](freq::ProfileMatrix<FLOAT_TYPE> &view) {
+                if(db) {for(size_t r = 0; r < rows.size(); ++r) db->get(rows[r], view.row(r));}
+                else   profile_inputs(added, mink, ks, nthreads, rc, maxk_only, cell_bits, &view, gather ? &thread_stats: nullptr);
+            });
+        }
+        if(calculate_distances) {
+            const freq::ProfileMatrix<FLOAT_TYPE> profiles(paths.size(), dim, pfile->row(0));
+            const std::string out = nshards > 1 ? freq::shard_path(matpath, shard, nshards): matpath;
+            std::fprintf(stderr, "calculating distances into %s\n", out.data());
+            {
+                StageTimer t(gather ? &run_stats.distance_time: nullptr);
+                if(prev.empty()) freq::compute_blocks(profiles, metric, tag, out, shard, nshards);
+                else             freq::update_blocks(profiles, prev, metric, tag, out);
+            }
+            if(nshards == 1) freq::write_names(matpath, paths, tag);
+            if(ofp != stdout && nshards == 1) print_distmat(ofp, freq::DiskMatrix<FLOAT_TYPE>(out, freq::KF_DMAT).row(0), paths);
+        }
+    } else {
+        freq::ProfileMatrix<FLOAT_TYPE> profiles(calculate_distances ? paths.size(): 0, dim);
+        fill(calculate_distances ? &profiles: nullptr);
+        if(calculate_distances) {
+            std::fprintf(stderr, "calculating distances\n");
+            std::vector<FLOAT_TYPE> dists;
+            {
+                StageTimer t(gather ? &run_stats.distance_time: nullptr);
+                dists = freq::pairwise(profiles, metric);
+            }
+            print_distmat(ofp, dists.data(), paths);
+        }
     }
     if(ofp != stdout) std::fclose(ofp);
+    Progress::get().stop();
+    if(gather) {
+        for(const auto &s: thread_stats) run_stats += s;
+        run_stats.wall_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if(print_stats) {
+            run_stats.print(stderr);
+            if(thread_stats.size() > 1) print_balance(stderr, thread_stats);
+        }
+        if(!statspath.empty()) write_stats(statspath, run_stats, thread_stats);
+    }
 }
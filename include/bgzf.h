@@ -0,0 +1,129 @@
+#pragma once
+#include "kseq_declare.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace kf {
+
+// BGZF, as written by bgzip and htslib, is gzip split into members of at most 64 KiB which
+// record their own compressed size in the gzip extra field. Members can therefore be found
+// without inflating anything and inflated independently of one another.
+static constexpr unsigned BGZF_HEADER_SIZE = 18, BGZF_FOOTER_SIZE = 8, BGZF_MAX_BLOCK = 1u << 16;
+static constexpr unsigned BGZF_BLOCK_INPUT = 0xff00; // Bytes deflated per block, as bgzip does
+
+// The empty block bgzip ends files with, which htslib checks for to detect truncation.
+static const uint8_t BGZF_EOF[28] {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67, 2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+static inline bool is_bgzf_header(const uint8_t *h) {
+    return h[0] == 31 && h[1] == 139 && h[2] == 8 && (h[3] & 4) && h[10] == 6 && h[11] == 0 &&
+           h[12] == 'B' && h[13] == 'C' && h[14] == 2 && h[15] == 0;
+}
+
+static inline bool is_bgzf(const char *path) {
+    uint8_t h[BGZF_HEADER_SIZE];
+    std::FILE *fp = std::fopen(path, "rb");
+    if(fp == nullptr) throw std::runtime_error(std::string("Could not open file at ") + path);
+    const bool ret = std::fread(h, 1, sizeof(h), fp) == sizeof(h) && is_bgzf_header(h);
+    std::fclose(fp);
+    return ret;
+}
+
+// Reads a BGZF file a group of blocks at a time, for the caller to inflate in parallel.
+class BGZFReader {
+    std::FILE *fp_;
+    static u32 le32(const uint8_t *p) {return p[0] | (u32(p[1]) << 8) | (u32(p[2]) << 16) | (u32(p[3]) << 24);}
+public:
+    struct Block {
+        size_t in, inlen; // Deflate stream within the raw buffer
+        size_t out;       // Offset of the inflated block in the output
+        u32    outlen, crc;
+    };
+    BGZFReader(const char *path): fp_(std::fopen(path, "rb")) {
+        if(fp_ == nullptr) throw std::runtime_error(std::string("Could not open file at ") + path);
+    }
+    ~BGZFReader() {std::fclose(fp_);}
+    BGZFReader(const BGZFReader &) = delete;
+    BGZFReader &operator=(const BGZFReader &) = delete;
+    // Reads whole blocks into raw until the next might not fit in capacity inflated bytes.
+    // Returns the number of inflated bytes the blocks hold, or 0 at the end of the file.
+    size_t next(std::vector<uint8_t> &raw, std::vector<Block> &blocks, size_t capacity) {
+        if(capacity < BGZF_MAX_BLOCK) throw std::runtime_error("BGZF output buffer is smaller than a block.");
+        blocks.clear();
+        size_t used = 0, out = 0;
+        uint8_t h[BGZF_HEADER_SIZE];
+        while(out + BGZF_MAX_BLOCK <= capacity) {
+            const size_t nh = std::fread(h, 1, sizeof(h), fp_);
+            if(nh == 0) break;
+            if(nh != sizeof(h) || !is_bgzf_header(h)) throw std::runtime_error("Malformed or truncated BGZF block header.");
+            const size_t bsize = (h[16] | (size_t(h[17]) << 8)) + 1;
+            if(bsize < BGZF_HEADER_SIZE + BGZF_FOOTER_SIZE) throw std::runtime_error("Malformed BGZF block size.");
+            const size_t rest = bsize - BGZF_HEADER_SIZE;
+            if(raw.size() < used + rest) raw.resize(std::max(used + rest, raw.size() << 1));
+            if(std::fread(raw.data() + used, 1, rest, fp_) != rest) throw std::runtime_error("Truncated BGZF block.");
+            const uint8_t *footer = raw.data() + used + rest - BGZF_FOOTER_SIZE;
+            const Block b {used, rest - BGZF_FOOTER_SIZE, out, le32(footer + 4), le32(footer)};
+            if(b.outlen > BGZF_MAX_BLOCK) throw std::runtime_error("BGZF block inflates past 64 KiB.");
+            blocks.push_back(b);
+            used += rest, out += b.outlen;
+        }
+        return out;
+    }
+    // Inflates block b from raw into out + b.out with zs, a stream set up by inflateInit2(&zs, -15).
+    static void inflate_block(z_stream &zs, const uint8_t *raw, const Block &b, char *out) {
+        if(inflateReset(&zs) != Z_OK) throw std::runtime_error("Could not reset inflate stream.");
+        zs.next_in = const_cast<Bytef *>(raw + b.in), zs.avail_in = b.inlen;
+        zs.next_out = reinterpret_cast<Bytef *>(out + b.out), zs.avail_out = b.outlen;
+        if(inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.avail_out)
+            throw std::runtime_error("Corrupt BGZF block.");
+        if(crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<const Bytef *>(out + b.out), b.outlen) != b.crc)
+            throw std::runtime_error("BGZF block failed its CRC check.");
+    }
+};
+
+// Deflates text into whole BGZF blocks, which a thread can do for its own part of a file while
+// others do theirs. Concatenated in order, with BGZF_EOF last, they are a BGZF file.
+class BGZFDeflater {
+    z_stream zs_;
+    static void le16(uint8_t *p, u32 v) {p[0] = v, p[1] = v >> 8;}
+    static void le32(uint8_t *p, u32 v) {p[0] = v, p[1] = v >> 8, p[2] = v >> 16, p[3] = v >> 24;}
+public:
+    BGZFDeflater(int level=Z_DEFAULT_COMPRESSION) {
+        std::memset(&zs_, 0, sizeof(zs_));
+        if(deflateInit2(&zs_, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("Could not initialize deflate stream.");
+    }
+    ~BGZFDeflater() {deflateEnd(&zs_);}
+    BGZFDeflater(const BGZFDeflater &) = delete;
+    BGZFDeflater &operator=(const BGZFDeflater &) = delete;
+    // Appends data[0, n) to out as blocks of up to BGZF_BLOCK_INPUT bytes each.
+    void compress(const char *data, size_t n, std::vector<uint8_t> &out) {
+        for(size_t i = 0; i < n; i += BGZF_BLOCK_INPUT) {
+            const u32 len = std::min<size_t>(n - i, BGZF_BLOCK_INPUT);
+            const size_t start = out.size();
+            out.resize(start + BGZF_MAX_BLOCK);
+            uint8_t *const b = out.data() + start, *const body = b + BGZF_HEADER_SIZE;
+            const u32 cap = BGZF_MAX_BLOCK - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+            if(deflateReset(&zs_) != Z_OK) throw std::runtime_error("Could not reset deflate stream.");
+            zs_.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data + i)), zs_.avail_in = len;
+            zs_.next_out = body, zs_.avail_out = cap;
+            u32 clen;
+            if(deflate(&zs_, Z_FINISH) == Z_STREAM_END) clen = cap - zs_.avail_out;
+            else { // Incompressible: one stored block, which always fits.
+                body[0] = 1, le16(body + 1, len), le16(body + 3, ~len & 0xFFFFu);
+                std::memcpy(body + 5, data + i, len);
+                clen = len + 5;
+            }
+            std::memcpy(b, BGZF_EOF, 16);
+            le16(b + 16, BGZF_HEADER_SIZE + clen + BGZF_FOOTER_SIZE - 1);
+            le32(body + clen, crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<const Bytef *>(data + i), len));
+            le32(body + clen + 4, len);
+            out.resize(start + BGZF_HEADER_SIZE + clen + BGZF_FOOTER_SIZE);
+        }
+    }
+};
+
+} // namespace kf
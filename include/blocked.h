@@ -0,0 +1,72 @@
+#pragma once
+#include "kmerutil.h"
+#include <algorithm>
+#include <vector>
+
+// Defaults below come from bench/blocked; rerun it to pick crossovers for other machines.
+#ifndef KF_BLOCK_SIZE
+#  define KF_BLOCK_SIZE (1u << 22)        // Codes buffered before each flush
+#endif
+#ifndef KF_BLOCK_SLICE_BYTES
+#  define KF_BLOCK_SLICE_BYTES (1u << 20) // Target bytes of table touched per bucket (~L2)
+#endif
+#ifndef KF_BLOCK_MAX_BITS
+#  define KF_BLOCK_MAX_BITS 8u            // Most buckets per flush, keeping the scatter in L1
+#endif
+#ifndef KF_BLOCKED_MIN_K
+#  define KF_BLOCKED_MIN_K 11u            // k range for which KFreqArray/KFreqList block by default
+#endif
+#ifndef KF_BLOCKED_MAX_K
+#  define KF_BLOCKED_MAX_K 12u
+#endif
+
+namespace kf {
+
+// Cache-blocked counting for large tables.
+// k-mer codes are buffered, and on flush are radix-scattered by their high bits into buckets
+// whose slice of the table fits in cache, then counted bucket by bucket. Each flush therefore
+// walks the table once in order instead of touching a random cache line and page per base.
+// This wins while a block is large relative to the table (k = 11-12 here); past that,
+// each bucket's slice is revisited too sparsely and direct increments are faster.
+template<typename CellType>
+class BlockedCounter {
+    std::vector<u32> buf_, tmp_, offsets_;
+    size_t   n_;
+    unsigned shift_;
+public:
+    BlockedCounter(unsigned k=0, size_t blocksize=KF_BLOCK_SIZE): n_(0), shift_(k << 1) {
+        unsigned bits = 0;
+        while(bits < KF_BLOCK_MAX_BITS && bits < (k << 1) && (sizeof(CellType) << ((k << 1) - bits)) > KF_BLOCK_SLICE_BYTES)
+            ++bits;
+        shift_ -= bits;
+        if(k) {
+            buf_.resize(blocksize);
+            if(bits) tmp_.resize(blocksize), offsets_.resize((size_t(1) << bits) + 1);
+        }
+    }
+    bool     enabled()     const {return !buf_.empty();}
+    bool     empty()       const {return n_ == 0;}
+    unsigned nbuckets()    const {return offsets_.empty() ? 1: offsets_.size() - 1;}
+    // Table is anything with inc(index), normally a SubKFreq.
+    template<typename Table>
+    void push(u32 code, Table &table) {
+        buf_[n_] = code;
+        if(++n_ == buf_.size()) flush(table);
+    }
+    template<typename Table>
+    void flush(Table &table) {
+        if(offsets_.empty()) {
+            for(size_t i = 0; i < n_; table.inc(buf_[i++]));
+        } else {
+            std::fill(offsets_.begin(), offsets_.end(), 0u);
+            for(size_t i = 0; i < n_; ++offsets_[(buf_[i++] >> shift_) + 1]);
+            for(size_t i = 1; i < offsets_.size(); ++i) offsets_[i] += offsets_[i - 1];
+            for(size_t i = 0; i < n_; ++i) tmp_[offsets_[buf_[i] >> shift_]++] = buf_[i];
+            for(size_t i = 0; i < n_; table.inc(tmp_[i++]));
+        }
+        n_ = 0;
+    }
+    void clear() {n_ = 0;}
+};
+
+} // namespace kf
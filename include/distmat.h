@@ -0,0 +1,442 @@
+#pragma once
+#include "kfdist.h"
+#include "kfmap.h"
+#include <cstdio>
+#include <memory>
+#include <unordered_map>
+
+#ifndef KF_DISTMAT_BLOCK
+#  define KF_DISTMAT_BLOCK 512u // Profiles per side of each block of the on-disk matrix; the unit of checkpointing and sharding
+#endif
+
+namespace kf {
+
+namespace freq {
+
+// Profiles and distance matrices kept on disk and mapped, so that memory use does not grow
+// with the number of genomes: a KF_MAP_ALIGN-byte header, then rows of stride values each
+// (zero-padded to a multiple of 4 rows). A distance matrix has stride == cols == rows, so it
+// can be read as a plain row-major matrix at offset sizeof(DiskMatrixHeader).
+// tag identifies the inputs a file was made from, so that stale files are not resumed.
+static const char KF_DMAT [] {'#', 'k', 'f', 'd', 'm', 'a', 't', '\n'};
+static const char KF_PROF [] {'#', 'k', 'f', 'p', 'r', 'o', 'f', '\n'};
+static constexpr u32 KF_DMAT_VERSION = 1;
+
+struct alignas(KF_MAP_ALIGN) DiskMatrixHeader {
+    char     magic[sizeof(KF_DMAT)];
+    u32      version;
+    uint8_t  float_bytes;
+    uint8_t  metric;
+    uint16_t reserved;
+    u64      rows, cols, stride;
+    u64      block; // Block size the matrix's checkpoint refers to
+    u64      tag;
+    u64      file_bytes;
+};
+
+template<typename FloatType>
+class DiskMatrix {
+    char  *data_;
+    size_t size_;
+    std::string path_;
+public:
+    // Creates a zero-filled matrix at path, replacing whatever is there.
+    DiskMatrix(const std::string &path, const char *magic, u64 rows, u64 cols, u64 stride, Metric metric, u64 tag, u64 block=0):
+        data_(nullptr), size_(0), path_(path)
+    {
+        DiskMatrixHeader h;
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.magic, magic, sizeof(h.magic));
+        h.version = KF_DMAT_VERSION, h.float_bytes = sizeof(FloatType), h.metric = metric;
+        h.rows = rows, h.cols = cols, h.stride = stride, h.block = block, h.tag = tag;
+        h.file_bytes = sizeof(h) + ((rows + 3) & ~u64(3)) * stride * sizeof(FloatType);
+        const int fd = ::open(path.data(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) throw std::runtime_error(std::string("Could not open file for output at ") + path);
+        // Sparse: blocks never written take no space.
+        if(::ftruncate(fd, h.file_bytes) || ::pwrite(fd, &h, sizeof(h), 0) != ssize_t(sizeof(h))) {
+            ::close(fd);
+            throw std::runtime_error(std::string("Could not allocate matrix at ") + path);
+        }
+        map(fd, true);
+    }
+    // Maps the existing matrix at path. Unless writable, changes made through the mapping stay private.
+    DiskMatrix(const std::string &path, const char *magic, bool writable=false): data_(nullptr), size_(0), path_(path) {
+        const int fd = ::open(path.data(), writable ? O_RDWR: O_RDONLY);
+        if(fd < 0) throw std::runtime_error(std::string("Could not open file at ") + path);
+        map(fd, writable);
+        const DiskMatrixHeader &h = header();
+        const char *err = nullptr;
+        if(std::memcmp(h.magic, magic, sizeof(h.magic)))  err = "Unexpected magic string";
+        else if(h.version != KF_DMAT_VERSION)             err = "Unsupported version or byte order";
+        else if(h.float_bytes != sizeof(FloatType))      err = "Unexpected floating-point width";
+        else if(h.file_bytes != size_ || h.stride < h.cols ||
+                sizeof(h) + ((h.rows + 3) & ~u64(3)) * h.stride * sizeof(FloatType) != size_) err = "Size does not match header";
+        if(err) {
+            ::munmap(data_, size_);
+            throw std::runtime_error(std::string(err) + " in matrix file at " + path);
+        }
+    }
+    DiskMatrix(const DiskMatrix &) = delete;
+    DiskMatrix &operator=(const DiskMatrix &) = delete;
+    ~DiskMatrix() {::munmap(data_, size_);}
+    void map(int fd, bool writable) {
+        struct stat st;
+        if(::fstat(fd, &st) || size_t(st.st_size) < sizeof(DiskMatrixHeader)) {
+            ::close(fd);
+            throw std::runtime_error(std::string("Truncated matrix file at ") + path_);
+        }
+        size_ = st.st_size;
+        void *p = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, writable ? MAP_SHARED: MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if(p == MAP_FAILED) throw std::runtime_error(std::string("Could not map file at ") + path_);
+        data_ = static_cast<char *>(p);
+    }
+    const DiskMatrixHeader &header() const {return *reinterpret_cast<const DiskMatrixHeader *>(data_);}
+    const std::string &path() const {return path_;}
+    size_t rows()   const {return header().rows;}
+    size_t cols()   const {return header().cols;}
+    size_t stride() const {return header().stride;}
+    Metric metric() const {return Metric(header().metric);}
+    FloatType       *row(size_t i)       {return reinterpret_cast<FloatType *>(data_ + sizeof(DiskMatrixHeader)) + i * stride();}
+    const FloatType *row(size_t i) const {return reinterpret_cast<const FloatType *>(data_ + sizeof(DiskMatrixHeader)) + i * stride();}
+    // Writes rows [r0, r1) back to disk, returning once they are there.
+    void sync(size_t r0, size_t r1) {
+        static const size_t page = ::sysconf(_SC_PAGESIZE);
+        const size_t b = (reinterpret_cast<char *>(row(r0)) - data_) / page * page,
+                     e = std::min(size_, size_t(reinterpret_cast<char *>(row(r1)) - data_));
+        if(e > b && ::msync(data_ + b, e - b, MS_SYNC))
+            throw std::runtime_error(std::string("Could not write matrix to ") + path_);
+    }
+    void sync() {sync(0, rows());}
+};
+
+// Whether path holds a matrix which a run with these parameters can reuse.
+template<typename FloatType>
+bool disk_matrix_matches(const std::string &path, const char *magic, u64 rows, u64 cols, Metric metric, u64 tag, u64 block=0) {
+    DiskMatrixHeader h;
+    std::FILE *fp = std::fopen(path.data(), "rb");
+    if(fp == nullptr) return false;
+    const bool ret = std::fread(&h, sizeof(h), 1, fp) == 1 && !std::memcmp(h.magic, magic, sizeof(h.magic)) &&
+                     h.version == KF_DMAT_VERSION && h.float_bytes == sizeof(FloatType) &&
+                     h.rows == rows && h.cols == cols && h.metric == metric && h.tag == tag && h.block == block;
+    std::fclose(fp);
+    return ret;
+}
+
+// Standardized profiles on disk, for use as a ProfileMatrix view. fill() receives a view of a
+// zeroed matrix to set the rows of. A finished file at path is reused if it was made from the
+// same inputs; otherwise the file is built under a temporary name and renamed once complete, so
+// that anything at path is whole even when several shards build it at once.
+template<typename FloatType, typename Fill>
+std::unique_ptr<DiskMatrix<FloatType>> profile_file(const std::string &path, size_t n, size_t d, Metric metric, u64 tag, const Fill &fill) {
+    using PM = ProfileMatrix<FloatType>;
+    if(disk_matrix_matches<FloatType>(path, KF_PROF, n, d, metric, tag))
+        return std::unique_ptr<DiskMatrix<FloatType>>(new DiskMatrix<FloatType>(path, KF_PROF));
+    const std::string tmp = path + ".tmp" + std::to_string(::getpid()); // Shards may race to build it
+    std::unique_ptr<DiskMatrix<FloatType>> ret(new DiskMatrix<FloatType>(tmp, KF_PROF, n, d, PM::stride_for(d), metric, tag));
+    PM view(n, d, ret->row(0));
+    fill(view);
+    standardize(view, metric);
+    ret->sync();
+    if(std::rename(tmp.data(), path.data()))
+        throw std::runtime_error(std::string("Could not rename ") + tmp + " to " + path);
+    return ret;
+}
+
+// Append-only record of finished blocks: one u64 index each, synced after every append.
+// A record torn by a crash mid-write is dropped on loading.
+class BlockCheckpoint {
+    int fd_;
+    std::string path_;
+    std::vector<bool> done_;
+public:
+    static std::vector<bool> load(const std::string &path, size_t nblocks) {
+        std::vector<bool> ret(nblocks);
+        std::FILE *fp = std::fopen(path.data(), "rb");
+        if(fp == nullptr) return ret;
+        for(u64 b; std::fread(&b, sizeof(b), 1, fp) == 1;) {
+            if(b >= nblocks) {
+                std::fclose(fp);
+                throw std::runtime_error(std::string("Block index out of range in checkpoint at ") + path);
+            }
+            ret[b] = true;
+        }
+        std::fclose(fp);
+        return ret;
+    }
+    // Starts over unless resume, syncing the emptied record before returning.
+    BlockCheckpoint(const std::string &path, size_t nblocks, bool resume):
+        fd_(-1), path_(path), done_(resume ? load(path, nblocks): std::vector<bool>(nblocks))
+    {
+        fd_ = ::open(path.data(), O_RDWR | O_CREAT | (resume ? 0: O_TRUNC), 0644);
+        struct stat st;
+        if(fd_ < 0 || ::fstat(fd_, &st) || ::ftruncate(fd_, st.st_size / sizeof(u64) * sizeof(u64)) ||
+           ::lseek(fd_, 0, SEEK_END) < 0 || (!resume && ::fsync(fd_))) {
+            if(fd_ >= 0) ::close(fd_);
+            throw std::runtime_error(std::string("Could not open checkpoint at ") + path);
+        }
+    }
+    BlockCheckpoint(const BlockCheckpoint &) = delete;
+    BlockCheckpoint &operator=(const BlockCheckpoint &) = delete;
+    ~BlockCheckpoint() {::close(fd_);}
+    bool done(size_t b) const {return done_[b];}
+    size_t count() const {return std::count(done_.begin(), done_.end(), true);}
+    void mark(size_t b) {
+        const u64 v = b;
+        if(::write(fd_, &v, sizeof(v)) != ssize_t(sizeof(v)) || ::fsync(fd_))
+            throw std::runtime_error(std::string("Could not update checkpoint at ") + path_);
+        done_[b] = true;
+    }
+    void mark_all() {
+        std::vector<u64> todo;
+        for(size_t b = 0; b < done_.size(); ++b) if(!done_[b]) todo.push_back(b);
+        const ssize_t nb = todo.size() * sizeof(u64);
+        if(::write(fd_, todo.data(), nb) != nb || ::fsync(fd_))
+            throw std::runtime_error(std::string("Could not update checkpoint at ") + path_);
+        std::fill(done_.begin(), done_.end(), true);
+    }
+};
+
+// Blocks of the upper triangle of an n x n matrix, as (row, column) offsets; a block's index
+// in this list is how checkpoints and shards refer to it.
+static inline std::vector<std::pair<size_t, size_t>> matrix_blocks(size_t n) {
+    std::vector<std::pair<size_t, size_t>> ret;
+    for(size_t i = 0; i < n; i += KF_DISTMAT_BLOCK)
+        for(size_t j = i; j < n; j += KF_DISTMAT_BLOCK) ret.emplace_back(i, j);
+    return ret;
+}
+
+static inline std::string shard_path(const std::string &path, unsigned shard, unsigned nshards) {
+    return path + '.' + std::to_string(shard) + "of" + std::to_string(nshards);
+}
+static inline std::string checkpoint_path(const std::string &path) {return path + ".ckpt";}
+
+// Computes the blocks of the all-pairs matrix of standardized profiles m with index % nshards == shard
+// into the matrix at path, writing and checkpointing one block at a time. A matrix already at path
+// from the same inputs is resumed, skipping the blocks its checkpoint records.
+// Memory use is bounded by one block beyond what is mapped. Returns the number of blocks computed.
+template<typename FloatType>
+size_t compute_blocks(const ProfileMatrix<FloatType> &m, Metric metric, u64 tag, const std::string &path,
+                      unsigned shard=0, unsigned nshards=1) {
+    if(shard >= nshards) throw std::runtime_error("Shard index must be less than the number of shards.");
+    const size_t n = m.size();
+    const auto blocks = matrix_blocks(n);
+    const bool resume = disk_matrix_matches<FloatType>(path, KF_DMAT, n, n, metric, tag, KF_DISTMAT_BLOCK);
+    // The checkpoint is emptied before a new matrix is created: a crash between the two then
+    // leaves a matrix with no blocks recorded, rather than one that matches with another's.
+    BlockCheckpoint ckpt(checkpoint_path(path), blocks.size(), resume);
+    std::unique_ptr<DiskMatrix<FloatType>> out(resume ? new DiskMatrix<FloatType>(path, KF_DMAT, true)
+                                                      : new DiskMatrix<FloatType>(path, KF_DMAT, n, n, n, metric, tag, KF_DISTMAT_BLOCK));
+    std::vector<FloatType> buf(size_t(KF_DISTMAT_BLOCK) * KF_DISTMAT_BLOCK);
+    size_t ret = 0;
+    for(size_t b = shard; b < blocks.size(); b += nshards) {
+        if(ckpt.done(b)) continue;
+        const size_t i0 = blocks[b].first, i1 = std::min(n, i0 + KF_DISTMAT_BLOCK),
+                     j0 = blocks[b].second, j1 = std::min(n, j0 + KF_DISTMAT_BLOCK);
+        pairwise_block(m, metric, i0, i1, j0, j1, buf.data(), KF_DISTMAT_BLOCK);
+        for(size_t i = i0; i < i1; ++i)
+            std::copy(&buf[(i - i0) * KF_DISTMAT_BLOCK], &buf[(i - i0) * KF_DISTMAT_BLOCK + j1 - j0], out->row(i) + j0);
+        if(i0 != j0) {
+            for(size_t j = j0; j < j1; ++j)
+                for(size_t i = i0; i < i1; ++i) out->row(j)[i] = buf[(i - i0) * KF_DISTMAT_BLOCK + j - j0];
+            out->sync(j0, j1);
+        }
+        out->sync(i0, i1);
+        ckpt.mark(b), ++ret;
+    }
+    return ret;
+}
+
+static inline std::string profiles_path(const std::string &path) {return path + ".profiles";}
+static inline std::string names_path(const std::string &path) {return path + ".names";}
+
+// The names of a matrix's rows, for update_blocks: the tag of the inputs it was made from, then
+// the names, NUL-terminated in row order. Replaced whole, like the matrix.
+static inline void write_names(const std::string &path, const std::vector<std::string> &names, u64 tag) {
+    const std::string tmp = names_path(path) + ".tmp" + std::to_string(::getpid());
+    std::FILE *fp = std::fopen(tmp.data(), "wb");
+    if(fp == nullptr) throw std::runtime_error(std::string("Could not open file for output at ") + tmp);
+    bool ok = std::fwrite(&tag, sizeof(tag), 1, fp) == 1;
+    for(const auto &name: names) ok = ok && std::fwrite(name.data(), 1, name.size() + 1, fp) == name.size() + 1;
+    if((std::fclose(fp) | !ok) || std::rename(tmp.data(), names_path(path).data()))
+        throw std::runtime_error(std::string("Could not write names to ") + names_path(path));
+}
+// Returns false if path has no names file.
+static inline bool read_names(const std::string &path, std::vector<std::string> &names, u64 &tag) {
+    std::FILE *fp = std::fopen(names_path(path).data(), "rb");
+    if(fp == nullptr) return false;
+    bool ok = std::fread(&tag, sizeof(tag), 1, fp) == 1;
+    names.clear();
+    std::string name;
+    for(int c; ok && (c = std::fgetc(fp)) != EOF;) {
+        if(c) name.push_back(c);
+        else  names.push_back(name), name.clear();
+    }
+    std::fclose(fp);
+    return ok && name.empty();
+}
+
+static constexpr size_t KF_NEW_ROW = size_t(-1);
+
+// Where each of names was in the finished matrix at path, for update_blocks: its row, or
+// KF_NEW_ROW for a name the matrix lacks. A name listed more than once matches its occurrences
+// in order. Returns an empty vector unless the matrix, its profiles and its names (see
+// write_names) agree, the matrix is complete and was computed with this metric and profile
+// dimension, settings(its names) gives the tag it was made with, and some row is kept.
+template<typename FloatType, typename Settings>
+std::vector<size_t> previous_rows(const std::string &path, const std::vector<std::string> &names, size_t d, Metric metric,
+                                  const Settings &settings) {
+    std::vector<size_t> ret;
+    std::vector<std::string> prev;
+    u64 tag;
+    if(!read_names(path, prev, tag) || settings(prev) != tag ||
+       !disk_matrix_matches<FloatType>(path, KF_DMAT, prev.size(), prev.size(), metric, tag, KF_DISTMAT_BLOCK) ||
+       !disk_matrix_matches<FloatType>(profiles_path(path), KF_PROF, prev.size(), d, metric, tag))
+        return ret;
+    const std::vector<bool> done = BlockCheckpoint::load(checkpoint_path(path), matrix_blocks(prev.size()).size());
+    if(std::count(done.begin(), done.end(), false)) return ret;
+    std::unordered_map<std::string, std::vector<size_t>> rows;
+    for(size_t i = prev.size(); i--; rows[prev[i]].push_back(i)); // Each name's rows, last first
+    bool kept = false;
+    for(const auto &name: names) {
+        auto it = rows.find(name);
+        if(it == rows.end() || it->second.empty()) ret.push_back(KF_NEW_ROW);
+        else ret.push_back(it->second.back()), it->second.pop_back(), kept = true;
+    }
+    if(!kept) ret.clear();
+    return ret;
+}
+
+// The standardized profiles for an update from the matrix at path (see previous_rows): rows
+// with a previous row are copied from its profiles, and fill() sets the others, in order, in a
+// zeroed matrix of just those. Replaces the profiles at profiles_path(path) once complete.
+template<typename FloatType, typename Fill>
+std::unique_ptr<DiskMatrix<FloatType>> update_profile_file(const std::string &path, const std::vector<size_t> &prev, size_t d,
+                                                           Metric metric, u64 tag, const Fill &fill) {
+    using PM = ProfileMatrix<FloatType>;
+    const std::string ppath = profiles_path(path), tmp = ppath + ".tmp" + std::to_string(::getpid());
+    const size_t n = prev.size(), added = std::count(prev.begin(), prev.end(), KF_NEW_ROW);
+    std::unique_ptr<DiskMatrix<FloatType>> ret(new DiskMatrix<FloatType>(tmp, KF_PROF, n, d, PM::stride_for(d), metric, tag));
+    {
+        const DiskMatrix<FloatType> old(ppath, KF_PROF);
+        for(size_t i = 0; i < n; ++i)
+            if(prev[i] != KF_NEW_ROW) std::copy(old.row(prev[i]), old.row(prev[i]) + d, ret->row(i));
+    }
+    PM view(added, d);
+    fill(view);
+    standardize(view, metric);
+    for(size_t i = 0, r = 0; i < n; ++i)
+        if(prev[i] == KF_NEW_ROW) std::copy(view.row(r), view.row(r) + d, ret->row(i)), ++r;
+    ret->sync();
+    if(std::rename(tmp.data(), ppath.data()))
+        throw std::runtime_error(std::string("Could not rename ") + tmp + " to " + ppath);
+    return ret;
+}
+
+// Turns the finished matrix at path into the all-pairs matrix of standardized profiles m, where
+// prev[i] is the row m's row i had in it, or KF_NEW_ROW (see previous_rows). Only new rows are
+// compared, against every row, so an update costs O(new x total) comparisons; values between
+// kept rows are copied, and rows whose profiles m lacks are dropped. Since each value depends
+// only on its two profiles, the result is the same as computing m's matrix afresh. The matrix
+// is rebuilt under a temporary name and renamed over path once complete.
+template<typename FloatType>
+void update_blocks(const ProfileMatrix<FloatType> &m, const std::vector<size_t> &prev, Metric metric, u64 tag, const std::string &path) {
+    const size_t n = m.size();
+    if(prev.size() != n) throw std::runtime_error("Need a previous row for every profile.");
+    const DiskMatrix<FloatType> old(path, KF_DMAT);
+    if(old.metric() != metric) throw std::runtime_error(std::string("The matrix at ") + path + " was computed with another metric.");
+    // Runs of kept columns whose previous columns are consecutive, copied at once.
+    struct Run {size_t j, pj, len;};
+    std::vector<Run> runs;
+    std::vector<size_t> added;
+    for(size_t j = 0; j < n; ++j) {
+        if(prev[j] == KF_NEW_ROW) {added.push_back(j); continue;}
+        if(prev[j] >= old.rows()) throw std::runtime_error(std::string("Row out of range for the matrix at ") + path);
+        if(!runs.empty() && runs.back().j + runs.back().len == j && runs.back().pj + runs.back().len == prev[j]) ++runs.back().len;
+        else runs.push_back(Run{j, prev[j], 1});
+    }
+    const std::string tmp = path + ".tmp" + std::to_string(::getpid());
+    DiskMatrix<FloatType> out(tmp, KF_DMAT, n, n, n, metric, tag, KF_DISTMAT_BLOCK);
+    #pragma omp parallel for schedule(dynamic, 64)
+    for(size_t i = 0; i < n; ++i) {
+        if(prev[i] == KF_NEW_ROW) continue;
+        const FloatType *src = old.row(prev[i]);
+        FloatType *dst = out.row(i);
+        for(const Run &r: runs) std::copy(src + r.pj, src + r.pj + r.len, dst + r.j);
+    }
+    if(!added.empty()) {
+        ProfileMatrix<FloatType> a(added.size(), m.dim());
+        for(size_t r = 0; r < added.size(); ++r) std::copy(m.row(added[r]), m.row(added[r]) + m.dim(), a.row(r));
+        std::vector<FloatType> buf(size_t(KF_DISTMAT_BLOCK) * KF_DISTMAT_BLOCK);
+        for(size_t i0 = 0; i0 < added.size(); i0 += KF_DISTMAT_BLOCK) {
+            const size_t i1 = std::min(added.size(), i0 + KF_DISTMAT_BLOCK);
+            for(size_t j0 = 0; j0 < n; j0 += KF_DISTMAT_BLOCK) {
+                const size_t j1 = std::min(n, j0 + KF_DISTMAT_BLOCK);
+                pairwise_block(a, m, metric, i0, i1, j0, j1, buf.data(), KF_DISTMAT_BLOCK);
+                for(size_t i = i0; i < i1; ++i)
+                    std::copy(&buf[(i - i0) * KF_DISTMAT_BLOCK], &buf[(i - i0) * KF_DISTMAT_BLOCK + j1 - j0], out.row(added[i]) + j0);
+                for(size_t j = j0; j < j1; ++j)
+                    for(size_t i = i0; i < i1; ++i) out.row(j)[added[i]] = buf[(i - i0) * KF_DISTMAT_BLOCK + j - j0];
+            }
+        }
+    }
+    out.sync();
+    // Drop the old checkpoint first: a crash before the new one is written then recomputes
+    // the matrix rather than trusting blocks recorded for another one.
+    std::remove(checkpoint_path(path).data());
+    if(std::rename(tmp.data(), path.data()))
+        throw std::runtime_error(std::string("Could not rename ") + tmp + " to " + path);
+    BlockCheckpoint(checkpoint_path(path), matrix_blocks(n).size(), false).mark_all();
+}
+
+// Assembles the matrix at path from the nshards matrices computed by compute_blocks into
+// shard_path(path, i, nshards), copying the blocks each one's checkpoint records.
+// Throws unless every block is found, leaving whatever was at path in place.
+template<typename FloatType>
+void merge_shards(const std::string &path, unsigned nshards) {
+    if(!nshards) throw std::runtime_error("No shards to merge.");
+    const std::string tmp = path + ".tmp" + std::to_string(::getpid());
+    std::unique_ptr<DiskMatrix<FloatType>> out;
+    std::vector<std::pair<size_t, size_t>> blocks;
+    std::vector<bool> found;
+    size_t n = 0;
+    for(unsigned s = 0; s < nshards; ++s) {
+        const std::string sp = shard_path(path, s, nshards);
+        DiskMatrix<FloatType> in(sp, KF_DMAT);
+        const DiskMatrixHeader &h = in.header();
+        if(!out) {
+            if(h.block != KF_DISTMAT_BLOCK)
+                throw std::runtime_error(sp + " was computed with a block size of " + std::to_string(h.block));
+            n = h.rows, blocks = matrix_blocks(n), found.resize(blocks.size());
+            out.reset(new DiskMatrix<FloatType>(tmp, KF_DMAT, n, n, n, in.metric(), h.tag, KF_DISTMAT_BLOCK));
+        } else if(h.rows != n || h.metric != out->header().metric || h.tag != out->header().tag || h.block != KF_DISTMAT_BLOCK) {
+            throw std::runtime_error(sp + " does not belong with " + shard_path(path, 0, nshards));
+        }
+        const std::vector<bool> done = BlockCheckpoint::load(checkpoint_path(sp), blocks.size());
+        for(size_t b = 0; b < blocks.size(); ++b) {
+            if(!done[b] || found[b]) continue;
+            const size_t i0 = blocks[b].first, i1 = std::min(n, i0 + KF_DISTMAT_BLOCK),
+                         j0 = blocks[b].second, j1 = std::min(n, j0 + KF_DISTMAT_BLOCK);
+            for(size_t i = i0; i < i1; ++i) std::copy(in.row(i) + j0, in.row(i) + j1, out->row(i) + j0);
+            if(i0 != j0)
+                for(size_t j = j0; j < j1; ++j) std::copy(in.row(j) + i0, in.row(j) + i1, out->row(j) + i0);
+            found[b] = true;
+        }
+    }
+    const size_t missing = std::count(found.begin(), found.end(), false);
+    if(missing) {
+        std::remove(tmp.data());
+        throw std::runtime_error(std::to_string(missing) + " of " + std::to_string(blocks.size()) + " blocks missing from the shards of " + path);
+    }
+    out->sync();
+    // As in update_blocks, the old checkpoint goes before the matrix it described.
+    std::remove(checkpoint_path(path).data());
+    if(std::rename(tmp.data(), path.data()))
+        throw std::runtime_error(std::string("Could not rename ") + tmp + " to " + path);
+    // The merged matrix is complete; record it so that resuming it is a no-op.
+    BlockCheckpoint(checkpoint_path(path), blocks.size(), false).mark_all();
+}
+
+} // namespace freq
+
+} // namespace kf
@@ -0,0 +1,142 @@
+#pragma once
+#include "kmerutil.h"
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#  include <immintrin.h>
+#  define KF_ENCODE_X86 1
+#else
+#  define KF_ENCODE_X86 0
+#endif
+
+#ifndef KF_ENCODE_CHUNK
+#  define KF_ENCODE_CHUNK 4096u // Bases encoded per call in for_each_run; must be a multiple of 64.
+#endif
+
+namespace kf {
+
+// 2-bit codes as in cstr_lut, with 4 for anything but ACGT/acgt.
+static const uint8_t nuc2code_lut[256] {
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+};
+
+// Each encoder writes a 2-bit code per base to codes (undefined for ambiguous bases)
+// and sets bit i % 64 of ambig[i / 64] for every base i that is not ACGT.
+// Bits past n in the last word are cleared.
+using encode_fn = void (*)(const char *, size_t, uint8_t *, uint64_t *);
+
+static void encode_scalar(const char *s, size_t n, uint8_t *codes, uint64_t *ambig) {
+    for(size_t w = 0; w < n; w += 64) {
+        uint64_t m = 0;
+        for(size_t i = w, e = std::min(n, w + 64); i < e; ++i) {
+            const uint8_t c = nuc2code_lut[(uint8_t)s[i]];
+            codes[i] = c & 3;
+            m |= uint64_t(c >> 2) << (i - w);
+        }
+        ambig[w >> 6] = m;
+    }
+}
+
+#if KF_ENCODE_X86
+// Codes come from the low nibble of each byte (A=1, C=3, G=7, T=4 in either case) with a
+// byte shuffle; validity from comparing the case-folded byte against ACGT.
+__attribute__((target("avx2")))
+static void encode_avx2(const char *s, size_t n, uint8_t *codes, uint64_t *ambig) {
+    const __m256i lut  = _mm256_setr_epi8(0, 0, 0, 1, 3, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0,
+                                          0, 0, 0, 1, 3, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i lo   = _mm256_set1_epi8(0x0F), fold = _mm256_set1_epi8((char)0xDF);
+    const __m256i a = _mm256_set1_epi8('A'), c = _mm256_set1_epi8('C'),
+                  g = _mm256_set1_epi8('G'), t = _mm256_set1_epi8('T');
+    size_t i = 0;
+    for(; i + 64 <= n; i += 64) {
+        uint64_t valid = 0;
+        for(unsigned h = 0; h < 2; ++h) {
+            const __m256i v = _mm256_loadu_si256((const __m256i *)(s + i + (h << 5)));
+            _mm256_storeu_si256((__m256i *)(codes + i + (h << 5)), _mm256_shuffle_epi8(lut, _mm256_and_si256(v, lo)));
+            const __m256i u = _mm256_and_si256(v, fold);
+            const __m256i ok = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(u, a), _mm256_cmpeq_epi8(u, c)),
+                                               _mm256_or_si256(_mm256_cmpeq_epi8(u, g), _mm256_cmpeq_epi8(u, t)));
+            valid |= uint64_t(uint32_t(_mm256_movemask_epi8(ok))) << (h << 5);
+        }
+        ambig[i >> 6] = ~valid;
+    }
+    if(i < n) encode_scalar(s + i, n - i, codes + i, ambig + (i >> 6));
+}
+
+__attribute__((target("sse4.2")))
+static void encode_sse42(const char *s, size_t n, uint8_t *codes, uint64_t *ambig) {
+    const __m128i lut  = _mm_setr_epi8(0, 0, 0, 1, 3, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i lo   = _mm_set1_epi8(0x0F), fold = _mm_set1_epi8((char)0xDF);
+    const __m128i a = _mm_set1_epi8('A'), c = _mm_set1_epi8('C'),
+                  g = _mm_set1_epi8('G'), t = _mm_set1_epi8('T');
+    size_t i = 0;
+    for(; i + 64 <= n; i += 64) {
+        uint64_t valid = 0;
+        for(unsigned q = 0; q < 4; ++q) {
+            const __m128i v = _mm_loadu_si128((const __m128i *)(s + i + (q << 4)));
+            _mm_storeu_si128((__m128i *)(codes + i + (q << 4)), _mm_shuffle_epi8(lut, _mm_and_si128(v, lo)));
+            const __m128i u = _mm_and_si128(v, fold);
+            const __m128i ok = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(u, a), _mm_cmpeq_epi8(u, c)),
+                                            _mm_or_si128(_mm_cmpeq_epi8(u, g), _mm_cmpeq_epi8(u, t)));
+            valid |= uint64_t(uint32_t(_mm_movemask_epi8(ok))) << (q << 4);
+        }
+        ambig[i >> 6] = ~valid;
+    }
+    if(i < n) encode_scalar(s + i, n - i, codes + i, ambig + (i >> 6));
+}
+#endif
+
+static inline encode_fn select_encoder() {
+#if KF_ENCODE_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))   return encode_avx2;
+    if(__builtin_cpu_supports("sse4.2")) return encode_sse42;
+#endif
+    return encode_scalar;
+}
+
+static INLINE void encode_nucleotides(const char *s, size_t n, uint8_t *codes, uint64_t *ambig) {
+    static const encode_fn fn = select_encoder();
+    fn(s, n, codes, ambig);
+}
+
+// Splits s into runs of unambiguous bases.
+// seg(codes, n) receives the 2-bit codes for each piece of a run (runs may arrive in several
+// pieces), and end() is called after each run, including at the end of the sequence.
+template<typename SegFunc, typename EndFunc>
+void for_each_run(const char *s, size_t l, const SegFunc &seg, const EndFunc &end) {
+    static_assert(KF_ENCODE_CHUNK % 64 == 0, "KF_ENCODE_CHUNK must be a multiple of 64.");
+    alignas(64) uint8_t codes[KF_ENCODE_CHUNK];
+    uint64_t ambig[KF_ENCODE_CHUNK / 64];
+    for(size_t off = 0; off < l; off += KF_ENCODE_CHUNK) {
+        const size_t n = std::min(l - off, size_t(KF_ENCODE_CHUNK));
+        encode_nucleotides(s + off, n, codes, ambig);
+        size_t pos = 0;
+        for(size_t w = 0; w < (n + 63) >> 6; ++w) {
+            for(uint64_t m = ambig[w]; m; m &= m - 1) {
+                const size_t p = (w << 6) + __builtin_ctzll(m);
+                if(p > pos) seg(codes + pos, p - pos);
+                end();
+                pos = p + 1;
+            }
+        }
+        if(n > pos) seg(codes + pos, n - pos);
+    }
+    end();
+}
+
+} // namespace kf
@@ -0,0 +1,410 @@
+#pragma once
+#include "kfreq.h"
+#include <algorithm>
+#include <string>
+#include <utility>
+
+#ifndef KF_HASH_LOAD_PCT
+#  define KF_HASH_LOAD_PCT 80u // Tables grow once more than this percentage of slots are used.
+#endif
+#ifndef KF_HASH_BATCH
+#  define KF_HASH_BATCH 16u    // Keys hashed and prefetched together before being counted.
+#endif
+
+namespace kf {
+
+namespace freq {
+
+static const char KFH_BIN [] {'#', 'k', 'f', 'h', 'b', 'i', 'n', '\n'};
+static const char KFH_TEXT [] {'#', 'k', 'f', 'h', 't', 'x', 't', '\n'};
+static const char KFH_CBIN [] {'#', 'k', 'f', 'h', 'c', 'b', 'n', '\n'};
+static const char KFH_CTEXT [] {'#', 'k', 'f', 'h', 'c', 't', 'x', '\n'};
+
+// Murmur3's 64-bit finalizer.
+static INLINE u64 kmer_hash(u64 key) {
+    key ^= key >> 33;
+    key *= UINT64_C(0xff51afd7ed558ccd);
+    key ^= key >> 33;
+    key *= UINT64_C(0xc4ceb9fe1a85ec53);
+    key ^= key >> 33;
+    return key;
+}
+
+// Open-addressing counter from 64-bit keys, with linear probing over cache-line buckets.
+// A bucket holds as many key/count pairs as fit in 64 bytes, so most lookups touch one line.
+// A count of 0 marks an empty slot; entries are never removed, so a probe stops at the first one.
+template<typename SizeType=u64>
+class KmerHashTable {
+public:
+    static constexpr unsigned SLOTS = 64 / (sizeof(u64) + sizeof(SizeType));
+    struct alignas(64) Bucket {
+        u64      keys[SLOTS];
+        SizeType counts[SLOTS];
+    };
+private:
+    std::vector<Bucket, HugePageAllocator<Bucket>> buckets_;
+    size_t n_, limit_;
+    static size_t limit_for(size_t nbuckets) {return nbuckets * SLOTS * KF_HASH_LOAD_PCT / 100;}
+    void grow() {
+        decltype(buckets_) tmp(buckets_.size() << 1, Bucket());
+        tmp.swap(buckets_);
+        limit_ = limit_for(buckets_.size());
+        n_ = 0;
+        for(const auto &b: tmp)
+            for(unsigned j = 0; j < SLOTS && b.counts[j]; ++j)
+                add_hashed(b.keys[j], kmer_hash(b.keys[j]), b.counts[j]);
+    }
+    void add_hashed(u64 key, u64 h, SizeType val) {
+        for(size_t i = h & (buckets_.size() - 1);; i = (i + 1) & (buckets_.size() - 1)) {
+            Bucket &b = buckets_[i];
+            for(unsigned j = 0; j < SLOTS; ++j) {
+                if(b.counts[j] == 0) {
+                    if(n_ == limit_) {
+                        grow();
+                        add_hashed(key, h, val);
+                        return;
+                    }
+                    b.keys[j] = key, b.counts[j] = val, ++n_;
+                    return;
+                }
+                if(b.keys[j] == key) {
+                    b.counts[j] += val;
+                    return;
+                }
+            }
+        }
+    }
+public:
+    KmerHashTable(size_t nbuckets=64): buckets_(roundup(std::max(nbuckets, size_t(2))), Bucket()), n_(0), limit_(limit_for(buckets_.size())) {}
+    static size_t roundup(size_t x) {
+        size_t ret = 1;
+        while(ret < x) ret <<= 1;
+        return ret;
+    }
+    size_t size()     const {return n_;}
+    size_t capacity() const {return buckets_.size() * SLOTS;}
+    SizeType get(u64 key) const {
+        for(size_t i = kmer_hash(key) & (buckets_.size() - 1);; i = (i + 1) & (buckets_.size() - 1)) {
+            const Bucket &b = buckets_[i];
+            for(unsigned j = 0; j < SLOTS; ++j) {
+                if(b.counts[j] == 0)   return 0;
+                if(b.keys[j] == key)   return b.counts[j];
+            }
+        }
+    }
+    void add(u64 key, SizeType val) {if(val) add_hashed(key, kmer_hash(key), val);}
+    void inc(u64 key) {add_hashed(key, kmer_hash(key), 1);}
+    // Adds vals (or 1 if null) to n <= KF_HASH_BATCH keys, prefetching all of their buckets first.
+    void add(const u64 *keys, const SizeType *vals, size_t n) {
+        u64 h[KF_HASH_BATCH];
+        for(size_t i = 0; i < n; ++i) {
+            h[i] = kmer_hash(keys[i]);
+            __builtin_prefetch(&buckets_[h[i] & (buckets_.size() - 1)], 1);
+        }
+        for(size_t i = 0; i < n; ++i) add_hashed(keys[i], h[i], vals ? vals[i]: SizeType(1));
+    }
+    void inc(const u64 *keys, size_t n) {add(keys, nullptr, n);}
+    void reserve(size_t n) {
+        while(limit_ < n) grow();
+    }
+    void clear() {
+        std::fill(buckets_.begin(), buckets_.end(), Bucket());
+        n_ = 0;
+    }
+    // Calls func(key, count) for each entry, in table order.
+    template<typename Func>
+    void for_each(const Func &func) const {
+        for(const auto &b: buckets_)
+            for(unsigned j = 0; j < SLOTS && b.counts[j]; ++j)
+                func(b.keys[j], b.counts[j]);
+    }
+    // Entries sorted by key, for deterministic output.
+    std::vector<std::pair<u64, SizeType>> sorted() const {
+        std::vector<std::pair<u64, SizeType>> ret;
+        ret.reserve(n_);
+        for_each([&ret](u64 key, SizeType val) {ret.emplace_back(key, val);});
+        std::sort(ret.begin(), ret.end());
+        return ret;
+    }
+    KmerHashTable &operator+=(const KmerHashTable &o) {
+        reserve(n_ + o.n_ / 2);
+        o.for_each([this](u64 key, SizeType val) {add(key, val);});
+        return *this;
+    }
+};
+
+// Counts for a single k, up to 32, stored sparsely.
+template<typename SizeType>
+struct HashSubKFreq {
+    using size_type = SizeType;
+    const unsigned k_;
+    KmerHashTable<SizeType> table_;
+    HashSubKFreq(unsigned k): k_(k) {}
+    size_t size() const {return table_.size();}
+    SizeType get(u64 i) const {return table_.get(i);}
+    void inc(u64 i) {table_.inc(i);}
+    void add(u64 i, SizeType val) {table_.add(i, val);}
+    void clear() {table_.clear();}
+    // Folds every k-mer onto its canonical representation, counting palindromes twice as
+    // canonical KFreqList tables do.
+    void rc_collapse() {
+        KmerHashTable<SizeType> tmp(table_.size() / table_.SLOTS);
+        table_.for_each([&](u64 key, SizeType val) {
+            const u64 rc = kf::reverse_complement(key, k_);
+            tmp.add(std::min(key, rc), key == rc ? SizeType(val << 1): val);
+        });
+        std::swap(tmp, table_);
+    }
+    void write(gzFile fp) const {
+        const auto entries(table_.sorted());
+        const u64 n = entries.size();
+        std::vector<char> buf(sizeof(n) + n * (sizeof(u64) + sizeof(SizeType)));
+        char *p = buf.data();
+        std::memcpy(p, &n, sizeof(n)), p += sizeof(n);
+        for(const auto &e: entries)
+            std::memcpy(p, &e.first, sizeof(e.first)), p += sizeof(e.first), std::memcpy(p, &e.second, sizeof(e.second)), p += sizeof(e.second);
+        if(gzwrite(fp, buf.data(), buf.size()) != int(buf.size())) throw std::runtime_error("Could not write table.");
+    }
+    // Formats entries [begin, end) of sorted as "KMER\tcount\n" lines to p; returns the end.
+    char *format(const std::vector<std::pair<u64, SizeType>> &sorted, size_t begin, size_t end, char *p) const {
+        for(size_t i = begin; i < end; ++i) {
+            for(unsigned j = 0; j < k_; ++j) p[j] = "ACGT"[(sorted[i].first >> ((k_ - j - 1) << 1)) & 3];
+            p += k_, *p++ = '\t';
+            p = u64toa(sorted[i].second, p), *p++ = '\n';
+        }
+        return p;
+    }
+    void read(gzFile fp) {
+        clear();
+        u64 n, key;
+        SizeType val;
+        if(gzread(fp, &n, sizeof(n)) != sizeof(n)) throw std::runtime_error("Could not read from file.");
+        table_.reserve(n);
+        while(n--) {
+            if(gzread(fp, &key, sizeof(key)) != sizeof(key) || gzread(fp, &val, sizeof(val)) != sizeof(val))
+                throw std::runtime_error("Could not read from file.");
+            add(key, val);
+        }
+    }
+    HashSubKFreq &operator+=(const HashSubKFreq &o) {
+        if(o.k_ != k_) throw std::runtime_error("Cannot add tables for different k.");
+        table_ += o.table_;
+        return *this;
+    }
+};
+
+// Sparse counterpart to KFreqList for k up to 32, for when 4^k cells would not fit in memory.
+// Only the max k is counted per base, with 64-bit rolling k-mers; lower orders are derived in
+// finalize() from its entries plus the edge k-mers at the end of each run, as in count_maxk.
+// Tables read from a file recover their edge k-mers from the lower tables, so that they add
+// and count like the tables they were written from.
+// Both strands are counted together by folding stranded tables at the end (rc_collapse), after
+// which the tables are complete and only add to other canonical tables.
+template<typename SizeType=u32, typename=typename std::enable_if<std::is_integral<SizeType>::value && std::is_unsigned<SizeType>::value>::type>
+class HashKFreqList {
+    uint16_t maxk_;
+    uint16_t   nk_;
+    bool derived_   = false; // Whether lower tables have been derived from the maxk table and edges_.
+    bool canonical_ = false; // Folded onto canonical k-mers by rc_collapse; edges_ are then unused.
+    std::vector<HashSubKFreq<SizeType>> freqs_;
+    std::vector<HashSubKFreq<SizeType>> edges_; // Edge k-mers for each lower table
+    using FreqType = std::vector<HashSubKFreq<SizeType>>;
+    void init() {
+        if(maxk_ > 32 || maxk_ < 2 || nk_ == 0 || nk_ > maxk_)
+            throw std::runtime_error(std::string("Unsupported k range: max k ") + std::to_string(maxk_) + ", " + std::to_string(nk_) + " k.");
+        for(unsigned k = maxk_ - nk_ + 1; k <= maxk_; ++k) {
+            freqs_.emplace_back(k);
+            if(k < maxk_) edges_.emplace_back(k);
+        }
+    }
+    void derive() {
+        for(size_t j = freqs_.size() - 1; j-- > 0;) {
+            auto &lo = freqs_[j];
+            lo.clear();
+            lo.table_.reserve(freqs_[j + 1].size() + edges_[j].size());
+            lo += edges_[j];
+            u64 keys[KF_HASH_BATCH];
+            SizeType vals[KF_HASH_BATCH];
+            unsigned n = 0;
+            freqs_[j + 1].table_.for_each([&](u64 key, SizeType val) {
+                keys[n] = key >> 2, vals[n] = val;
+                if(++n == KF_HASH_BATCH) lo.table_.add(keys, vals, n), n = 0;
+            });
+            lo.table_.add(keys, vals, n);
+        }
+        derived_ = true;
+    }
+    // Inverts derive(): each lower table less the one above summed over its last base.
+    void recover_edges() {
+        for(size_t j = 0; j + 1 < freqs_.size(); ++j) {
+            const auto &hi = freqs_[j + 1];
+            edges_[j].clear();
+            freqs_[j].table_.for_each([&](u64 key, SizeType val) {
+                const SizeType sum = hi.get(key << 2) + hi.get((key << 2) | 1) + hi.get((key << 2) | 2) + hi.get((key << 2) | 3);
+                if(sum > val) throw std::runtime_error(std::string("Counts for k = ") + std::to_string(freqs_[j].k_) + " are less than those for k + 1 imply.");
+                if(val > sum) edges_[j].add(key, val - sum);
+            });
+        }
+    }
+    void check_stranded() const {
+        if(canonical_) throw std::runtime_error("Cannot count into tables folded by rc_collapse.");
+    }
+public:
+    FreqType       &freqs()       {return freqs_;}
+    const FreqType &freqs() const {return freqs_;}
+    using size_type = SizeType;
+    HashKFreqList(unsigned k, unsigned num_kmers=3): maxk_(k), nk_(num_kmers) {init();}
+    HashKFreqList empty_like() const {return HashKFreqList(maxk_, nk_);}
+    HashKFreqList(const char *path) {
+        gzFile fp = gzopen(path, "rb");
+        if(!fp) throw std::runtime_error(std::string("Could not open file at ") + path);
+        char buf[sizeof(KFH_BIN)];
+        if(gzread(fp, buf, sizeof(buf)) != sizeof(buf)) throw std::runtime_error("Could not read from file.");
+        if(std::memcmp(buf, KFH_BIN, sizeof(buf)) == 0 || (canonical_ = !std::memcmp(buf, KFH_CBIN, sizeof(buf)))) {
+            gzread(fp, &maxk_, sizeof(maxk_));
+            gzread(fp, &nk_, sizeof(nk_));
+            init();
+            for(auto &sf: freqs_) sf.read(fp);
+        } else if(std::memcmp(buf, KFH_TEXT, sizeof(buf)) == 0 || (canonical_ = !std::memcmp(buf, KFH_CTEXT, sizeof(buf)))) {
+            char line[256], kmer[33];
+            unsigned maxk, nk, k;
+            unsigned long long n, val;
+            if(!gzgets(fp, line, sizeof(line)) || std::sscanf(line, "#Max k: %u", &maxk) != 1 ||
+               !gzgets(fp, line, sizeof(line)) || std::sscanf(line, "#nk: %u", &nk) != 1) goto fail;
+            maxk_ = maxk, nk_ = nk;
+            init();
+            for(auto &sf: freqs_) {
+                if(!gzgets(fp, line, sizeof(line)) || std::sscanf(line, "%u: %llu", &k, &n) != 2 || k != sf.k_) goto fail;
+                sf.table_.reserve(n);
+                while(n--) {
+                    if(!gzgets(fp, line, sizeof(line)) || std::sscanf(line, "%32s\t%llu", kmer, &val) != 2) goto fail;
+                    sf.add(str2kmer<u64>(kmer), val);
+                }
+            }
+        } else {
+            buf[sizeof(buf) - 1] = '\0';
+            throw std::runtime_error(std::string("Unexpected magic string: ") + buf);
+        }
+        if(false) {
+            fail:
+            throw std::runtime_error("Error in parsing.");
+        }
+        derived_ = true;
+        gzclose(fp);
+        if(!canonical_) recover_edges();
+    }
+    void process_seq(const char *s, size_t l) {
+        check_stranded();
+        derived_ = false;
+        auto &top = freqs_.back();
+        const u64 mask = __kmask_init(maxk_);
+        u64 v = 0, keys[KF_HASH_BATCH];
+        unsigned f = 0, nkeys = 0; // f: bases seen in the current run, saturating at maxk - 1
+        for_each_run(s, l, [&](const uint8_t *codes, size_t n) {
+            size_t i = 0;
+            for(; f < maxk_ - 1u && i < n; ++i) v = (v << 2) | codes[i], ++f;
+            for(; i < n; ++i) {
+                keys[nkeys++] = v = ((v << 2) | codes[i]) & mask;
+                if(nkeys == KF_HASH_BATCH) top.table_.inc(keys, nkeys), nkeys = 0;
+            }
+        }, [&]() {
+            for(auto &e: edges_) if(e.k_ <= f) e.inc(v & __kmask_init(e.k_));
+            v = f = 0;
+        });
+        top.table_.inc(keys, nkeys);
+    }
+    // Reads through a SeqPipeline when using several threads or if stats are requested.
+    void add(const char *path, kseq_t *ks=nullptr, unsigned nthreads=1, PipelineStats *stats=nullptr) {
+        if(nthreads > 1 || stats) {
+            parallel_add(*this, path, nthreads, ks, stats);
+            return;
+        }
+        KSeqBatchReader reader(path, ks);
+        SeqBatch batch;
+        while(reader.next(batch))
+            for(size_t i = 0; i < batch.size(); ++i) process_seq(batch.seq(i), batch.len(i));
+        finalize();
+    }
+    // Lower-order tables are only complete after finalize(), which add() calls.
+    void finalize() {
+        if(!derived_) derive();
+    }
+    void flush() {}
+    void clear() {
+        for(auto &freq: freqs_) freq.clear();
+        for(auto &freq: edges_) freq.clear();
+        derived_ = canonical_ = false;
+    }
+    // Adds each k-mer's count to its reverse complement's, keeping one of the two (the lesser),
+    // in every table. Finalizes first.
+    void rc_collapse() {
+        if(canonical_) return;
+        finalize();
+        for(auto &freq: freqs_) freq.rc_collapse();
+        for(auto &freq: edges_) freq.clear();
+        canonical_ = true;
+    }
+    HashKFreqList &operator+=(const HashKFreqList &o) {
+        if(o.maxk_ != maxk_ || o.nk_ != nk_ || o.canonical_ != canonical_)
+            throw std::runtime_error("Cannot add HashKFreqLists with different k ranges or strandedness.");
+        if(canonical_) {
+            for(size_t i(0); i < freqs_.size(); ++i) freqs_[i] += o.freqs_[i];
+            return *this;
+        }
+        freqs_.back() += o.freqs_.back();
+        for(size_t i(0); i < edges_.size(); ++i) edges_[i] += o.edges_[i];
+        derived_ = false;
+        return *this;
+    }
+    // Text is BGZF, sorted by k-mer and formatted on nthreads threads, as for the dense tables; see textio.h.
+    void write(const char *path, bool emit_binary=false, unsigned nthreads=1) {
+        finalize();
+        if(!emit_binary) {
+            std::vector<std::vector<std::pair<u64, SizeType>>> sorted;
+            struct Task {size_t t, begin, end;};
+            std::vector<Task> tasks;
+            for(size_t t = 0; t < freqs_.size(); ++t) {
+                sorted.push_back(freqs_[t].table_.sorted());
+                const size_t n = sorted.back().size();
+                for(size_t i = 0; i == 0 || i < n; i += KF_WRITE_CHUNK) tasks.push_back(Task{t, i, std::min(n, i + size_t(KF_WRITE_CHUNK))});
+            }
+            const std::string header = std::string(canonical_ ? KFH_CTEXT: KFH_TEXT, sizeof(KFH_TEXT)) +
+                                       "#Max k: " + std::to_string(maxk_) + "\n#nk: " + std::to_string(nk_) + '\n';
+            write_bgzf_text(path, header, tasks.size(), [&](size_t j, std::vector<char> &text) {
+                const Task &task = tasks[j];
+                const auto &sf = freqs_[task.t];
+                text.resize((task.end - task.begin) * (sf.k_ + 22) + 48);
+                char *p = text.data();
+                if(!task.begin) p = u64toa(sf.k_, p), *p++ = ':', *p++ = ' ', p = u64toa(sorted[task.t].size(), p), *p++ = '\n';
+                return static_cast<const char *>(sf.format(sorted[task.t], task.begin, task.end, p));
+            }, nthreads);
+            return;
+        }
+        gzFile fp = gzopen(path, "wb");
+        if(fp == nullptr) throw std::runtime_error("Could not open file for output.");
+        gzwrite(fp, (void *)(canonical_ ? KFH_CBIN: KFH_BIN), sizeof(KFH_BIN));
+        gzwrite(fp, (void *)&maxk_, sizeof(maxk_));
+        gzwrite(fp, (void *)&nk_, sizeof(nk_));
+        for(const auto &freq: freqs_) freq.write(fp);
+        gzclose(fp);
+    }
+    SizeType count(const std::string &str) const {
+        return count(str.size(), str2kmer<u64>(str));
+    }
+    SizeType count(unsigned k, u64 value) const {
+        return table(k).get(canonical_ ? canonical_representation(value, k): value);
+    }
+    const HashSubKFreq<SizeType> &table(unsigned k) const {
+        if(k < mink() || k > maxk_) throw std::runtime_error(std::string("No table for k = ") + std::to_string(k));
+        return freqs_[k - mink()];
+    }
+    unsigned mink() const {return maxk_ - nk_ + 1;}
+    unsigned maxk() const {return maxk_;}
+    unsigned nk()   const {return nk_;}
+    bool canonical() const {return canonical_;}
+};
+using KFH = HashKFreqList<u32>;
+
+} // namespace freq
+
+} // namespace kf
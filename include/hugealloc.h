@@ -0,0 +1,68 @@
+#pragma once
+#include <cstdio>
+#include <cstdlib>
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef KF_USE_HUGEPAGES
+#  ifdef MADV_HUGEPAGE
+#    define KF_USE_HUGEPAGES 1
+#  else
+#    define KF_USE_HUGEPAGES 0
+#  endif
+#endif
+
+namespace kf {
+
+// Cache-line aligned allocator which asks for transparent huge pages on large allocations.
+// Advice has to be given before the pages are first touched, which is why counting tables
+// take it as an allocator instead of calling madvise after the vector has been zeroed.
+// Disable with -DKF_USE_HUGEPAGES=0.
+template<typename T>
+struct HugePageAllocator {
+    using value_type = T;
+    static constexpr size_t HUGE_PAGE_SIZE = size_t(1) << 21;
+    static constexpr size_t CACHE_LINE_SIZE = 64;
+    HugePageAllocator() = default;
+    template<typename U> HugePageAllocator(const HugePageAllocator<U> &) {}
+    T *allocate(size_t n) {
+        if(n > std::numeric_limits<size_t>::max() / sizeof(T)) throw std::bad_alloc();
+        const size_t nb = n * sizeof(T);
+        const bool huge = KF_USE_HUGEPAGES && nb >= HUGE_PAGE_SIZE;
+        void *ret;
+        if(posix_memalign(&ret, huge ? size_t(HUGE_PAGE_SIZE): size_t(CACHE_LINE_SIZE), nb)) throw std::bad_alloc();
+#if KF_USE_HUGEPAGES
+        if(huge) madvise(ret, nb, MADV_HUGEPAGE);
+#endif
+        return static_cast<T *>(ret);
+    }
+    void deallocate(T *p, size_t) {std::free(p);}
+    template<typename U> bool operator==(const HugePageAllocator<U> &) const {return true;}
+    template<typename U> bool operator!=(const HugePageAllocator<U> &) const {return false;}
+};
+
+// Bytes of memory available to allocate without swapping: MemAvailable from /proc/meminfo, or
+// free physical pages where that is missing. 0 if neither can be read.
+static inline size_t available_memory() {
+    if(std::FILE *fp = std::fopen("/proc/meminfo", "r")) {
+        char line[256];
+        unsigned long long kb;
+        while(std::fgets(line, sizeof(line), fp)) {
+            if(std::sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+                std::fclose(fp);
+                return size_t(kb) << 10;
+            }
+        }
+        std::fclose(fp);
+    }
+#ifdef _SC_AVPHYS_PAGES
+    const long pages = sysconf(_SC_AVPHYS_PAGES), page = sysconf(_SC_PAGESIZE);
+    if(pages > 0 && page > 0) return size_t(pages) * size_t(page);
+#endif
+    return 0;
+}
+
+} // namespace kf
@@ -0,0 +1,212 @@
+#pragma once
+#include "hugealloc.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifndef KF_DIST_TILE
+#  define KF_DIST_TILE 32u    // Profiles per tile of the output; a multiple of 4
+#endif
+#ifndef KF_DIST_DEPTH
+#  define KF_DIST_DEPTH 1024u // Values of each profile per pass over a tile, sized so both tiles stay in L2
+#endif
+
+namespace kf {
+
+namespace freq {
+
+enum Metric {
+    PEARSON   = 0,
+    COSINE    = 1,
+    EUCLIDEAN = 2
+};
+
+static inline Metric metric_from_name(const std::string &name) {
+    if(name == "pearson")   return PEARSON;
+    if(name == "cosine")    return COSINE;
+    if(name == "euclidean") return EUCLIDEAN;
+    throw std::runtime_error(std::string("Unknown metric ") + name);
+}
+
+// What a profile holds for each k-mer it covers: its z-score (see calc_zscores), its count, or
+// its count as a fraction of all k-mers counted for that k.
+enum ProfileValues {
+    ZSCORES     = 0,
+    COUNTS      = 1,
+    FREQUENCIES = 2
+};
+
+static inline ProfileValues values_from_name(const std::string &name) {
+    if(name == "zscores") return ZSCORES;
+    if(name == "counts")  return COUNTS;
+    if(name == "freqs")   return FREQUENCIES;
+    throw std::runtime_error(std::string("Unknown profile values ") + name);
+}
+
+// Profiles stored as rows of one contiguous, zero-padded matrix, so that all pairs can be
+// compared as a single blocked matrix product. Rows are padded to whole cache lines, and the
+// row count to a multiple of 4 for the 4x4 kernel below.
+// The matrix either owns its storage or is a view of storage laid out the same way, such as
+// a mapped file (see distmat.h).
+template<typename FloatType>
+class ProfileMatrix {
+    static_assert(std::is_floating_point<FloatType>::value, "ProfileMatrix needs a floating-point type.");
+    size_t n_, d_, stride_;
+    std::vector<FloatType, HugePageAllocator<FloatType>> owned_;
+    FloatType *data_;
+public:
+    static size_t stride_for(size_t d) {
+        static constexpr size_t PER_LINE = 64 / sizeof(FloatType);
+        return (d + PER_LINE - 1) / PER_LINE * PER_LINE;
+    }
+    static size_t padded_rows(size_t n) {return (n + 3) & ~size_t(3);}
+    ProfileMatrix(size_t n, size_t d):
+        n_(n), d_(d), stride_(stride_for(d)), owned_(padded_rows(n) * stride_), data_(owned_.data()) {}
+    // View of padded_rows(n) rows of stride_for(d) values at data, zeroed past each row's d values.
+    ProfileMatrix(size_t n, size_t d, FloatType *data): n_(n), d_(d), stride_(stride_for(d)), data_(data) {}
+    ProfileMatrix(ProfileMatrix &&) = default;
+    ProfileMatrix(const ProfileMatrix &) = delete;
+    ProfileMatrix &operator=(const ProfileMatrix &) = delete;
+    size_t size() const {return n_;}
+    size_t dim()  const {return d_;}
+    size_t stride() const {return stride_;}
+    FloatType       *row(size_t i)       {return data_ + i * stride_;}
+    const FloatType *row(size_t i) const {return data_ + i * stride_;}
+    template<typename Container>
+    void set_row(size_t i, const Container &vals) {
+        if(vals.size() != d_) throw std::runtime_error(std::string("Profile has ") + std::to_string(vals.size()) + " values, not " + std::to_string(d_));
+        std::copy(vals.begin(), vals.end(), row(i));
+    }
+};
+
+// Rescales each row in place so that the dot product of two rows gives their similarity:
+// Pearson's r after centering and scaling to unit length, and cosine similarity after scaling.
+// Euclidean rows are left as they are. Constant (or all-zero) rows become zero, correlating
+// at 0 with everything.
+template<typename FloatType>
+void standardize_row(FloatType *r, size_t d, Metric metric) {
+    if(metric == EUCLIDEAN) return;
+    double sum = 0., ss = 0.;
+    if(metric == PEARSON) {
+        for(size_t j = 0; j < d; ++j) sum += r[j];
+        const FloatType mean = sum / d;
+        for(size_t j = 0; j < d; ++j) r[j] -= mean;
+    }
+    for(size_t j = 0; j < d; ++j) ss += double(r[j]) * r[j];
+    const FloatType scale = ss > 0. ? 1. / std::sqrt(ss): 0.;
+    for(size_t j = 0; j < d; ++j) r[j] *= scale;
+}
+template<typename FloatType>
+void standardize(ProfileMatrix<FloatType> &m, Metric metric) {
+    if(metric == EUCLIDEAN) return;
+    #pragma omp parallel for schedule(dynamic)
+    for(size_t i = 0; i < m.size(); ++i) standardize_row(m.row(i), m.dim(), metric);
+}
+
+// Squared differences are summed directly rather than expanded into norms and a dot product,
+// which would cancel catastrophically for near-identical profiles.
+template<bool SquaredDiff, typename FloatType>
+static inline FloatType pair_term(FloatType x, FloatType y) {return SquaredDiff ? (x - y) * (x - y): x * y;}
+
+// Adds the dot products (or summed squared differences) of rows a[0..3] with rows b[0..3]
+// over n values to acc (row stride lda).
+template<bool SquaredDiff, typename FloatType>
+static inline void dot4x4(const FloatType *a, const FloatType *b, size_t stride, size_t n, double *acc, size_t lda) {
+    const FloatType *a0 = a, *a1 = a + stride, *a2 = a1 + stride, *a3 = a2 + stride;
+    const FloatType *b0 = b, *b1 = b + stride, *b2 = b1 + stride, *b3 = b2 + stride;
+    FloatType s00 = 0, s01 = 0, s02 = 0, s03 = 0, s10 = 0, s11 = 0, s12 = 0, s13 = 0,
+              s20 = 0, s21 = 0, s22 = 0, s23 = 0, s30 = 0, s31 = 0, s32 = 0, s33 = 0;
+    #pragma omp simd reduction(+:s00,s01,s02,s03,s10,s11,s12,s13,s20,s21,s22,s23,s30,s31,s32,s33)
+    for(size_t k = 0; k < n; ++k) {
+        const FloatType x0 = a0[k], x1 = a1[k], x2 = a2[k], x3 = a3[k];
+        const FloatType y0 = b0[k], y1 = b1[k], y2 = b2[k], y3 = b3[k];
+#define KF_PT(x, y) pair_term<SquaredDiff>(x, y)
+        s00 += KF_PT(x0, y0), s01 += KF_PT(x0, y1), s02 += KF_PT(x0, y2), s03 += KF_PT(x0, y3);
+        s10 += KF_PT(x1, y0), s11 += KF_PT(x1, y1), s12 += KF_PT(x1, y2), s13 += KF_PT(x1, y3);
+        s20 += KF_PT(x2, y0), s21 += KF_PT(x2, y1), s22 += KF_PT(x2, y2), s23 += KF_PT(x2, y3);
+        s30 += KF_PT(x3, y0), s31 += KF_PT(x3, y1), s32 += KF_PT(x3, y2), s33 += KF_PT(x3, y3);
+#undef KF_PT
+    }
+    acc[0]           += s00, acc[1]           += s01, acc[2]           += s02, acc[3]           += s03;
+    acc[lda]         += s10, acc[lda + 1]     += s11, acc[lda + 2]     += s12, acc[lda + 3]     += s13;
+    acc[2 * lda]     += s20, acc[2 * lda + 1] += s21, acc[2 * lda + 2] += s22, acc[2 * lda + 3] += s23;
+    acc[3 * lda]     += s30, acc[3 * lda + 1] += s31, acc[3 * lda + 2] += s32, acc[3 * lda + 3] += s33;
+}
+
+// Dot products (or summed squared differences) of rows [i0, i0 + KF_DIST_TILE) of a with rows
+// [j0, j0 + KF_DIST_TILE) of b, clipped to their rows, into acc. The depth is walked in KF_DIST_DEPTH
+// slices so that both tiles' slices stay in cache while every pair is visited; partial sums
+// are kept in double, whatever FloatType is.
+template<bool SquaredDiff, typename FloatType>
+void gram_tile(const ProfileMatrix<FloatType> &a, const ProfileMatrix<FloatType> &b, size_t i0, size_t j0, double *acc) {
+    static_assert(KF_DIST_TILE % 4 == 0, "KF_DIST_TILE must be a multiple of 4.");
+    using PM = ProfileMatrix<FloatType>;
+    const size_t ni = std::min(PM::padded_rows(a.size()) - i0, size_t(KF_DIST_TILE)),
+                 nj = std::min(PM::padded_rows(b.size()) - j0, size_t(KF_DIST_TILE));
+    const bool diag = &a == &b && i0 == j0;
+    std::fill(acc, acc + KF_DIST_TILE * KF_DIST_TILE, 0.);
+    for(size_t k = 0; k < a.dim(); k += KF_DIST_DEPTH) {
+        const size_t n = std::min(size_t(KF_DIST_DEPTH), a.dim() - k);
+        for(size_t i = 0; i < ni; i += 4)
+            for(size_t j = diag ? i: 0; j < nj; j += 4)
+                dot4x4<SquaredDiff>(a.row(i0 + i) + k, b.row(j0 + j) + k, a.stride(), n, acc + i * KF_DIST_TILE + j, KF_DIST_TILE);
+    }
+}
+
+// Values between rows [i0, i1) of standardized a and rows [j0, j1) of standardized b, into
+// out[(i - i0) * ld + j - j0]: similarities (Pearson, cosine) or distances (Euclidean).
+// A block on the diagonal of one matrix (a and b the same, i0 == j0 and i1 == j1) has only its
+// upper triangle computed, then mirrored. Each value depends only on its two rows, so a pair
+// comes out the same from any block holding it. Runs one KF_DIST_TILE-square tile per task.
+template<typename FloatType>
+void pairwise_block(const ProfileMatrix<FloatType> &a, const ProfileMatrix<FloatType> &b, Metric metric,
+                    size_t i0, size_t i1, size_t j0, size_t j1, FloatType *out, size_t ld) {
+    if(a.dim() != b.dim()) throw std::runtime_error("Profiles to compare differ in dimension.");
+    const bool diag = &a == &b && i0 == j0;
+    std::vector<std::pair<size_t, size_t>> tiles;
+    for(size_t i = i0; i < i1; i += KF_DIST_TILE)
+        for(size_t j = diag ? i: j0; j < j1; j += KF_DIST_TILE) tiles.emplace_back(i, j);
+    #pragma omp parallel
+    {
+        std::vector<double> acc(KF_DIST_TILE * KF_DIST_TILE);
+        #pragma omp for schedule(dynamic)
+        for(size_t t = 0; t < tiles.size(); ++t) {
+            const size_t ti = tiles[t].first, tj = tiles[t].second;
+            if(metric == EUCLIDEAN) gram_tile<true>(a, b, ti, tj, acc.data());
+            else                    gram_tile<false>(a, b, ti, tj, acc.data());
+            const bool dtile = diag && ti == tj;
+            for(size_t i = ti; i < std::min(i1, ti + KF_DIST_TILE); ++i) {
+                for(size_t j = dtile ? i: tj; j < std::min(j1, tj + KF_DIST_TILE); ++j) {
+                    const double v = acc[(i - ti) * KF_DIST_TILE + j - tj];
+                    out[(i - i0) * ld + j - j0] = metric == EUCLIDEAN ? std::sqrt(v): std::min(std::max(v, -1.), 1.);
+                    if(diag) out[(j - j0) * ld + i - i0] = out[(i - i0) * ld + j - j0];
+                }
+            }
+        }
+    }
+}
+template<typename FloatType>
+void pairwise_block(const ProfileMatrix<FloatType> &m, Metric metric, size_t i0, size_t i1, size_t j0, size_t j1,
+                    FloatType *out, size_t ld) {
+    pairwise_block(m, m, metric, i0, i1, j0, j1, out, ld);
+}
+
+// All-pairs similarity (Pearson, cosine) or distance (Euclidean) between the rows of m, as a
+// row-major size() x size() matrix. Computed like the Gram matrix of the standardized rows.
+// Standardizes m in place.
+template<typename FloatType>
+std::vector<FloatType> pairwise(ProfileMatrix<FloatType> &m, Metric metric) {
+    const size_t n = m.size();
+    standardize(m, metric);
+    std::vector<FloatType> ret(n * n);
+    pairwise_block(m, metric, 0, n, 0, n, ret.data(), n);
+    return ret;
+}
+
+} // namespace freq
+
+} // namespace kf
@@ -0,0 +1,140 @@
+#pragma once
+#include "kmerutil.h"
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef KF_MAP_ALIGN
+#  define KF_MAP_ALIGN 64u // Alignment of the header and of every table section, in bytes.
+#endif
+
+namespace kf {
+
+namespace freq {
+
+// Uncompressed count files which are mapped and used in place instead of being read.
+// A fixed-size header records the k range, count width and strandedness along with the byte
+// offset of each table; each table is a row of full-width counts (canonical_size(k) of them
+// for canonical tables) starting on a KF_MAP_ALIGN boundary. Fields are in host byte order,
+// so a file written on a machine of the other endianness fails the version check.
+static const char KF_MAP [] {'#', 'k', 'f', 'm', 'a', 'p', '\n', '\0'};
+static constexpr u32 KF_MAP_VERSION = 1;
+static constexpr unsigned KF_MAP_MAXK = 32;
+
+struct alignas(KF_MAP_ALIGN) KFMapHeader {
+    char     magic[sizeof(KF_MAP)];
+    u32      version;
+    uint16_t mink, maxk;
+    uint8_t  count_bytes; // Width of each count
+    uint8_t  canonical;
+    uint8_t  reserved[6];
+    u64      file_bytes;
+    u64      offsets[KF_MAP_MAXK]; // Byte offset of the table for k = mink + i
+};
+
+static inline u64 map_align(u64 off) {return (off + KF_MAP_ALIGN - 1) / KF_MAP_ALIGN * KF_MAP_ALIGN;}
+
+static inline bool is_mapped_file(const char *path) {
+    char buf[sizeof(KF_MAP)];
+    std::FILE *fp = std::fopen(path, "rb");
+    if(fp == nullptr) throw std::runtime_error(std::string("Could not open file at ") + path);
+    const bool ret = std::fread(buf, 1, sizeof(buf), fp) == sizeof(buf) && !std::memcmp(buf, KF_MAP, sizeof(buf));
+    std::fclose(fp);
+    return ret;
+}
+
+// Writes tables (consecutive k, ascending) in the mapped format.
+template<typename SFType>
+void write_mapped(const char *path, const std::vector<SFType> &freqs, bool canonical) {
+    using size_type = typename SFType::size_type;
+    if(freqs.empty() || freqs.size() > KF_MAP_MAXK) throw std::runtime_error("Unsupported number of tables for the mapped format.");
+    KFMapHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, KF_MAP, sizeof(KF_MAP));
+    h.version = KF_MAP_VERSION;
+    h.mink = freqs.front().k_, h.maxk = freqs.back().k_;
+    h.count_bytes = sizeof(size_type);
+    h.canonical = canonical;
+    u64 off = sizeof(h);
+    for(size_t i = 0; i < freqs.size(); ++i)
+        h.offsets[i] = off = map_align(off), off += freqs[i].size() * sizeof(size_type);
+    h.file_bytes = off;
+    std::FILE *fp = std::fopen(path, "wb");
+    if(fp == nullptr) throw std::runtime_error(std::string("Could not open file for output at ") + path);
+    static const char zeros[KF_MAP_ALIGN] {};
+    bool ok = std::fwrite(&h, sizeof(h), 1, fp) == 1;
+    off = sizeof(h);
+    for(size_t i = 0; ok && i < freqs.size(); ++i) {
+        ok = std::fwrite(zeros, 1, h.offsets[i] - off, fp) == h.offsets[i] - off;
+        freqs[i].write_counts([&](const void *data, size_t nb) {ok = ok && std::fwrite(data, 1, nb, fp) == nb;});
+        off = h.offsets[i] + freqs[i].size() * sizeof(size_type);
+    }
+    if(std::fclose(fp) || !ok) throw std::runtime_error(std::string("Could not write mapped tables to ") + path);
+}
+
+// Read-only mapping of a whole file of at least min_size bytes.
+class ReadOnlyMap {
+    void  *data_;
+    size_t size_;
+public:
+    ReadOnlyMap(const char *path, size_t min_size): data_(nullptr), size_(0) {
+        const int fd = ::open(path, O_RDONLY);
+        if(fd < 0) throw std::runtime_error(std::string("Could not open file at ") + path);
+        struct stat st;
+        if(::fstat(fd, &st) || size_t(st.st_size) < min_size) {
+            ::close(fd);
+            throw std::runtime_error(std::string("Truncated file at ") + path);
+        }
+        size_ = st.st_size;
+        void *p = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if(p == MAP_FAILED) throw std::runtime_error(std::string("Could not map file at ") + path);
+        data_ = p;
+    }
+    ReadOnlyMap(const ReadOnlyMap &) = delete;
+    ReadOnlyMap &operator=(const ReadOnlyMap &) = delete;
+    ~ReadOnlyMap() {::munmap(data_, size_);}
+    const void *data() const {return data_;}
+    size_t size() const {return size_;}
+};
+
+// Read-only mapping of a file in the mapped format. The header is checked on opening,
+// and each table's bounds when it is looked up.
+class MappedFile {
+    ReadOnlyMap map_;
+public:
+    MappedFile(const char *path): map_(path, sizeof(KFMapHeader)) {
+        const KFMapHeader &h = header();
+        const char *err = nullptr;
+        if(std::memcmp(h.magic, KF_MAP, sizeof(KF_MAP)))             err = "Unexpected magic string";
+        else if(h.version != KF_MAP_VERSION)                          err = "Unsupported version or byte order";
+        else if(h.file_bytes != map_.size())                          err = "Size does not match header";
+        else if(!h.mink || h.mink > h.maxk || h.maxk - h.mink >= int(KF_MAP_MAXK)) err = "Invalid k range";
+        if(err) throw std::runtime_error(std::string(err) + " in mapped table file at " + path);
+    }
+    const KFMapHeader &header() const {return *static_cast<const KFMapHeader *>(map_.data());}
+    // n: number of counts expected in the table.
+    template<typename SizeType>
+    const SizeType *table(unsigned k, size_t n) const {
+        const KFMapHeader &h = header();
+        if(h.count_bytes != sizeof(SizeType))
+            throw std::runtime_error(std::string("Mapped counts are ") + std::to_string(h.count_bytes * CHAR_BIT) +
+                                     " bits wide, not " + std::to_string(sizeof(SizeType) * CHAR_BIT));
+        if(k < h.mink || k > h.maxk) throw std::runtime_error(std::string("No table for k = ") + std::to_string(k));
+        const u64 off = h.offsets[k - h.mink];
+        if(off % KF_MAP_ALIGN || off < sizeof(h) || off + n * sizeof(SizeType) > map_.size())
+            throw std::runtime_error(std::string("Table for k = ") + std::to_string(k) + " lies outside of the mapped file");
+        return reinterpret_cast<const SizeType *>(static_cast<const char *>(map_.data()) + off);
+    }
+};
+
+} // namespace freq
+
+} // namespace kf
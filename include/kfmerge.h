@@ -0,0 +1,124 @@
+#pragma once
+#include "kfreq.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef KF_MERGE_CHUNK
+#  define KF_MERGE_CHUNK (1u << 16) // Counts per table summed per task when merging
+#endif
+
+namespace kf {
+
+namespace freq {
+
+// dst[i] += src[i] for i in [0, n). Returns whether any sum overflowed Out.
+template<typename Out, typename In>
+bool add_counts(Out *dst, const In *src, size_t n) {
+    unsigned overflow = 0;
+    #pragma omp simd reduction(|:overflow)
+    for(size_t i = 0; i < n; ++i) {
+        const Out s = src[i], d = dst[i] + s;
+        overflow |= unsigned(d < s) | unsigned(In(s) != src[i]);
+        dst[i] = d;
+    }
+    return overflow;
+}
+
+// A count file, as written by KFreqArray::write or KFreqList::write, for merging. Files in the
+// mapped format are used in place at the width they were written with; text and older binary
+// files are read into memory at 64 bits.
+class CountFile {
+    std::shared_ptr<const MappedFile> map_;
+    std::unique_ptr<KFreqArray<u64>> kfa_;
+    std::unique_ptr<KFreqList<u64>>  kfl_;
+public:
+    unsigned mink, maxk, count_bytes;
+    bool canonical;
+    CountFile(const char *path) {
+        if(is_mapped_file(path)) {
+            map_ = std::make_shared<const MappedFile>(path);
+            const KFMapHeader &h = map_->header();
+            mink = h.mink, maxk = h.maxk, count_bytes = h.count_bytes, canonical = h.canonical;
+            if(count_bytes != 4 && count_bytes != 8)
+                throw std::runtime_error(std::string("Unsupported count width in ") + path);
+            return;
+        }
+        gzFile fp = gzopen(path, "rb");
+        if(fp == nullptr) throw std::runtime_error(std::string("Could not open file at ") + path);
+        char buf[4];
+        const bool list = gzread(fp, buf, sizeof(buf)) == sizeof(buf) && !std::memcmp(buf, "#kfl", sizeof(buf));
+        gzclose(fp);
+        if(list) kfl_.reset(new KFreqList<u64>(path));
+        else     kfa_.reset(new KFreqArray<u64>(path));
+        mink = list ? kfl_->mink(): 1, maxk = list ? kfl_->maxk(): kfa_->maxk(), count_bytes = 8;
+        canonical = list ? kfl_->canonical(): kfa_->canonical();
+    }
+    bool mapped() const {return map_ != nullptr;}
+    // The table for k, count_bytes wide per count.
+    const void *table(unsigned k) const {
+        const size_t n = canonical ? canonical_size(k): size_t(1) << (k << 1);
+        if(map_) return count_bytes == 4 ? static_cast<const void *>(map_->table<u32>(k, n)): map_->table<u64>(k, n);
+        return kfl_ ? kfl_->table(k).data_.data(): kfa_->table(k).data_.data();
+    }
+};
+
+// Adds the counts in each of paths (see CountFile) into out's tables, as if the inputs behind
+// them had been counted together, e.g. for a read set counted in shards on several machines.
+// Every file must hold out's k range and strandedness, and mapped files must share one count
+// width, no wider than out's. Mapped files are summed together KF_MERGE_CHUNK counts at a time,
+// in parallel across tables and chunks; others are read one at a time and added in the same way.
+// out must have full-width cells and not be in maxk-only mode. Throws if a count overflows.
+template<typename KFType>
+void merge_counts(const std::vector<std::string> &paths, KFType &out, unsigned nthreads=1) {
+    using SizeType = typename KFType::size_type;
+    static_assert(!std::remove_reference<decltype(out.freqs().front())>::type::compact, "Merged tables need full-width cells.");
+    if(out.maxk_only()) throw std::runtime_error("Cannot merge into tables counted in maxk-only mode.");
+    struct Task {unsigned j; size_t begin, end;};
+    std::vector<Task> tasks;
+    auto &freqs = out.freqs();
+    for(unsigned j = 0; j < freqs.size(); ++j)
+        for(size_t i = 0; i < freqs[j].size(); i += KF_MERGE_CHUNK) tasks.push_back(Task{j, i, std::min(freqs[j].size(), i + size_t(KF_MERGE_CHUNK))});
+    auto add = [&](const std::vector<const CountFile *> &files) {
+        unsigned overflow = 0;
+        #pragma omp parallel for schedule(dynamic) num_threads(std::max(nthreads, 1u)) reduction(|:overflow)
+        for(size_t t = 0; t < tasks.size(); ++t) {
+            const Task &task = tasks[t];
+            const unsigned k = freqs[task.j].k_;
+            SizeType *dst = freqs[task.j].data_.data() + task.begin;
+            for(const CountFile *f: files) {
+                const void *src = f->table(k);
+                overflow |= f->count_bytes == 4 ? add_counts(dst, static_cast<const u32 *>(src) + task.begin, task.end - task.begin)
+                                                : add_counts(dst, static_cast<const u64 *>(src) + task.begin, task.end - task.begin);
+            }
+        }
+        if(overflow)
+            throw std::runtime_error(std::string("Merged counts overflow ") + std::to_string(sizeof(SizeType) * CHAR_BIT) + " bits.");
+    };
+    unsigned mapped_bytes = 0;
+    auto check = [&](const CountFile &f, const std::string &path) {
+        if(f.mink != out.mink() || f.maxk != out.maxk() || f.canonical != out.canonical())
+            throw std::runtime_error(path + " holds " + (f.canonical ? "canonical": "stranded") + " tables for k = " + std::to_string(f.mink) +
+                                     " to " + std::to_string(f.maxk) + ", not " + (out.canonical() ? "canonical": "stranded") +
+                                     " tables for k = " + std::to_string(out.mink()) + " to " + std::to_string(out.maxk()));
+        if(!f.mapped()) return;
+        if(!mapped_bytes) mapped_bytes = f.count_bytes;
+        if(f.count_bytes != mapped_bytes || f.count_bytes > sizeof(SizeType))
+            throw std::runtime_error(path + " has " + std::to_string(f.count_bytes * CHAR_BIT) + "-bit counts, not " +
+                                     std::to_string((f.count_bytes != mapped_bytes ? mapped_bytes: sizeof(SizeType)) * CHAR_BIT));
+    };
+    std::vector<std::unique_ptr<CountFile>> mapped;
+    for(const auto &path: paths) {
+        std::unique_ptr<CountFile> f(new CountFile(path.data()));
+        check(*f, path);
+        if(f->mapped()) mapped.push_back(std::move(f));
+        else            add(std::vector<const CountFile *>{f.get()});
+    }
+    std::vector<const CountFile *> files;
+    for(const auto &f: mapped) files.push_back(f.get());
+    if(!files.empty()) add(files);
+}
+
+} // namespace freq
+
+} // namespace kf
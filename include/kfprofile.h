@@ -0,0 +1,310 @@
+#pragma once
+#include "kfreq.h"
+#include "kfdist.h"
+#include "scheduler.h"
+#include "sharedtable.h"
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace kf {
+
+namespace freq {
+
+// Length of profiles holding the z-scores for every k in [mink, maxk].
+static inline size_t profile_dim(unsigned mink, unsigned maxk, bool canonical) {
+    size_t ret = 0;
+    for(unsigned k = mink; k <= maxk; ++k) ret += zscore_size(k, canonical);
+    return ret;
+}
+
+// Ignores each input's z-scores; see profile_files_as.
+struct NoEmit {
+    template<typename FloatType>
+    size_t operator()(size_t, const FloatType *, size_t) const {return 0;}
+};
+
+#ifndef KF_TABLE_MEM_FRACTION
+#  define KF_TABLE_MEM_FRACTION 0.75 // Share of available memory counting tables may take before threads share them
+#endif
+#ifndef KF_SHARE_TABLES
+#  define KF_SHARE_TABLES -1         // 1 always shares tables between threads counting an input, 0 never, -1 when memory is short
+#endif
+
+// How many tables to count with, and whether threads counting the same input share its table.
+struct TablePlan {
+    unsigned ntables;
+    bool shared;
+};
+
+// Private tables are fastest, but take up to two per thread: one for the thread's own input and
+// one for helping with another's (see SharedInput). table_bytes is a table's size once promoted,
+// as compact tables may become on large inputs and shared max-k tables always do. If that many do not fit
+// in KF_TABLE_MEM_FRACTION of available memory, threads share the table of whichever input they
+// count, and only as many inputs are counted at once as there are tables that fit.
+// Sharing needs max-k-only counting (see SharedCounter).
+static inline TablePlan plan_tables(size_t table_bytes, unsigned nthreads, size_t ninputs, bool maxk_only) {
+    const unsigned want = std::max<size_t>(std::min<size_t>(nthreads, ninputs), 1);
+    if(!maxk_only || KF_SHARE_TABLES == 0) return TablePlan{want, false};
+    const size_t avail = available_memory(), fit = avail * KF_TABLE_MEM_FRACTION / std::max<size_t>(table_bytes, 1);
+    if(KF_SHARE_TABLES < 0 && (!avail || fit >= 2 * size_t(nthreads) - 1)) return TablePlan{want, false};
+    return TablePlan{unsigned(std::max<size_t>(std::min<size_t>(fit, want), 1)), true};
+}
+
+// An input being counted that idle workers can join. Everyone counting it takes whole batches
+// from one SeqPipeline. With private tables, each counts into a table of its own; once the input
+// is exhausted, the owner adds the helpers' tables into its own, as parallel_add does, and only
+// then lets the helpers go. With a shared table, everyone counts into the owner's max-k table
+// through a SharedCounter, and the owner adds the lower-order k-mers they set aside.
+template<typename KFType>
+class SharedInput {
+    using SFType = typename std::decay<decltype(std::declval<KFType &>().freqs().back())>::type;
+    SeqPipeline pipe_;
+    std::unique_ptr<SharedTable<SFType>> shared_;
+    const std::vector<SFType> *freqs_ = nullptr; // The owner's tables, when shared
+    bool canonical_ = false;
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::vector<KFType *> tables_;             // Helpers' tables, waiting to be added
+    std::vector<std::vector<u32>> edges_;      // Lower-order cells set aside while sharing
+    unsigned counting_ = 1;                    // Owner and helpers yet to finish
+    bool open_ = true, merged_ = false;
+    template<typename Fn>
+    void each_seq(double *count_time, const Fn &fn) {
+        while(SeqBatch *pb = pipe_.next()) {
+            StageTimer t(count_time);
+            for(size_t i = 0; i < pb->size(); ++i) fn(pb->seq(i), pb->len(i));
+            KF_STAT(Progress::get().add_bases(pb->size(), pb->bases()));
+            pipe_.release(pb);
+        }
+    }
+    void count_shared(double *count_time) {
+        SharedCounter<SFType> sc(*shared_, *freqs_, canonical_);
+        each_seq(count_time, [&](const char *s, size_t l) {sc.process_seq(s, l);});
+        {
+            StageTimer t(count_time);
+            sc.flush();
+        }
+        auto edges = sc.edges();
+        std::lock_guard<std::mutex> lock(m_);
+        if(edges_.empty()) edges_.resize(edges.size());
+        for(size_t j = 0; j < edges.size(); ++j) edges_[j].insert(edges_[j].end(), edges[j].begin(), edges[j].end());
+    }
+public:
+    const size_t size;
+    // If owner is given, everyone counting this input shares its table, which must be empty.
+    SharedInput(const char *path, size_t size, unsigned nthreads, KFType *owner=nullptr):
+        pipe_(path, KF_BATCH_BASES, nthreads), size(size)
+    {
+        if(owner) {
+            shared_.reset(new SharedTable<SFType>(owner->freqs().back()));
+            freqs_ = &owner->freqs(), canonical_ = owner->canonical();
+        }
+    }
+    bool shared() const {return shared_ != nullptr;}
+    // Returns false once the input is exhausted. On success, *load is the input's bytes per
+    // thread counting it, counting this one.
+    bool join(double *load) {
+        std::lock_guard<std::mutex> lock(m_);
+        if(!open_) return false;
+        *load = double(size) / ++counting_;
+        return true;
+    }
+    double load() {
+        std::lock_guard<std::mutex> lock(m_);
+        return open_ ? double(size) / counting_: -1.;
+    }
+    // For the owner: counts batches into kf until the input is exhausted, adding the time taken to *count_time.
+    void count(KFType &kf, double *count_time) {
+        if(shared_) count_shared(count_time);
+        else        each_seq(count_time, [&](const char *s, size_t l) {kf.process_seq(s, l);});
+    }
+    // For a helper: counts until the input is exhausted, then leaves, adding the time spent
+    // counting to *busy. Without a shared table, counts into local, hands it to the owner and
+    // waits until it has been added; local may be null otherwise.
+    void help(KFType *local, double *busy, double *count_time) {
+        {
+            StageTimer t(busy);
+            if(shared_) count_shared(count_time);
+            else        count(*local, count_time);
+        }
+        std::unique_lock<std::mutex> lock(m_);
+        --counting_;
+        if(shared_) {
+            cv_.notify_all();
+            return;
+        }
+        tables_.push_back(local);
+        cv_.notify_all();
+        cv_.wait(lock, [this]() {return merged_;});
+    }
+    // For the owner, after count(): waits for the helpers, adds what they counted into kf and lets
+    // them go, adding the time spent adding to *busy. Returns the statistics of reading the input.
+    PipelineStats finish(KFType &kf, double *busy) {
+        {
+            std::unique_lock<std::mutex> lock(m_);
+            open_ = false, --counting_;
+            cv_.wait(lock, [this]() {return !counting_;});
+            StageTimer t(busy);
+            for(KFType *p: tables_) p->flush(), kf += *p;
+            for(size_t j = 0; j < edges_.size(); ++j)
+                for(const u32 i: edges_[j]) kf.freqs()[j].inc(i);
+            merged_ = true;
+        }
+        cv_.notify_all();
+        StageTimer t(busy);
+        kf.finalize();
+        return pipe_.stats();
+    }
+};
+
+// Counts each of paths with a KFType and scores it for every k in [mink, maxk] (see calc_zscores)
+// into row i of profiles, or into a scratch buffer if profiles is null. emit(i, zscores, dim) is
+// then called from the thread that scored input i, returning the number of bytes it wrote.
+// Inputs are handed out largest first by an InputScheduler, each counted by the thread taking it
+// into a table from a pool, reused between inputs. Threads left without an input, or without a
+// table to count one in, join those still being counted (see SharedInput), the least helped for
+// its size first, so a few large inputs at the end, or fewer inputs than threads, still keep
+// every thread counting. plan_tables sizes the pool and decides whether helpers share tables.
+// If stats is given, it gets one PipelineStats per thread, each with the time spent counting,
+// scoring and emitting, and the time spent busy and idle, from which the balance can be read.
+template<typename KFType, typename FloatType, typename Emit=NoEmit>
+void profile_files_as(const std::vector<std::string> &paths, unsigned mink, unsigned maxk, unsigned nthreads, bool canonical,
+                      bool maxk_only, ProfileMatrix<FloatType> *profiles, const Emit &emit=Emit(), std::vector<PipelineStats> *stats=nullptr) {
+    using Input = SharedInput<KFType>;
+    if(!nthreads) nthreads = 1;
+    if(stats) stats->assign(nthreads, PipelineStats());
+    const size_t dim = profile_dim(mink, maxk, canonical);
+    if(profiles && (profiles->size() != paths.size() || profiles->dim() != dim))
+        throw std::runtime_error("Profile matrix does not match the inputs.");
+    // BGZF inputs are inflated across their share of the threads when there are too few inputs to go
+    // round, so that the inflate teams of the inputs open at once add up to no more than nthreads.
+    const unsigned inflate_threads = paths.size() < nthreads ? nthreads / std::max<size_t>(paths.size(), 1): 1;
+    InputScheduler sched(input_sizes(paths), nthreads);
+    std::vector<std::unique_ptr<KFType>> kfcs;
+    kfcs.emplace_back(new KFType(maxk, maxk_only, canonical));
+    const TablePlan plan = plan_tables(kfcs[0]->max_bytes(), nthreads, paths.size(), maxk_only);
+    while(kfcs.size() < plan.ntables) kfcs.emplace_back(new KFType(kfcs[0]->empty_like()));
+    std::vector<std::unique_ptr<KFType>> helps(plan.shared ? 0: nthreads);
+    std::vector<std::vector<FloatType>> zbufs(profiles ? 0: nthreads, std::vector<FloatType>(dim));
+    std::mutex active_mutex;
+    std::condition_variable changed;
+    std::vector<std::shared_ptr<Input>> active; // Inputs being counted, which idle threads may join
+    std::vector<KFType *> free_tables;
+    for(const auto &p: kfcs) free_tables.push_back(p.get());
+    size_t unstarted = paths.size();
+    bool handed_out = false;
+    auto process = [&](size_t i, KFType &kfc, unsigned tid, PipelineStats *st) {
+        double *busy = st ? &st->busy_time: nullptr;
+        auto in = std::make_shared<Input>(paths[i].data(), sched.size(i), inflate_threads, plan.shared ? &kfc: nullptr);
+        {
+            std::lock_guard<std::mutex> lock(active_mutex);
+            active.push_back(in), --unstarted;
+        }
+        changed.notify_all();
+        {
+            StageTimer t(busy);
+            in->count(kfc, st ? &st->count_time: nullptr);
+        }
+        const PipelineStats ps = in->finish(kfc, busy);
+        {
+            std::lock_guard<std::mutex> lock(active_mutex);
+            active.erase(std::find(active.begin(), active.end(), in));
+        }
+        StageTimer t(busy);
+        if(st) *st += ps;
+        FloatType *zs = profiles ? profiles->row(i): zbufs[tid].data();
+        {
+            StageTimer t(st ? &st->zscore_time: nullptr);
+            calc_zscores(kfc, mink, maxk, zs);
+        }
+        {
+            StageTimer t(st ? &st->emit_time: nullptr);
+            const size_t nb = emit(i, static_cast<const FloatType *>(zs), dim);
+            KF_STAT(if(st) st->bytes_out += nb);
+            (void)nb;
+        }
+        kfc.clear();
+        KF_STAT(Progress::get().add_file());
+    };
+    // Either takes the next input and a table to count it in, or joins the open input with the most
+    // bytes per thread counting it, waiting for tables to free up or inputs to start as need be.
+    // Returns false once there is nothing left to do.
+    auto next = [&](unsigned tid, size_t &i, KFType *&table, std::shared_ptr<Input> &help) {
+        std::unique_lock<std::mutex> lock(active_mutex);
+        for(;;) {
+            if(!handed_out && !free_tables.empty()) {
+                if(sched.next(tid, i)) {
+                    table = free_tables.back(), free_tables.pop_back();
+                    return true;
+                }
+                handed_out = true;
+            }
+            double most = -1.;
+            for(const auto &in: active) {
+                const double load = in->load();
+                if(load > most) most = load, help = in;
+            }
+            if(help && help->join(&most)) return true;
+            help.reset();
+            if(!unstarted) return false;
+            changed.wait(lock);
+        }
+    };
+    const auto start = std::chrono::steady_clock::now();
+    #pragma omp parallel num_threads(nthreads)
+    {
+#ifdef _OPENMP
+        const unsigned tid = omp_get_thread_num();
+#else
+        const unsigned tid = 0;
+#endif
+        PipelineStats *st = stats ? &(*stats)[tid]: nullptr;
+        size_t i;
+        KFType *table;
+        std::shared_ptr<Input> in;
+        while(next(tid, i, table, in)) {
+            if(!in) {
+                process(i, *table, tid, st);
+                {
+                    std::lock_guard<std::mutex> lock(active_mutex);
+                    free_tables.push_back(table);
+                }
+                changed.notify_all();
+                continue;
+            }
+            KFType *local = nullptr;
+            if(!in->shared()) {
+                if(!helps[tid]) helps[tid].reset(new KFType(kfcs[0]->empty_like()));
+                local = helps[tid].get();
+            }
+            in->help(local, st ? &st->busy_time: nullptr, st ? &st->count_time: nullptr);
+            if(local) local->clear();
+            in.reset();
+        }
+    }
+    if(stats) {
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        for(auto &st: *stats) st.idle_time = std::max(elapsed - st.busy_time, 0.);
+    }
+}
+
+// As profile_files_as, counting into cells of cell_bits (8, 16 or 32) bits; see KFreqArray.
+template<typename FloatType, typename Emit=NoEmit>
+void profile_files(const std::vector<std::string> &paths, unsigned mink, unsigned maxk, unsigned nthreads, bool canonical,
+                   bool maxk_only, unsigned cell_bits, ProfileMatrix<FloatType> *profiles, const Emit &emit=Emit(),
+                   std::vector<PipelineStats> *stats=nullptr) {
+    switch(cell_bits) {
+        case 8:  profile_files_as<KFreqArray<u32, uint8_t>>(paths, mink, maxk, nthreads, canonical, maxk_only, profiles, emit, stats);  break;
+        case 16: profile_files_as<KFreqArray<u32, uint16_t>>(paths, mink, maxk, nthreads, canonical, maxk_only, profiles, emit, stats); break;
+        case 32: profile_files_as<KFC>(paths, mink, maxk, nthreads, canonical, maxk_only, profiles, emit, stats); break;
+        default: throw std::runtime_error(std::string("Unsupported cell width ") + std::to_string(cell_bits));
+    }
+}
+
+} // namespace freq
+
+} // namespace kf
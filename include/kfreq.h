@@ -1,42 +1,36 @@
 #pragma once
 #include "kmerutil.h"
+#include "blocked.h"
+#include "encode.h"
+#include "hugealloc.h"
+#include "kfmap.h"
+#include "pipeline.h"
+#include "textio.h"
 #include <numeric>
+#include <chrono>
 #include <climits>
 #include <cmath>
 #include <cstring>
+#include <future>
 #include <limits>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <unordered_map>
 #include <vector>
+#ifdef _OPENMP
+#  include <omp.h>
+#endif
 
 namespace kf {
 
-static inline void kseq_assign(kseq_t *ks, gzFile fp) {
-    if(!ks->f) {
-        ks->f = (kstream_t*)calloc(1, sizeof(kstream_t));
-        ks->f->buf = (unsigned char*)malloc(KSTREAM_SIZE);
-    } else ks->f->is_eof = ks->f->begin = ks->f->end = 0;
-    ks->f->f = fp;
-}
-
-static inline kseq_t kseq_init_stack() {
-    kseq_t ret;
-    std::memset(&ret, 0, sizeof(ret));
-    return ret;
-}
-static inline void kseq_destroy_stack(kseq_t &ks) {
-    free(ks.name.s); free(ks.comment.s); free(ks.seq.s); free(ks.qual.s);
-    ks_destroy(ks.f);
-}
-
-
-
 namespace freq {
 
 template<typename FloatType, typename=typename std::enable_if<std::is_floating_point<FloatType>::value>::type>
 double pearsonr_naive(const std::vector<FloatType> &v1, const std::vector<FloatType> &v2) {
-    // This is far from the fastest way to perform this task. See https://github.com/dnbaker/vec/blob/master/stats.h for an accelerated pearsonr implementation.
-    const auto m1(std::accumulate(v1.cbegin(), v1.cend(), static_cast<FloatType>(0))),
-               m2(std::accumulate(v2.cbegin(), v2.cend(), static_cast<FloatType>(0)));
+    // Reference implementation; pairwise() in kfdist.h computes all pairs at once.
+    const auto m1(std::accumulate(v1.cbegin(), v1.cend(), static_cast<FloatType>(0)) / v1.size()),
+               m2(std::accumulate(v2.cbegin(), v2.cend(), static_cast<FloatType>(0)) / v2.size());
     FloatType sd = 0., s1s = 0., s2s = 0., val1, val2;
     for(size_t i(0); i < v1.size(); ++i) {
         val1 = v1[i] - m1, val2 = v2[i] - m2;
@@ -56,6 +50,10 @@ static const char KF_BIN [] {'#', 'k', 'f', 'b', 'i', 'n', '\n'};
 static const char KF_TEXT [] {'#', 'k', 'f', 't', 'x', 't', '\n'};
 static const char KFL_BIN [] {'#', 'k', 'f', 'l', 'b', 'i', 'n', '\n'};
 static const char KFL_TEXT [] {'#', 'k', 'f', 'l', 't', 'x', 't', '\n'};
+static const char KF_CBIN [] {'#', 'k', 'f', 'c', 'b', 'n', '\n'};
+static const char KF_CTEXT [] {'#', 'k', 'f', 'c', 't', 'x', '\n'};
+static const char KFL_CBIN [] {'#', 'k', 'f', 'l', 'c', 'b', 'n', '\n'};
+static const char KFL_CTEXT [] {'#', 'k', 'f', 'l', 'c', 't', 'x', '\n'};
 
 template<typename SizeType=std::size_t>
 inline SizeType str2kmer(const std::string &str) {
@@ -78,132 +76,563 @@ static INLINE u32 reverse_complement(u32 kmer, uint8_t n) {
     return (((u32)-1) - kmer) >> (CHAR_BIT * sizeof(kmer) - (n << 1));
 }
 
-template<typename SizeType, typename=typename std::enable_if<std::is_integral<SizeType>::value && std::is_unsigned<SizeType>::value>::type>
+#define __kmask32(k) (UINT32_C(-1) >> (32 - ((k) << 1)))
+
+// Canonical tables keep one cell per reverse-complement pair, holding the count of the k-mer
+// plus that of its reverse complement, so palindromes (even k only) count twice.
+// For odd k, the stored orientation is the one with A or C as its middle base, and the index
+// is the k-mer with that base's high bit dropped.
+// For even k, bases pair up symmetrically around the middle; the innermost pair which is not
+// complementary picks the orientation (6 of its 16 values are stored as is, 6 flipped).
+// Cells are grouped by the number d of complementary pairs inside it, each group taking
+// 6 * 4^(k-d-2) cells, followed by the 4^(k/2) palindromes. Everything is shifts and masks,
+// as a branch on the pairs would mispredict for a quarter of all k-mers.
+static INLINE u64 canonical_size(unsigned k) {
+    return ((UINT64_C(1) << (k << 1)) + (k & 1 ? 0: UINT64_C(1) << k)) >> 1;
+}
+// Pair (left base << 2 | right base) -> 0-5: stored rank; 6-11: rank + 6 of the reverse
+// complement; 12-15: complementary pairs.
+static const uint8_t canonical_pair_class[16] {0, 1, 2, 12, 3, 4, 13, 8, 5, 14, 10, 7, 15, 11, 9, 6};
+
+// v is a k-mer, and rc its reverse complement.
+static INLINE u32 canonical_index_odd(u32 v, u32 rc, unsigned k) {
+    const u32 x = v ^ ((v ^ rc) & -((v >> k) & 1)); // Bit k is the high bit of the middle base.
+    return ((x >> (k + 1)) << k) | (x & ((UINT32_C(1) << k) - 1));
+}
+static INLINE u32 canonical_index_even(u32 v, u32 rc, unsigned k) {
+    // The right half of v and rc agree up to the first non-complementary pair.
+    const u32 diff = (v ^ rc) & ((UINT32_C(1) << k) - 1);
+    if(__builtin_expect(diff == 0, 0)) return (UINT32_C(1) << ((k << 1) - 1)) - (UINT32_C(1) << (k - 1)) + (v >> k);
+    const unsigned d2 = (__builtin_clz(diff) - (32 - k)) & ~1u; // Bits in each half of the complementary core
+    const unsigned pl = k + d2, outer = k - 2 - d2;             // Low bits of the pair's left and right bases
+    const unsigned cls = canonical_pair_class[(((v >> pl) & 3) << 2) | ((v >> outer) & 3)];
+    const u32 flip = -u32(cls >= 6), x = v ^ ((v ^ rc) & flip);
+    u32 ret = ((cls - (6 & flip)) << d2) | ((x >> k) & ((UINT32_C(1) << d2) - 1));
+    ret = (ret << outer) | u32(u64(x) >> (pl + 2));
+    ret = (ret << outer) | (x & ((UINT32_C(1) << outer) - 1));
+    return ret + (UINT32_C(1) << ((k << 1) - 1)) - (UINT32_C(1) << ((k << 1) - 1 - d2));
+}
+static INLINE u32 canonical_index(u32 v, u32 rc, unsigned k) {
+    return k & 1 ? canonical_index_odd(v, rc, k): canonical_index_even(v, rc, k);
+}
+static INLINE u32 canonical_index(u32 v, unsigned k) {return canonical_index(v, reverse_complement(v, k), k);}
+// Whether v is the orientation stored in canonical tables (always true for palindromes).
+static INLINE bool is_canonical(u32 v, unsigned k) {
+    if(k & 1) return !((v >> k) & 1);
+    const u32 diff = (v ^ reverse_complement(v, k)) & ((UINT32_C(1) << k) - 1);
+    if(diff == 0) return true;
+    const unsigned d2 = (__builtin_clz(diff) - (32 - k)) & ~1u;
+    return canonical_pair_class[(((v >> (k + d2)) & 3) << 2) | ((v >> (k - 2 - d2)) & 3)] < 6;
+}
+
+#ifndef KF_PROMOTE_FRACTION
+#  define KF_PROMOTE_FRACTION 64u // Compact tables are widened once over 1 / KF_PROMOTE_FRACTION of their cells overflow.
+#endif
+#ifndef KF_COMPACT_MIN_BYTES
+#  define KF_COMPACT_MIN_BYTES (1u << 20) // Tables smaller than this at full width start out wide.
+#endif
+
+// Counts for a single k.
+// CellType may be narrower than SizeType to save memory. Saturated cells then keep their excess
+// in spill_, and a table which spills too often is promoted to full-width cells in wide_, so
+// that small, dense tables end up wide while large, sparse ones stay compact. Tables which are
+// small at full width start out wide, as the saturation check would cost more than it saves.
+// Go through get/inc/add/set rather than data_ unless CellType == SizeType.
+// Canonical tables are indexed by canonical_index; see index().
+// Tables opened from a mapped file read their full-width counts from it and are read-only.
+template<typename SizeType, typename CellType=SizeType,
+         typename=typename std::enable_if<std::is_integral<SizeType>::value && std::is_unsigned<SizeType>::value &&
+                                          std::is_integral<CellType>::value && std::is_unsigned<CellType>::value &&
+                                          sizeof(CellType) <= sizeof(SizeType)>::type>
 struct SubKFreq {
+    using size_type = SizeType;
+    using cell_type = CellType;
+    static constexpr bool compact = sizeof(CellType) < sizeof(SizeType);
+    static constexpr CellType CELL_MAX = std::numeric_limits<CellType>::max();
+
     const unsigned k_; // Kmer size
     u32            v_; // Value
     uint8_t        f_; // How full?
-    std::vector<SizeType> data_;
-    SubKFreq(unsigned k): k_(k), v_(0), f_(0), data_(1ull << (k << 1)) {
+    const bool     canonical_;
+    const SizeType *map_; // Counts in a mapped file, if any; see kfmap.h
+    std::vector<CellType, HugePageAllocator<CellType>> data_;
+    std::vector<SizeType, HugePageAllocator<SizeType>> wide_;  // Cells after promotion
+    std::unordered_map<u32, SizeType>                  spill_; // Excess over CELL_MAX for saturated cells
+    SubKFreq(unsigned k, bool canonical=false): k_(k), v_(0), f_(0), canonical_(canonical), map_(nullptr), data_(size()) {
+        if(compact && starts_wide()) promote();
+    }
+    SubKFreq(unsigned k, bool canonical, const MappedFile &map):
+        k_(k), v_(0), f_(0), canonical_(canonical), map_(map.table<SizeType>(k, size())) {}
+    size_t size() const {return canonical_ ? canonical_size(k_): size_t(1) << (k_ << 1);}
+    // Cell holding the count for kmer.
+    size_t index(u32 kmer) const {return canonical_ ? canonical_index(kmer, k_): kmer;}
+    bool starts_wide() const {return size() * sizeof(SizeType) < KF_COMPACT_MIN_BYTES;}
+    bool promoted() const {return compact && !wide_.empty();}
+    bool mapped() const {return map_ != nullptr;}
+    SizeType get(size_t i) const {
+        if(map_) return map_[i];
+        if(!compact) return data_[i];
+        if(promoted()) return wide_[i];
+        if(data_[i] != CELL_MAX) return data_[i];
+        const auto it(spill_.find(i));
+        return SizeType(CELL_MAX) + (it == spill_.end() ? SizeType(0): it->second);
+    }
+    void inc(size_t i) {
+        if(!compact)                 ++data_[i];
+        else if(promoted())          ++wide_[i];
+        else if(!++data_[i]) { // Wrapped around from CELL_MAX
+            data_[i] = CELL_MAX;
+            ++spill_[i];
+            if(spill_.size() > size() / KF_PROMOTE_FRACTION) promote();
+        }
+    }
+    // inc() for hot loops: keeps the cell pointer in a register, which compilers will not do
+    // across calls to inc() since any of them may promote the table.
+    class Incrementer {
+        SubKFreq &t_;
+        CellType *cells_; // nullptr once promoted
+        SizeType *wide_;  // nullptr until promoted
+    public:
+        Incrementer(SubKFreq &t): t_(t), cells_(t.promoted() ? nullptr: t.data_.data()),
+                                  wide_(t.promoted() ? t.wide_.data(): nullptr) {}
+        INLINE void operator()(size_t i) {
+            if(!compact || !cells_) {
+                if(!compact) ++cells_[i];
+                else         ++wide_[i];
+            } else if(!++cells_[i]) {
+                --cells_[i];
+                t_.inc(i);
+                if(t_.promoted()) cells_ = nullptr, wide_ = t_.wide_.data();
+            }
+        }
+    };
+    void set(size_t i, SizeType val) {
+        if(!compact) data_[i] = val;
+        else if(promoted()) wide_[i] = val;
+        else if(val < CELL_MAX) {
+            if(data_[i] == CELL_MAX) spill_.erase(i);
+            data_[i] = val;
+        } else {
+            data_[i] = CELL_MAX;
+            if(val == CELL_MAX) spill_.erase(i);
+            else {
+                spill_[i] = val - CELL_MAX;
+                if(spill_.size() > size() / KF_PROMOTE_FRACTION) promote();
+            }
+        }
+    }
+    // inc() for threads sharing the table, each holding cells none of the others touch. Compact
+    // tables are promoted before they are shared (see SharedTable), so no cell spills or moves.
+    void inc_shared(size_t i) {
+        if(!compact) ++data_[i];
+        else         ++wide_[i];
+    }
+    // Bytes held by the cells.
+    size_t bytes() const {return data_.capacity() * sizeof(CellType) + wide_.capacity() * sizeof(SizeType);}
+    // Bytes the cells may come to hold: compact tables widen to SizeType when promoted.
+    size_t max_bytes() const {return map_ ? 0: size() * sizeof(SizeType);}
+    void add(size_t i, SizeType val) {
+        if(!compact) data_[i] += val;
+        else if(promoted()) wide_[i] += val;
+        else set(i, get(i) + val);
+    }
+    void promote() {
+        decltype(wide_) tmp(size());
+        for(size_t i = 0; i < tmp.size(); ++i) tmp[i] = get(i);
+        wide_.swap(tmp);
+        decltype(data_)().swap(data_);
+        spill_.clear();
     }
     void clear_kmer() {
         f_ = v_ = 0;
     }
     void clear() {
         clear_kmer();
+        if(promoted() && !starts_wide()) {
+            decltype(wide_)().swap(wide_);
+            data_.resize(size());
+        }
         std::fill(std::begin(data_), std::end(data_), 0);
+        std::fill(std::begin(wide_), std::end(wide_), 0);
+        spill_.clear();
+    }
+    // Counts of cells [i, i + n) into out, choosing where to read them from once rather than per cell.
+    template<typename T>
+    void get_range(size_t i, size_t n, T *out) const {
+        if(map_)            std::copy(map_ + i, map_ + i + n, out);
+        else if(!compact)   std::copy(data_.data() + i, data_.data() + i + n, out);
+        else if(promoted()) std::copy(wide_.data() + i, wide_.data() + i + n, out);
+        else {
+            std::copy(data_.data() + i, data_.data() + i + n, out);
+            if(!spill_.empty())
+                for(size_t j = 0; j < n; ++j) if(data_[i + j] == CELL_MAX) out[j] = get(i + j);
+        }
+    }
+    // Hands the table's counts to fn(data, nbytes) in order, always at full width, whatever the cells.
+    template<typename WriteFn>
+    void write_counts(const WriteFn &fn) const {
+        if(map_) fn(map_, size() * sizeof(SizeType));
+        else if(!compact) fn(data_.data(), data_.size() * sizeof(SizeType));
+        else if(promoted()) fn(wide_.data(), wide_.size() * sizeof(SizeType));
+        else {
+            std::vector<SizeType> buf(std::min(size(), size_t(1) << 16));
+            for(size_t i = 0; i < size(); i += buf.size()) {
+                const size_t n = std::min(buf.size(), size() - i);
+                get_range(i, n, buf.data());
+                fn(buf.data(), n * sizeof(SizeType));
+            }
+        }
     }
     void write(gzFile fp) const {
-        gzwrite(fp, (void *)data_.data(), data_.size() * sizeof(SizeType));
+        write_counts([fp](const void *data, size_t nb) {gzwrite(fp, data, nb);});
 #if !NDEBUG
         std::fprintf(stderr, "For k = %u:", k_);
-        for(const auto &el: data_) {
-            std::fprintf(stderr, "%u|", (unsigned)el);
+        for(size_t i = 0; i < size(); ++i) {
+            std::fprintf(stderr, "%u|", (unsigned)get(i));
         }
         std::fputc('\n', stderr);
 #endif
     }
+    void read(gzFile fp) {
+        clear();
+        if(!compact) gzread(fp, data_.data(), data_.size() * sizeof(SizeType));
+        else {
+            std::vector<SizeType> buf(std::min(size(), size_t(1) << 16));
+            for(size_t i = 0; i < size(); i += buf.size()) {
+                const size_t n = std::min(buf.size(), size() - i);
+                gzread(fp, buf.data(), n * sizeof(SizeType));
+                for(size_t j = 0; j < n; ++j) set(i + j, buf[j]);
+            }
+        }
+    }
+    // o is read through get(), as its counts may be in a mapped file rather than in data_.
+    SubKFreq &operator+=(const SubKFreq &o) {
+        if(o.k_ != k_ || o.canonical_ != canonical_) throw std::runtime_error("Cannot add tables for different k or strandedness.");
+        if(map_) throw std::runtime_error("Tables opened from a mapped file are read-only.");
+        if(!compact) for(size_t i(0); i < data_.size(); ++i) data_[i] += o.get(i);
+        else {
+            SizeType val;
+            for(size_t i(0); i < size(); ++i) if((val = o.get(i)) != 0) add(i, val);
+        }
+        return *this;
+    }
+    // Adds each k-mer's count to its reverse complement's, giving the counts a canonical table holds.
     void rc_collapse() {
-        for(u32 rc, k = 0; k < k_; rc = reverse_complement(k, k_), data_[rc] += data_[k], data_[k++] = data_[rc]);
+        if(canonical_) return;
+        for(size_t i = 0; i < size(); ++i) {
+            const u32 rc = reverse_complement(u32(i), k_);
+            if(i < rc) {
+                const SizeType sum = get(i) + get(rc);
+                set(i, sum), set(rc, sum);
+            } else if(i == rc) set(i, get(i) << 1);
+        }
     }
 };
 
+// Counts every table in freqs (consecutive k, ascending) from one rolling max-k code.
+// Only the first k - 1 bases of each run need to check which tables are full.
+template<typename SFType>
+void count_all(std::vector<SFType> &freqs, const char *s, size_t l) {
+    const unsigned k = freqs.back().k_;
+    const u32 mask = __kmask32(k);
+    u32 v = 0, f = 0; // f: bases seen in the current run, saturating at k - 1
+    for_each_run(s, l, [&](const uint8_t *codes, size_t n) {
+        size_t i = 0;
+        for(; f < k - 1 && i < n; ++i) {
+            v = (v << 2) | codes[i], ++f;
+            for(auto it(freqs.begin()); it < freqs.end() && it->k_ <= f; ++it)
+                it->inc(v & __kmask32(it->k_));
+        }
+        for(; i < n; ++i) {
+            v = ((v << 2) | codes[i]) & mask;
+            for(auto &sf: freqs) sf.inc(v & __kmask32(sf.k_));
+        }
+    }, [&]() {v = f = 0;});
+}
+
+// Max-k-only counting: only the last table in freqs is updated per base.
+// Every lower-order k-mer is a prefix of exactly one max-k k-mer except the last one of each run
+// of unambiguous bases, so the lower tables only receive those edge k-mers while counting,
+// and are completed afterwards by summing each table over its last base (marginalize_freqs).
+// Each full max-k k-mer is handed to inc, which either increments the table or buffers it.
+template<typename SFType, typename IncFunc>
+void count_maxk(std::vector<SFType> &freqs, const char *s, size_t l, IncFunc inc) {
+    const unsigned k = freqs.back().k_;
+    const u32 mask = __kmask32(k);
+    u32 v = 0, f = 0; // f: bases seen in the current run, saturating at k - 1
+    for_each_run(s, l, [&](const uint8_t *codes, size_t n) {
+        size_t i = 0;
+        for(; f < k - 1 && i < n; ++i) v = (v << 2) | codes[i], ++f;
+        u32 fw = v; // Copied so that it stays in a register; inc could alias it.
+        for(; i < n; ++i) inc(fw = ((fw << 2) | codes[i]) & mask);
+        v = fw;
+    }, [&]() {
+        for(auto it(freqs.begin()); it + 1 < freqs.end() && it->k_ <= f; ++it)
+            it->inc(v & __kmask32(it->k_));
+        v = f = 0;
+    });
+}
+
+// Canonical counterparts of count_all and count_maxk, for tables built with canonical set.
+// A reverse-complement code is rolled alongside the forward one, so each k-mer costs one
+// canonical_index; palindromes are counted twice.
+template<typename SFType>
+void count_all_canonical(std::vector<SFType> &freqs, const char *s, size_t l) {
+    const unsigned k = freqs.back().k_, rcshift = (k - 1) << 1;
+    const u32 mask = __kmask32(k);
+    u32 v = 0, rc = 0, f = 0;
+    auto inc = [&](SFType &sf) {
+        const u32 x = v & __kmask32(sf.k_), xrc = rc >> ((k - sf.k_) << 1), i = canonical_index(x, xrc, sf.k_);
+        sf.inc(i);
+        if(x == xrc) sf.inc(i);
+    };
+    for_each_run(s, l, [&](const uint8_t *codes, size_t n) {
+        size_t i = 0;
+        for(; f < k - 1 && i < n; ++i) {
+            v = (v << 2) | codes[i], rc = (rc >> 2) | (u32(3 - codes[i]) << rcshift), ++f;
+            for(auto it(freqs.begin()); it < freqs.end() && it->k_ <= f; ++it) inc(*it);
+        }
+        for(; i < n; ++i) {
+            v = ((v << 2) | codes[i]) & mask, rc = (rc >> 2) | (u32(3 - codes[i]) << rcshift);
+            for(auto &sf: freqs) inc(sf);
+        }
+    }, [&]() {v = rc = f = 0;});
+}
+
+// Lower canonical tables are marginalized over the last base of their stored orientation,
+// which misses that orientation's final k-mer in each run and the reverse complement's first.
+// Those are the edges counted here: the last k-mer if stored as is, and the first if its
+// reverse complement is the one stored.
+template<typename SFType, typename IncFunc>
+void count_maxk_canonical(std::vector<SFType> &freqs, const char *s, size_t l, IncFunc inc) {
+    const unsigned k = freqs.back().k_, k0 = freqs.front().k_, rcshift = (k - 1) << 1;
+    const u32 mask = __kmask32(k);
+    u32 v = 0, rc = 0, f = 0;
+    for_each_run(s, l, [&](const uint8_t *codes, size_t n) {
+        size_t i = 0;
+        for(; f < k - 1 && i < n; ++i) {
+            v = (v << 2) | codes[i], rc = (rc >> 2) | (u32(3 - codes[i]) << rcshift), ++f;
+            if(f >= k0) {
+                const u32 xrc = rc >> ((k - f) << 1);
+                if(v == xrc || !is_canonical(v, f)) freqs[f - k0].inc(canonical_index(v, xrc, f));
+            }
+        }
+        u32 fw = v, bw = rc; // Copied so that they stay in registers; inc could alias them.
+        if(k & 1) {
+            for(; i < n; ++i) {
+                fw = ((fw << 2) | codes[i]) & mask, bw = (bw >> 2) | (u32(3 - codes[i]) << rcshift);
+                inc(canonical_index_odd(fw, bw, k)); // Odd k-mers are never palindromic.
+            }
+        } else {
+            for(; i < n; ++i) {
+                fw = ((fw << 2) | codes[i]) & mask, bw = (bw >> 2) | (u32(3 - codes[i]) << rcshift);
+                const u32 ci = canonical_index_even(fw, bw, k);
+                inc(ci);
+                if(fw == bw) inc(ci);
+            }
+        }
+        v = fw, rc = bw;
+    }, [&]() {
+        for(auto it(freqs.begin()); it + 1 < freqs.end() && it->k_ <= f; ++it) {
+            const u32 x = v & __kmask32(it->k_);
+            if(is_canonical(x, it->k_)) it->inc(canonical_index(x, rc >> ((k - it->k_) << 1), it->k_));
+        }
+        v = rc = f = 0;
+    });
+}
+
+// Completes (or, with inverse, undoes) the lower tables of a max-k-only count.
+// Each table is the sum of the one above over its last base plus its edge k-mers.
+template<typename SFType>
+void marginalize_freqs(std::vector<SFType> &freqs, bool inverse=false) {
+    using size_type = typename SFType::size_type;
+    auto marginalize = [&](size_t j) {
+        auto &lo = freqs[j];
+        const auto &hi = freqs[j + 1];
+        if(lo.canonical_) {
+            for(u32 x = 0; x <= __kmask32(lo.k_); ++x) {
+                if(!is_canonical(x, lo.k_)) continue;
+                const size_t i = lo.index(x);
+                const size_type sum = hi.get(hi.index(x << 2)) + hi.get(hi.index((x << 2) | 1)) +
+                                      hi.get(hi.index((x << 2) | 2)) + hi.get(hi.index((x << 2) | 3));
+                if(inverse) lo.set(i, lo.get(i) - sum);
+                else        lo.add(i, sum);
+            }
+            return;
+        }
+        for(size_t i = 0; i < lo.size(); ++i) {
+            const size_type sum = hi.get(i << 2) + hi.get((i << 2) + 1) + hi.get((i << 2) + 2) + hi.get((i << 2) + 3);
+            if(inverse) lo.set(i, lo.get(i) - sum);
+            else        lo.add(i, sum);
+        }
+    };
+    if(freqs.size() < 2) return;
+    if(inverse) for(size_t j = 0; j + 1 < freqs.size(); ++j) marginalize(j);
+    else        for(size_t j = freqs.size() - 1; j-- > 0;)   marginalize(j);
+}
+
 template<typename KFType>
 void rc_collapse(KFType &kf) {
     for(auto &fs: kf.freqs())
         fs.rc_collapse();
 }
 
+// Reads a line of any length into buf, returning nullptr at the end of the file.
+static inline char *gzgetline(gzFile fp, std::vector<char> &buf) {
+    if(buf.size() < 256) buf.resize(256);
+    size_t len = 0;
+    while(gzgets(fp, buf.data() + len, buf.size() - len)) {
+        len += std::strlen(buf.data() + len);
+        if(buf[len - 1] == '\n' || len + 1 < buf.size()) return buf.data(); // Whole line, or the last one
+        buf.resize(buf.size() << 1);
+    }
+    return len ? buf.data(): nullptr;
+}
+
+// Parses sf's line of the text format, "k: [count|count|...|count]".
+template<typename SFType>
+void read_text_table(gzFile fp, SFType &sf, std::vector<char> &buf) {
+    char *p = gzgetline(fp, buf), *end;
+    if(p == nullptr || std::strtoul(p, &end, 10) != sf.k_ || (p = std::strchr(end, '[')) == nullptr)
+        throw std::runtime_error(std::string("Could not find table for k = ") + std::to_string(sf.k_));
+    for(size_t i = 0; i < sf.size(); ++i, p = end) {
+        sf.set(i, static_cast<typename SFType::size_type>(std::strtoull(++p, &end, 10)));
+        if(end == p || *end != (i + 1 < sf.size() ? '|': ']'))
+            throw std::runtime_error(std::string("Error in parsing table for k = ") + std::to_string(sf.k_));
+    }
+}
+
+// Splits one input across nthreads: the file is inflated and parsed on two more threads
+// (see SeqPipeline; BGZF blocks are inflated across nthreads) while batches of records are
+// counted, each worker into its own table.
+// Thread-local tables are summed into kf at the end, so counts match a single-threaded add.
+// The pipeline parses records itself, so the kseq_t is unused.
+template<typename KFType>
+void parallel_add(KFType &kf, const char *path, unsigned nthreads, kseq_t * =nullptr, PipelineStats *stats=nullptr) {
+    SeqPipeline pipe(path, KF_BATCH_BASES, nthreads);
+    std::vector<KFType> locals;
+    locals.reserve(nthreads - 1);
+    while(locals.size() + 1 < nthreads) locals.emplace_back(kf.empty_like());
+    while(SeqBatch *pb = pipe.next()) {
+        KF_STAT(const auto start = std::chrono::steady_clock::now());
+        const SeqBatch &batch = *pb;
+        #pragma omp parallel num_threads(nthreads)
+        {
+#ifdef _OPENMP
+            const unsigned tid = omp_get_thread_num(), nt = omp_get_num_threads();
+#else
+            const unsigned tid = 0, nt = 1;
+#endif
+            KFType &dest = tid ? locals[tid - 1]: kf;
+            for(size_t i = batch.split(tid, nt), e = batch.split(tid + 1, nt); i < e; ++i)
+                dest.process_seq(batch.seq(i), batch.len(i));
+        }
+        KF_STAT(Progress::get().add_bases(batch.size(), batch.bases()));
+        pipe.release(pb);
+        KF_STAT(pipe.add_count_time(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()));
+    }
+    for(auto &local: locals) local.flush(), kf += local;
+    kf.finalize();
+    if(stats) *stats += pipe.stats();
+}
+
 // Counts short kmer occurrences using arrays. (Supported: up to 16)
-template<typename SizeType, typename=typename std::enable_if<std::is_integral<SizeType>::value && std::is_unsigned<SizeType>::value>::type>
+template<typename SizeType, typename CellType=SizeType, typename=typename std::enable_if<std::is_integral<SizeType>::value && std::is_unsigned<SizeType>::value>::type>
 class KFreqArray {
     unsigned maxk_;
-    std::vector<SubKFreq<SizeType>> freqs_;
-    using FreqType = std::vector<SubKFreq<SizeType>>;
+    bool maxk_only_ = false; // Count only maxk directly; see count_maxk.
+    bool derived_   = false; // Whether lower tables have been completed from the maxk table.
+    bool canonical_ = false; // Count both strands into half-size tables; see canonical_index.
+    std::vector<SubKFreq<SizeType, CellType>> freqs_;
+    BlockedCounter<CellType> blk_; // Buffers maxk increments in maxk-only mode; see blocked.h
+    std::shared_ptr<const MappedFile> map_; // Backs freqs_ when opened from a mapped file
+    using FreqType = std::vector<SubKFreq<SizeType, CellType>>;
+    void check_writable() const {
+        if(map_) throw std::runtime_error("Tables opened from a mapped file are read-only.");
+    }
+    // Whether lower tables hold only edge k-mers, awaiting finalize().
+    bool partial() const {return maxk_only_ && !derived_;}
 public:
     FreqType       &freqs()       {return freqs_;}
     const FreqType &freqs() const {return freqs_;}
     using size_type = SizeType;
-    KFreqArray(unsigned k): maxk_(k) {
+    KFreqArray(unsigned k, bool maxk_only=false, bool canonical=false):
+        maxk_(k), maxk_only_(maxk_only), canonical_(canonical), blk_(maxk_only && k >= KF_BLOCKED_MIN_K && k <= KF_BLOCKED_MAX_K ? k: 0)
+    {
         if(std::numeric_limits<SizeType>::max() < (1ull << (k << 1)))
             throw std::runtime_error(std::string("SizeType with width ") + std::to_string(sizeof(SizeType) * CHAR_BIT) + " is not long enough for k = " + std::to_string(maxk_));
-        while(freqs_.size() < maxk_) freqs_.emplace_back(freqs_.size() + 1);
+        while(freqs_.size() < maxk_) freqs_.emplace_back(freqs_.size() + 1, canonical_);
         //if(maxk_ != 4) throw std::runtime_error("I'm making it for only k == 4 for now because I'm lazy.");
     }
+    KFreqArray empty_like() const {
+        KFreqArray ret(maxk_, maxk_only_, canonical_);
+        if(ret.blocked() != blocked()) ret.set_blocked(blocked());
+        return ret;
+    }
+    // Files in the mapped format are used in place, read-only; others are read into memory.
     KFreqArray(const char *path) {
+        if(is_mapped_file(path)) {
+            map_ = std::make_shared<const MappedFile>(path);
+            const KFMapHeader &h = map_->header();
+            if(h.mink != 1) throw std::runtime_error("Mapped file lacks tables below k = " + std::to_string(h.mink) + ". Open it as a KFreqList.");
+            maxk_ = h.maxk, canonical_ = h.canonical;
+            while(freqs_.size() < maxk_) freqs_.emplace_back(freqs_.size() + 1, canonical_, *map_);
+            return;
+        }
         gzFile fp = gzopen(path, "rb");
         if(!fp) throw std::runtime_error("Could not open file.");
         char buf[sizeof(KF_BIN)];
         gzread(fp, buf, sizeof(buf));
         bool read_binary;
-        if(std::string(buf) == KF_BIN) read_binary == true;
-        else if(std::string(buf) == KF_TEXT) read_binary = false;
+        if(!std::memcmp(buf, KF_BIN, sizeof(buf)) || (canonical_ = !std::memcmp(buf, KF_CBIN, sizeof(buf)))) read_binary = true;
+        else if(!std::memcmp(buf, KF_TEXT, sizeof(buf)) || (canonical_ = !std::memcmp(buf, KF_CTEXT, sizeof(buf)))) read_binary = false;
         else {
             buf[sizeof(buf) - 1] = '\0';
             throw std::runtime_error(std::string("Unexpected magic string: ") + buf);
         }
+        // Compressed binary files are from before the mapped format.
         if(read_binary) {
             gzread(fp, &maxk_, sizeof(maxk_));
-            while(freqs_.size() < maxk_) freqs_.emplace_back(freqs_.size() + 1);
-            for(auto &sf: freqs_) gzread(fp, sf.data_.data(), sf.data_.size() * sizeof(SizeType));
+            while(freqs_.size() < maxk_) freqs_.emplace_back(freqs_.size() + 1, canonical_);
+            for(auto &sf: freqs_) sf.read(fp);
         } else {
-            char *line, *p;
-            std::vector<char> linebuf(256);
-            if((line = gzgets(fp, linebuf.data(), linebuf.size())) == nullptr) throw std::runtime_error("Could not read from file.");
-            for(p = line; *p; ++p);
-            while(!std::isdigit(*p)) --p; // In case the newline is attached
-            while(std::isdigit(*p)) --p;
-            maxk_ = std::atoi(p + 1);
-            while(freqs_.size() < maxk_) freqs_.emplace_back(freqs_.size() + 1);
-            for(unsigned i(0); i < maxk_;++i) {
-                auto &freq = freqs_[i];
-                if((line = gzgets(fp, linebuf.data(), linebuf.size())) == nullptr) throw std::runtime_error("Could not read from file.");
-                if(!(p = std::strchr(line, '['))) goto fail;
-                unsigned j(0);
-                do {
-                    freq.data_[j++] = static_cast<SizeType>(std::strtoull(++p, nullptr, 10));
-                    while(std::isdigit(*p)) ++p;
-                } while(j < freq.data_.size());
-            }
-            if(false) {
-                fail:
-                throw std::runtime_error("Error in parsing.");
-            }
+            std::vector<char> linebuf;
+            const char *line = gzgetline(fp, linebuf);
+            if(line == nullptr || std::sscanf(line, "#Max k: %u", &maxk_) != 1) throw std::runtime_error("Could not read max k.");
+            while(freqs_.size() < maxk_) freqs_.emplace_back(freqs_.size() + 1, canonical_);
+            for(auto &sf: freqs_) read_text_table(fp, sf, linebuf);
         }
         gzclose(fp);
     }
     void clear_kmers() {
         for(auto &freq: freqs_) freq.clear_kmer();
     }
-#define __kmask32(k) (UINT32_C(-1) >> (32 - ((k) << 1)))
     void process_seq(const char *s, size_t l) {
-        clear_kmers();
-        u32 cc;
-        size_t i = 0;
-        while(i < l) {
-            if((cc = cstr_lut[s[i++]]) == UINT32_C(-1)) {
-                clear_kmers();
-                //std::fprintf(stderr, "i is now %zu. Kmers are cleared. Continue.\n", i);
-                continue;
+        check_writable();
+        if(maxk_only_) {
+            if(derived_) marginalize_freqs(freqs_, true), derived_ = false;
+            auto &top = freqs_.back();
+            if(canonical_) {
+                if(blk_.enabled()) count_maxk_canonical(freqs_, s, l, [&](u32 v) {blk_.push(v, top);});
+                else               count_maxk_canonical(freqs_, s, l, typename SubKFreq<SizeType, CellType>::Incrementer(top));
+            } else {
+                if(blk_.enabled()) count_maxk(freqs_, s, l, [&](u32 v) {blk_.push(v, top);});
+                else               count_maxk(freqs_, s, l, typename SubKFreq<SizeType, CellType>::Incrementer(top));
             }
-            //std::fprintf(stderr, "Now incrementing counts\n");
-            ++freqs_[0].data_[cc];
-            for(auto it(freqs_.begin() + 1); it < freqs_.end(); ++it) {
-                //std::fprintf(stderr, "Now doing stuff at pos %zu of %zu\n", std::distance(freqs_.begin(), it), freqs_.size());
-                auto &sf(*it);
-                sf.v_ <<= 2;
-                sf.v_ |= cc;
-                if(sf.f_ == sf.k_ - 1) {
-                    sf.v_ &= __kmask32(sf.k_);
-                    ++sf.data_[sf.v_];
-                } else ++sf.f_;
-            }
-            //std::fprintf(stderr, "Done incrementing counts\n");
+            return;
         }
+        if(canonical_) count_all_canonical(freqs_, s, l);
+        else           count_all(freqs_, s, l);
     }
-    void add(const char *path, kseq_t *ks=nullptr) {
+    // Reads through a SeqPipeline when using several threads or if stats are requested.
+    void add(const char *path, kseq_t *ks=nullptr, unsigned nthreads=1, PipelineStats *stats=nullptr) {
+        if(nthreads > 1 || stats) {
+            parallel_add(*this, path, nthreads, ks, stats);
+            return;
+        }
         const bool destroy = (ks == nullptr);
         gzFile fp(gzopen(path, "rb"));
+        if(fp == nullptr) throw std::runtime_error(std::string("Could not open file at ") + path);
         if(destroy) ks = kseq_init(fp);
         else       kseq_assign(ks, fp);
 
@@ -211,97 +640,150 @@ public:
 
         if(destroy) kseq_destroy(ks);
         gzclose(fp);
+        finalize();
+    }
+    // In maxk-only mode, lower-order tables are only complete after finalize(), which add() calls.
+    void finalize() {
+        flush();
+        if(maxk_only_ && !derived_) marginalize_freqs(freqs_), derived_ = true;
+    }
+    void flush() {
+        if(!blk_.empty()) blk_.flush(freqs_.back());
+    }
+    bool blocked() const {return blk_.enabled();}
+    // Toggles cache-blocked counting of the max k table. Only used in maxk-only mode.
+    void set_blocked(bool blocked) {
+        flush();
+        blk_ = BlockedCounter<CellType>(blocked && maxk_only_ ? maxk_: 0);
     }
     void clear() {
+        check_writable();
         for(auto &freq: freqs_)
             freq.clear();
+        derived_ = false;
+        blk_.clear();
+    }
+    KFreqArray &operator+=(const KFreqArray &o) {
+        if(o.maxk_ != maxk_ || o.canonical_ != canonical_) throw std::runtime_error("Cannot add KFreqArrays with different maxk or strandedness.");
+        if(!o.blk_.empty()) throw std::runtime_error("Cannot add a table with buffered counts. Call finalize() on it first.");
+        check_writable();
+        flush();
+        // Tables read from a file, or counted directly, are already complete. Both forms are linear in the raw counts.
+        if(o.partial() && !partial()) {
+            if(!maxk_only_) throw std::runtime_error("Cannot add a table counted in maxk-only mode to one counted directly. Call finalize() on it first.");
+            marginalize_freqs(freqs_, true), derived_ = false;
+        } else if(!o.partial() && partial()) {
+            marginalize_freqs(freqs_), derived_ = true;
+        }
+        for(size_t i(0); i < freqs_.size(); ++i) freqs_[i] += o.freqs_[i];
+        return *this;
     }
-    void write(const char *path, bool emit_binary=false) {
-        gzFile fp = gzopen(path, "wb");
-        if(fp == nullptr) throw std::runtime_error("Could not open file for output.");
+    // Binary output is in the mapped format; see kfmap.h. Text is BGZF, formatted on nthreads threads; see textio.h.
+    void write(const char *path, bool emit_binary=false, unsigned nthreads=1) {
+        finalize();
         if(emit_binary) {
-            gzwrite(fp, (void *)KF_BIN, sizeof(KF_BIN));
-            gzwrite(fp, (void *)&maxk_, sizeof(maxk_));
-            for(const auto &freq: freqs_) {
-                freq.write(fp);
-            }
-        } else {
-            gzwrite(fp, (void *)KF_TEXT, sizeof(KF_TEXT));
-            gzprintf(fp, "#Max k: %u\n", maxk_);
-            for(const auto &sf: freqs_) {
-                gzprintf(fp, "%u: [", sf.k_);
-                for(size_t i(0); i < sf.data_.size() - 1; gzprintf(fp, "%zu|", size_t(sf.data_[i++])));
-                gzprintf(fp, "%zu]\n", size_t(sf.data_.back()));
-            }
+            write_mapped(path, freqs_, canonical_);
+            return;
         }
-        gzclose(fp);
+        write_text_tables(path, std::string(canonical_ ? KF_CTEXT: KF_TEXT, sizeof(KF_TEXT)) + "#Max k: " + std::to_string(maxk_) + '\n',
+                          freqs_, nthreads);
     }
     SizeType count(const std::string &str) const {
         return count(str.size(), str2kmer<SizeType>(str));
     }
     SizeType count(unsigned k, SizeType value) const {
-        return freqs_[k - 1].data_[value];
+        return freqs_[k - 1].get(freqs_[k - 1].index(value));
+    }
+    const SubKFreq<SizeType, CellType> &table(unsigned k) const {
+        if(k < 1 || k > maxk_) throw std::runtime_error(std::string("No table for k = ") + std::to_string(k));
+        return freqs_[k - 1];
     }
+    unsigned mink() const {return 1;}
     unsigned maxk() const {return maxk_;}
+    bool canonical() const {return canonical_;}
+    bool mapped() const {return map_ != nullptr;}
+    bool maxk_only() const {return maxk_only_;}
+    size_t bytes() const {
+        size_t ret = 0;
+        for(const auto &sf: freqs_) ret += sf.bytes();
+        return ret;
+    }
+    size_t max_bytes() const {
+        size_t ret = 0;
+        for(const auto &sf: freqs_) ret += sf.max_bytes();
+        return ret;
+    }
 };
 
 // Counts short kmer occurrences using arrays. (Supported: up to 16)
-template<typename SizeType, typename=typename std::enable_if<std::is_integral<SizeType>::value && std::is_unsigned<SizeType>::value>::type>
+template<typename SizeType, typename CellType=SizeType, typename=typename std::enable_if<std::is_integral<SizeType>::value && std::is_unsigned<SizeType>::value>::type>
 class KFreqList {
-    const uint16_t maxk_;
-    const uint16_t   nk_;
-    std::vector<SubKFreq<SizeType>> freqs_;
-    using FreqType = std::vector<SubKFreq<SizeType>>;
+    uint16_t maxk_;
+    uint16_t   nk_;
+    bool maxk_only_ = false; // Count only maxk directly; see count_maxk.
+    bool derived_   = false; // Whether lower tables have been completed from the maxk table.
+    bool canonical_ = false; // Count both strands into half-size tables; see canonical_index.
+    std::vector<SubKFreq<SizeType, CellType>> freqs_;
+    BlockedCounter<CellType> blk_; // Buffers maxk increments in maxk-only mode; see blocked.h
+    std::shared_ptr<const MappedFile> map_; // Backs freqs_ when opened from a mapped file
+    using FreqType = std::vector<SubKFreq<SizeType, CellType>>;
+    void check_writable() const {
+        if(map_) throw std::runtime_error("Tables opened from a mapped file are read-only.");
+    }
+    // Whether lower tables hold only edge k-mers, awaiting finalize().
+    bool partial() const {return maxk_only_ && !derived_;}
 public:
     FreqType       &freqs()       {return freqs_;}
     const FreqType &freqs() const {return freqs_;}
     using size_type = SizeType;
-    KFreqList(unsigned k, unsigned num_kmers=3): maxk_(k), nk_(num_kmers) {
-        if(std::numeric_limits<SizeType>::max() > (1ull << (k << 1)))
+    KFreqList(unsigned k, unsigned num_kmers=3, bool maxk_only=false, bool canonical=false):
+        maxk_(k), nk_(num_kmers), maxk_only_(maxk_only), canonical_(canonical), blk_(maxk_only && k >= KF_BLOCKED_MIN_K && k <= KF_BLOCKED_MAX_K ? k: 0)
+    {
+        if(std::numeric_limits<SizeType>::max() < (1ull << (k << 1)))
             throw std::runtime_error(std::string("SizeType with width ") + std::to_string(sizeof(SizeType) * CHAR_BIT) + " is not long enough for k = " + std::to_string(maxk_));
-        for(k = maxk_ - nk_; k < maxk_;freqs_.emplace_back(k+++1));
+        for(k = maxk_ - nk_; k < maxk_; ++k) freqs_.emplace_back(k + 1, canonical_);
     }
+    KFreqList empty_like() const {
+        KFreqList ret(maxk_, nk_, maxk_only_, canonical_);
+        if(ret.blocked() != blocked()) ret.set_blocked(blocked());
+        return ret;
+    }
+    // Files in the mapped format are used in place, read-only; others are read into memory.
     KFreqList(const char *path) {
+        if(is_mapped_file(path)) {
+            map_ = std::make_shared<const MappedFile>(path);
+            const KFMapHeader &h = map_->header();
+            maxk_ = h.maxk, nk_ = h.maxk - h.mink + 1, canonical_ = h.canonical;
+            for(unsigned k = h.mink; k <= maxk_; ++k) freqs_.emplace_back(k, canonical_, *map_);
+            return;
+        }
         gzFile fp = gzopen(path, "rb");
         if(!fp) throw std::runtime_error("Could not open file.");
-        char buf[sizeof(KF_BIN)];
+        char buf[sizeof(KFL_BIN)];
         gzread(fp, buf, sizeof(buf));
         bool read_binary;
-        if(std::string(buf) == KFL_BIN) read_binary == true;
-        else if(std::string(buf) == KFL_TEXT) read_binary = false;
+        if(!std::memcmp(buf, KFL_BIN, sizeof(buf)) || (canonical_ = !std::memcmp(buf, KFL_CBIN, sizeof(buf)))) read_binary = true;
+        else if(!std::memcmp(buf, KFL_TEXT, sizeof(buf)) || (canonical_ = !std::memcmp(buf, KFL_CTEXT, sizeof(buf)))) read_binary = false;
         else {
             buf[sizeof(buf) - 1] = '\0';
             throw std::runtime_error(std::string("Unexpected magic string: ") + buf);
         }
+        // Compressed binary files are from before the mapped format.
         if(read_binary) {
             gzread(fp, &maxk_, sizeof(maxk_));
             gzread(fp, &nk_, sizeof(nk_));
-            for(unsigned k = maxk_ - nk_; k < maxk_;freqs_.emplace_back(k+++1));
-            for(auto &sf: freqs_) gzread(fp, sf.data_.data(), sf.data_.size() * sizeof(SizeType));
+            for(unsigned k = maxk_ - nk_; k < maxk_; ++k) freqs_.emplace_back(k + 1, canonical_);
+            for(auto &sf: freqs_) sf.read(fp);
         } else {
-            char *line, *p;
-            std::vector<char> linebuf(256);
-            if((line = gzgets(fp, linebuf.data(), linebuf.size())) == nullptr) throw std::runtime_error("Could not read from file.");
-            for(p = line; *p; ++p);
-            while(!std::isdigit(*p)) --p; // In case the newline is attached
-            while(std::isdigit(*p)) --p;
-            maxk_ = std::atoi(p + 1);
-            while(freqs_.size() < maxk_) freqs_.emplace_back(freqs_.size() + 1);
-            auto it = freqs_.begin();
-            for(unsigned i(maxk_ - nk_); i < maxk_;++i) {
-                auto &freq = freqs_[i];
-                if((line = gzgets(fp, linebuf.data(), linebuf.size())) == nullptr) throw std::runtime_error("Could not read from file.");
-                if(!(p = std::strchr(line, '['))) goto fail;
-                unsigned j(0);
-                do {
-                    freq.data_[j++] = static_cast<SizeType>(std::strtoull(++p, nullptr, 10));
-                    while(std::isdigit(*p)) ++p;
-                } while(j < freq.data_.size());
-            }
-            if(false) {
-                fail:
-                throw std::runtime_error("Error in parsing.");
-            }
+            std::vector<char> linebuf;
+            const char *line;
+            unsigned maxk, nk;
+            if((line = gzgetline(fp, linebuf)) == nullptr || std::sscanf(line, "#Max k: %u", &maxk) != 1 ||
+               (line = gzgetline(fp, linebuf)) == nullptr || std::sscanf(line, "#nk: %u", &nk) != 1 || nk > maxk)
+                throw std::runtime_error("Could not read k range.");
+            maxk_ = maxk, nk_ = nk;
+            for(unsigned k = maxk_ - nk_; k < maxk_; ++k) freqs_.emplace_back(k + 1, canonical_);
+            for(auto &sf: freqs_) read_text_table(fp, sf, linebuf);
         }
         gzclose(fp);
     }
@@ -309,30 +791,31 @@ public:
         for(auto &freq: freqs_) freq.clear_kmer();
     }
     void process_seq(const char *s, size_t l) {
-        clear_kmers();
-        u32 cc;
-        size_t i = 0;
-        while(i < l) {
-            if((cc = cstr_lut[s[i++]]) == UINT32_C(-1)) {
-                clear_kmers();
-                //std::fprintf(stderr, "i is now %zu. Kmers are cleared. Continue.\n", i);
-                continue;
-            }
-            for(auto it(freqs_.begin()); it < freqs_.end(); ++it) {
-                //std::fprintf(stderr, "Now doing stuff at pos %zu of %zu\n", std::distance(freqs_.begin(), it), freqs_.size());
-                auto &sf(*it);
-                sf.v_ <<= 2;
-                sf.v_ |= cc;
-                sf.v_ &= __kmask32(sf.k_);
-                sf.f_ += (sf.f_ != sf.k_ - 1);
-                sf.data_[sf.v_] += (sf.f_ == sf.k_ - 1);
+        check_writable();
+        if(maxk_only_) {
+            if(derived_) marginalize_freqs(freqs_, true), derived_ = false;
+            auto &top = freqs_.back();
+            if(canonical_) {
+                if(blk_.enabled()) count_maxk_canonical(freqs_, s, l, [&](u32 v) {blk_.push(v, top);});
+                else               count_maxk_canonical(freqs_, s, l, typename SubKFreq<SizeType, CellType>::Incrementer(top));
+            } else {
+                if(blk_.enabled()) count_maxk(freqs_, s, l, [&](u32 v) {blk_.push(v, top);});
+                else               count_maxk(freqs_, s, l, typename SubKFreq<SizeType, CellType>::Incrementer(top));
             }
-            //std::fprintf(stderr, "Done incrementing counts\n");
+            return;
         }
+        if(canonical_) count_all_canonical(freqs_, s, l);
+        else           count_all(freqs_, s, l);
     }
-    void add(const char *path, kseq_t *ks=nullptr) {
+    // Reads through a SeqPipeline when using several threads or if stats are requested.
+    void add(const char *path, kseq_t *ks=nullptr, unsigned nthreads=1, PipelineStats *stats=nullptr) {
+        if(nthreads > 1 || stats) {
+            parallel_add(*this, path, nthreads, ks, stats);
+            return;
+        }
         const bool destroy = (ks == nullptr);
         gzFile fp(gzopen(path, "rb"));
+        if(fp == nullptr) throw std::runtime_error(std::string("Could not open file at ") + path);
         if(destroy) ks = kseq_init(fp);
         else       kseq_assign(ks, fp);
 
@@ -340,84 +823,209 @@ public:
 
         if(destroy) kseq_destroy(ks);
         gzclose(fp);
+        finalize();
+    }
+    // In maxk-only mode, lower-order tables are only complete after finalize(), which add() calls.
+    void finalize() {
+        flush();
+        if(maxk_only_ && !derived_) marginalize_freqs(freqs_), derived_ = true;
+    }
+    void flush() {
+        if(!blk_.empty()) blk_.flush(freqs_.back());
+    }
+    bool blocked() const {return blk_.enabled();}
+    // Toggles cache-blocked counting of the max k table. Only used in maxk-only mode.
+    void set_blocked(bool blocked) {
+        flush();
+        blk_ = BlockedCounter<CellType>(blocked && maxk_only_ ? maxk_: 0);
     }
     void clear() {
+        check_writable();
         for(auto &freq: freqs_)
             freq.clear();
+        derived_ = false;
+        blk_.clear();
+    }
+    KFreqList &operator+=(const KFreqList &o) {
+        if(o.maxk_ != maxk_ || o.nk_ != nk_ || o.canonical_ != canonical_) throw std::runtime_error("Cannot add KFreqLists with different k ranges or strandedness.");
+        if(!o.blk_.empty()) throw std::runtime_error("Cannot add a table with buffered counts. Call finalize() on it first.");
+        check_writable();
+        flush();
+        // Tables read from a file, or counted directly, are already complete. Both forms are linear in the raw counts.
+        if(o.partial() && !partial()) {
+            if(!maxk_only_) throw std::runtime_error("Cannot add a table counted in maxk-only mode to one counted directly. Call finalize() on it first.");
+            marginalize_freqs(freqs_, true), derived_ = false;
+        } else if(!o.partial() && partial()) {
+            marginalize_freqs(freqs_), derived_ = true;
+        }
+        for(size_t i(0); i < freqs_.size(); ++i) freqs_[i] += o.freqs_[i];
+        return *this;
     }
-    void write(const char *path, bool emit_binary=false) {
-        gzFile fp = gzopen(path, "wb");
-        if(fp == nullptr) throw std::runtime_error("Could not open file for output.");
+    // Binary output is in the mapped format; see kfmap.h. Text is BGZF, formatted on nthreads threads; see textio.h.
+    void write(const char *path, bool emit_binary=false, unsigned nthreads=1) {
+        finalize();
         if(emit_binary) {
-            gzwrite(fp, (void *)KFL_BIN, sizeof(KFL_BIN));
-            gzwrite(fp, (void *)&maxk_, sizeof(maxk_));
-            gzwrite(fp, (void *)&nk_, sizeof(nk_));
-            for(const auto &freq: freqs_) freq.write(fp);
-        } else {
-            gzwrite(fp, (void *)KFL_TEXT, sizeof(KF_TEXT));
-            gzprintf(fp, "#Max k: %u\n", maxk_);
-            gzprintf(fp, "#nk: %u\n", nk_);
-            for(const auto &sf: freqs_) {
-                gzprintf(fp, "%u: [", sf.k_);
-                for(size_t i(0); i < sf.data_.size() - 1; gzprintf(fp, "%zu|", size_t(sf.data_[i++])));
-                gzprintf(fp, "%zu]\n", size_t(sf.data_.back()));
-            }
+            write_mapped(path, freqs_, canonical_);
+            return;
         }
-        gzclose(fp);
+        write_text_tables(path, std::string(canonical_ ? KFL_CTEXT: KFL_TEXT, sizeof(KFL_TEXT)) + "#Max k: " + std::to_string(maxk_) +
+                                "\n#nk: " + std::to_string(nk_) + '\n', freqs_, nthreads);
     }
     SizeType count(const std::string &str) const {
         return count(str.size(), str2kmer<SizeType>(str));
     }
     SizeType count(unsigned k, SizeType value) const {
-        return freqs_[k - (maxk_ - nk_ + 1)].data_[value];
+        const auto &sf = freqs_[k - (maxk_ - nk_ + 1)];
+        return sf.get(sf.index(value));
+    }
+    const SubKFreq<SizeType, CellType> &table(unsigned k) const {
+        if(k < mink() || k > maxk_) throw std::runtime_error(std::string("No table for k = ") + std::to_string(k));
+        return freqs_[k - mink()];
     }
+    unsigned mink() const {return maxk_ - nk_ + 1;}
     unsigned maxk() const {return maxk_;}
+    bool canonical() const {return canonical_;}
+    bool mapped() const {return map_ != nullptr;}
+    bool maxk_only() const {return maxk_only_;}
+    size_t bytes() const {
+        size_t ret = 0;
+        for(const auto &sf: freqs_) ret += sf.bytes();
+        return ret;
+    }
+    size_t max_bytes() const {
+        size_t ret = 0;
+        for(const auto &sf: freqs_) ret += sf.max_bytes();
+        return ret;
+    }
 };
 using KFC = KFreqArray<u32>;
 using KFL = KFreqList<u32>;
 
+#ifndef KF_ZSCORE_BLOCK
+#  define KF_ZSCORE_BLOCK 4096u // K-mers scored per task; a power of 4
+#endif
+
+// Number of z-scores for k: one per k-mer, or one per reverse-complement pair from canonical tables.
+static inline size_t zscore_size(unsigned k, bool canonical) {
+    return canonical ? size_t(canonical_size(k)): size_t(1) << (k << 1);
+}
+
+// Every k-mer's count in sf as FloatType, indexed by the k-mer itself even for canonical tables.
+template<typename FloatType, typename SFType>
+void expand_counts(const SFType &sf, FloatType *out) {
+    const size_t n = size_t(1) << (sf.k_ << 1);
+    if(!sf.canonical_) {
+        sf.get_range(0, n, out);
+        return;
+    }
+    #pragma omp parallel for schedule(static, KF_ZSCORE_BLOCK)
+    for(size_t x = 0; x < n; ++x) out[x] = sf.get(sf.index(x));
+}
+
+// One k-mer's z-score from its count, the counts of its (k-1)-mer prefix and suffix and the count
+// of its middle (k-2)-mer, as below: 0 if mid is 0, and 1 / mid^2 if the variance is 0. Computed
+// without branches, so that loops over it vectorize.
+template<typename FloatType>
+static INLINE FloatType markov_zscore(FloatType count, FloatType prefix, FloatType suffix, FloatType mid) {
+    const FloatType fmid = FloatType(1) / mid, xp = suffix * prefix * fmid,
+                    var = xp * (mid - suffix) * (mid - prefix) * fmid * fmid;
+    const FloatType z = var == FloatType(0) ? fmid * fmid: (count - xp) / var;
+    return mid == FloatType(0) ? FloatType(0): z;
+}
+
+// Z-scores of k-mer counts against a maximal-order Markov model, for every k in [mink, maxk] in a
+// single call, from tables k - 2 to k of kf. Scores are written to out by increasing k, and within a
+// k in order of the k-mers scored (canonical k-mers only for canonical tables), taking
+// zscore_size(k) values each.
+// The (k-1)- and (k-2)-mer counts are expanded once into dense arrays, so that each k-mer's model
+// is a few loads and a branch-free select; k-mers are scored a block at a time in parallel.
+// Port of:
+//   def calc_zscores(c, k):
+//       # for each kmer, calc expected frequencies with a
+//       # maximal order Markov chain model (k, k-1, k-2)
+//       mer_z = []
+//       for mer in gen_kmers(k): # even if ambig nucs in Counters, we skip them
+//           mid = c[k-2][mer[1:k-1]]
+//           try:
+//               exp = 1. * c[k-1][mer[:k-1]] * c[k-1][mer[1:]] / mid
+//               std = sqrt(exp * (mid-c[k-1][mer[:k-1]]) * (mid-c[k-1][mer[1:]]) / (mid**2))
+//               mer_z.append((c[k][mer]-exp) / std)
+//           except ZeroDivisionError:
+//               if mid > 0: # if a (k-1)mer is absent
+//                   mer_z.append(1 / (mid**2))
+//               elif mid == 0: # if a (k-2)"mid"mer is absent
+//                   mer_z.append(0)
+//       return mer_z
+// As before, the square root is not taken: scores are divided by the variance.
+template<typename FloatType, typename KFType>
+void calc_zscores(const KFType &kf, unsigned mink, unsigned maxk, FloatType *out) {
+    static_assert(std::is_floating_point<FloatType>::value, "Z-scores need a floating-point type.");
+    static_assert((KF_ZSCORE_BLOCK & (KF_ZSCORE_BLOCK - 1)) == 0 && (KF_ZSCORE_BLOCK & 0x55555555u), "KF_ZSCORE_BLOCK must be a power of 4.");
+    if(mink < std::max(3u, kf.mink() + 2) || mink > maxk || maxk > kf.maxk())
+        throw std::runtime_error(std::string("Cannot score k = ") + std::to_string(mink) + " to " + std::to_string(maxk) +
+                                 " from tables for k = " + std::to_string(kf.mink()) + " to " + std::to_string(kf.maxk()));
+    const bool canonical = kf.canonical();
+    // lo and hi hold the expanded (k-2)- and (k-1)-mer counts; hi becomes lo as k rises.
+    std::vector<FloatType> lo(size_t(1) << ((mink - 2) << 1)), hi;
+    expand_counts(kf.table(mink - 2), lo.data());
+    for(unsigned k = mink; k <= maxk; ++k) {
+        hi.resize(size_t(1) << ((k - 1) << 1));
+        expand_counts(kf.table(k - 1), hi.data());
+        const auto &sf = kf.table(k);
+        const size_t n = size_t(1) << (k << 1), block = std::min(n, size_t(KF_ZSCORE_BLOCK)), nblocks = n / block;
+        const u32 m1 = __kmask32(k - 1), m2 = __kmask32(k - 2);
+        // Output offset of each block, from the number of canonical k-mers before it.
+        std::vector<size_t> offsets(nblocks + 1);
+        if(canonical) {
+            #pragma omp parallel for schedule(static)
+            for(size_t b = 0; b < nblocks; ++b) {
+                size_t c = 0;
+                for(u64 x = b * block, e = x + block; x < e; ++x) c += is_canonical(x, k);
+                offsets[b + 1] = c;
+            }
+            std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+        } else {
+            for(size_t b = 0; b <= nblocks; ++b) offsets[b] = b * block;
+        }
+        const FloatType *const L = hi.data(), *const M = lo.data();
+        #pragma omp parallel
+        {
+            std::vector<u32> kmers(block);
+            std::vector<FloatType> counts(block);
+            #pragma omp for schedule(dynamic)
+            for(size_t b = 0; b < nblocks; ++b) {
+                // Gather the block's k-mers to score and their counts,
+                size_t nk = 0;
+                if(canonical) {
+                    // An odd canonical k-mer is stored as itself, so its reverse complement is not needed.
+                    for(u64 x = b * block, e = x + block; x < e; ++x)
+                        if(is_canonical(x, k)) kmers[nk] = x, counts[nk++] = sf.get(k & 1 ? canonical_index_odd(x, x, k): sf.index(x));
+                } else {
+                    for(nk = 0; nk < block; ++nk) kmers[nk] = b * block + nk;
+                    sf.get_range(b * block, block, counts.data());
+                }
+                // then score them without branches.
+                FloatType *const dst = out + offsets[b];
+                const u32 *const km = kmers.data();
+                const FloatType *const cnt = counts.data();
+                #pragma omp simd
+                for(size_t i = 0; i < nk; ++i) {
+                    const u32 x = km[i];
+                    dst[i] = markov_zscore(cnt[i], L[x >> 2], L[x & m1], M[(x >> 2) & m2]);
+                }
+            }
+        }
+        out += offsets[nblocks];
+        std::swap(lo, hi);
+    }
+}
+
+// Z-scores for the max k alone; see above.
 template<typename KFType, typename FloatType=double,
          typename=typename std::enable_if<std::is_floating_point<FloatType>::value>::type>
 std::vector<FloatType> calc_zscores(const KFType &kf) {
-#if 0
-    Simple port of the below code:
-def calc_zscores(c, k):
-    # for each kmer, calc expected frequencies with a
-    # maximal order Markov chain model (k, k-1, k-2)
-    mer_z = []
-    for mer in gen_kmers(k): # even if ambig nucs in Counters, we skip them
-        mid = c[k-2][mer[1:k-1]]
-        try:
-            exp = 1. * c[k-1][mer[:k-1]] * c[k-1][mer[1:]] / mid
-            std = sqrt(exp * (mid-c[k-1][mer[:k-1]]) * (mid-c[k-1][mer[1:]]) / (mid**2))
-            mer_z.append((c[k][mer]-exp) / std)
-        except ZeroDivisionError:
-            if mid > 0: # if a (k-1)mer is absent
-                mer_z.append(1 / (mid**2))
-            elif mid == 0: # if a (k-2)"mid"mer is absent
-                mer_z.append(0)
-    return mer_z
-#endif
-    const unsigned k = kf.maxk();
-    std::vector<FloatType> ret;
-    ret.reserve(1u << (k << 1));
-    using sz_t = typename KFType::size_type;
-    sz_t mid;
-    u32 km1l, km1r;
-    FloatType xp, std, fmid;
-    for(unsigned i(0), max_kmer(1u << (k << 1)); i < max_kmer; ++i) {
-        if((mid = kf.count(k - 2, (i >> 2) & __kmask32(k - 2))) == 0) {
-            ret.push_back(0.); continue;
-        }
-        km1l = kf.count(k - 1, i & __kmask32(k - 1));
-        km1r = kf.count(k - 1, (i>>2) & __kmask32(k - 1));
-        fmid = 1. / mid;
-        xp = static_cast<FloatType>(km1l * km1r) * fmid;
-        if((std = xp * (mid - km1l) * (mid - km1r) * fmid * fmid) == 0.)
-            ret.push_back(1./(static_cast<FloatType>(mid) * static_cast<FloatType>(mid)));
-        else ret.push_back((kf.count(k, i) - xp) / std);
-    }
-    assert(ret.size() == (1u << (k << 1)));
+    std::vector<FloatType> ret(zscore_size(kf.maxk(), kf.canonical()));
+    calc_zscores(kf, kf.maxk(), kf.maxk(), ret.data());
     return ret;
 }
 
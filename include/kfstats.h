@@ -0,0 +1,198 @@
+#pragma once
+#include "kmerutil.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef KF_STATS
+#  define KF_STATS 1 // Per-stage timers and counters, and progress lines; 0 compiles them out
+#endif
+
+// Wraps statements that only gather statistics, so that they vanish when KF_STATS is 0.
+#if KF_STATS
+#  define KF_STAT(...) __VA_ARGS__
+#else
+#  define KF_STAT(...)
+#endif
+
+namespace kf {
+
+// Number of runs of anything but ACGT/acgt in s[0, n), where each run breaks counting.
+// in_break says whether the base before s was one; it is updated for the next piece of a record.
+static inline size_t count_breaks(const char *s, size_t n, bool &in_break) {
+    if(!n) return 0;
+    auto bad = [](char c) -> unsigned {
+        const uint8_t u = c & 0xDF;
+        return (u != 'A') & (u != 'C') & (u != 'G') & (u != 'T');
+    };
+    size_t ret = bad(s[0]) & !in_break;
+    for(size_t i = 1; i < n; ++i) ret += bad(s[i]) & (bad(s[i - 1]) ^ 1u);
+    in_break = bad(s[n - 1]);
+    return ret;
+}
+
+// Time spent in each stage of profiling, excluding waits between pipeline stages, and what
+// passed through it. Inflate, parse and count run concurrently in a SeqPipeline; the one with
+// the most time is the one limiting the run. The rest follow counting, per input.
+// Each thread fills its own copy, summed with += for totals.
+struct PipelineStats {
+    double inflate_time = 0., parse_time = 0., count_time = 0., zscore_time = 0., emit_time = 0., distance_time = 0.,
+           wall_time = 0.,
+           busy_time = 0., idle_time = 0.; // A profiling thread's time on its own or others' inputs, and without either
+    size_t files = 0,
+           bytes_in = 0,  // Bytes of input files, as stored
+           bytes = 0,     // Decompressed bytes,
+           records = 0,   // and what was parsed from them
+           bases = 0,
+           nbreaks = 0,   // Runs of non-ACGT bases
+           bytes_out = 0; // Bytes of z-scores written
+    PipelineStats &operator+=(const PipelineStats &o) {
+        inflate_time += o.inflate_time, parse_time += o.parse_time, count_time += o.count_time, wall_time += o.wall_time;
+        zscore_time += o.zscore_time, emit_time += o.emit_time, distance_time += o.distance_time;
+        busy_time += o.busy_time, idle_time += o.idle_time;
+        files += o.files, bytes_in += o.bytes_in, bytes += o.bytes, records += o.records, bases += o.bases;
+        nbreaks += o.nbreaks, bytes_out += o.bytes_out;
+        return *this;
+    }
+    const char *limiting_stage() const {
+        return inflate_time >= parse_time && inflate_time >= count_time ? "inflate": parse_time >= count_time ? "parse": "count";
+    }
+    void print(std::FILE *fp) const {
+        auto rate = [](double n, double t) {return t > 0. ? n / t * 1e-6: 0.;};
+        std::fprintf(fp, "inflate\t%0.3f s\t%0.1f MB/s\n", inflate_time, rate(bytes, inflate_time));
+        std::fprintf(fp, "parse\t%0.3f s\t%0.1f MB/s\n", parse_time, rate(bytes, parse_time));
+        std::fprintf(fp, "count\t%0.3f s\t%0.1f Mbases/s\n", count_time, rate(bases, count_time));
+        if(zscore_time > 0.)   std::fprintf(fp, "zscore\t%0.3f s\n", zscore_time);
+        if(emit_time > 0.)     std::fprintf(fp, "emit\t%0.3f s\t%0.1f MB/s\n", emit_time, rate(bytes_out, emit_time));
+        if(distance_time > 0.) std::fprintf(fp, "distance\t%0.3f s\n", distance_time);
+        if(busy_time + idle_time > 0.)
+            std::fprintf(fp, "busy\t%0.3f s\tidle %0.3f s (%0.1f%%)\n", busy_time, idle_time, 100. * idle_time / (busy_time + idle_time));
+        std::fprintf(fp, "total\t%0.3f s\t%zu records, %zu bases, %zu N-breaks. Limited by %s.\n",
+                     wall_time, records, bases, nbreaks, limiting_stage());
+    }
+    // Names and values of every field, times in nanoseconds, for reports.
+    template<typename Fn>
+    void for_each(const Fn &fn) const {
+        auto ns = [](double t) {return size_t(t * 1e9);};
+        fn("inflate_ns", ns(inflate_time)), fn("parse_ns", ns(parse_time)), fn("count_ns", ns(count_time));
+        fn("zscore_ns", ns(zscore_time)), fn("emit_ns", ns(emit_time)), fn("distance_ns", ns(distance_time));
+        fn("wall_ns", ns(wall_time)), fn("busy_ns", ns(busy_time)), fn("idle_ns", ns(idle_time));
+        fn("files", files), fn("bytes_in", bytes_in), fn("bytes", bytes), fn("records", records), fn("bases", bases);
+        fn("nbreaks", nbreaks), fn("bytes_out", bytes_out);
+    }
+};
+
+// Writes total and each thread's statistics to path: as JSON if path ends in ".json", else as TSV
+// with one row per thread and a last row for the total. Per-thread wall times overlap.
+static inline void write_stats(const std::string &path, const PipelineStats &total, const std::vector<PipelineStats> &threads) {
+    std::FILE *fp = std::fopen(path.data(), "wb");
+    if(fp == nullptr) throw std::runtime_error(std::string("Could not open file at ") + path);
+    const bool json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+    if(json) {
+        auto obj = [fp](const PipelineStats &s) {
+            const char *sep = "{";
+            s.for_each([&](const char *name, size_t v) {std::fprintf(fp, "%s\"%s\": %zu", sep, name, v); sep = ", ";});
+            std::fputc('}', fp);
+        };
+        std::fputs("{\"total\": ", fp);
+        obj(total);
+        std::fputs(",\n \"threads\": [", fp);
+        for(size_t i = 0; i < threads.size(); ++i) {
+            std::fputs(i ? ",\n  ": "\n  ", fp);
+            obj(threads[i]);
+        }
+        std::fputs("\n ]}\n", fp);
+    } else {
+        std::fputs("#thread", fp);
+        total.for_each([fp](const char *name, size_t) {std::fprintf(fp, "\t%s", name);});
+        std::fputc('\n', fp);
+        auto row = [fp](const char *label, const PipelineStats &s) {
+            std::fputs(label, fp);
+            s.for_each([fp](const char *, size_t v) {std::fprintf(fp, "\t%zu", v);});
+            std::fputc('\n', fp);
+        };
+        for(size_t i = 0; i < threads.size(); ++i) row(std::to_string(i).data(), threads[i]);
+        row("total", total);
+    }
+    std::fclose(fp);
+}
+
+// Prints each thread's busy and idle time, to check how evenly work was spread.
+static inline void print_balance(std::FILE *fp, const std::vector<PipelineStats> &threads) {
+    for(size_t i = 0; i < threads.size(); ++i)
+        std::fprintf(fp, "thread %zu\tbusy %0.3f s\tidle %0.3f s\n", i, threads[i].busy_time, threads[i].idle_time);
+}
+
+// Adds the elapsed time to *dst on destruction, unless dst is null or KF_STATS is 0.
+class StageTimer {
+#if KF_STATS
+    double *dst_;
+    std::chrono::steady_clock::time_point start_;
+public:
+    StageTimer(double *dst): dst_(dst), start_(dst ? std::chrono::steady_clock::now(): std::chrono::steady_clock::time_point()) {}
+    ~StageTimer() {if(dst_) *dst_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();}
+#else
+public:
+    StageTimer(double *) {}
+#endif
+    StageTimer(const StageTimer &) = delete;
+    StageTimer &operator=(const StageTimer &) = delete;
+};
+
+// Process-wide running totals, printed to stderr every interval seconds between start() and
+// stop(). Counting adds to them a batch at a time, so updates cost an atomic add per batch.
+class Progress {
+    std::atomic<size_t> files_{0}, records_{0}, bases_{0};
+    size_t total_files_ = 0;
+    std::mutex m_;
+    std::condition_variable cv_;
+    bool running_ = false;
+    std::thread reporter_;
+    Progress() {}
+    void report(double elapsed) const {
+        const size_t bases = bases_.load(std::memory_order_relaxed);
+        std::fprintf(stderr, "progress\t%zu/%zu files\t%zu records\t%0.1f Mbases\t%0.1f Mbases/s\t%0.0f s\n",
+                     files_.load(std::memory_order_relaxed), total_files_, records_.load(std::memory_order_relaxed),
+                     bases * 1e-6, elapsed > 0. ? bases * 1e-6 / elapsed: 0., elapsed);
+    }
+public:
+    static Progress &get() {
+        static Progress ret;
+        return ret;
+    }
+    ~Progress() {stop();}
+    void add_bases(size_t records, size_t bases) {
+        records_.fetch_add(records, std::memory_order_relaxed), bases_.fetch_add(bases, std::memory_order_relaxed);
+    }
+    void add_file() {files_.fetch_add(1, std::memory_order_relaxed);}
+    void start(double interval, size_t total_files) {
+#if KF_STATS
+        stop();
+        total_files_ = total_files, running_ = true;
+        reporter_ = std::thread([this, interval]() {
+            const auto start = std::chrono::steady_clock::now();
+            const auto period = std::chrono::duration<double>(interval);
+            std::unique_lock<std::mutex> lock(m_);
+            while(!cv_.wait_for(lock, period, [this]() {return !running_;}))
+                report(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        });
+#else
+        (void)interval, (void)total_files;
+#endif
+    }
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            running_ = false;
+        }
+        cv_.notify_all();
+        if(reporter_.joinable()) reporter_.join();
+    }
+};
+
+} // namespace kf
@@ -0,0 +1,241 @@
+#pragma once
+#include "distmat.h"
+#include "kfreq.h"
+#include <random>
+
+#ifndef KF_LSH_TABLES
+#  define KF_LSH_TABLES 16u // Hash tables per index
+#endif
+#ifndef KF_LSH_BITS
+#  define KF_LSH_BITS 12u   // Hyperplanes, and so bits of bucket code, per table; at most 32
+#endif
+
+namespace kf {
+
+namespace freq {
+
+// Persistent random-projection (SimHash) index over standardized profiles, for Pearson or
+// cosine nearest-neighbour queries. Each table hashes a profile to the signs of its projections
+// onto KF_LSH_BITS random hyperplanes; profiles at a small angle mostly share a bucket in some
+// table. A query probes its own bucket in every table, plus the buckets across its least certain
+// hyperplanes, and reranks the candidates found there exactly.
+// The hyperplanes are very sparse (+1/-1 on about sqrt(d) coordinates), which keeps hashing cheap
+// and the index small even for long profiles.
+// The index file maps in place: a header, the hyperplanes, then for each table its bucket codes
+// sorted, the ids they belong to, and finally the inputs' names. Profiles stay in path.profiles.
+static const char KF_LSH [] {'#', 'k', 'f', 'l', 's', 'h', '\n', '\0'};
+static constexpr u32 KF_LSH_VERSION = 2;
+static constexpr u32 KF_LSH_NEG = 1u << 31; // Sign bit of a hyperplane coordinate
+
+struct alignas(KF_MAP_ALIGN) LSHHeader {
+    char     magic[sizeof(KF_LSH)];
+    u32      version;
+    uint16_t mink, k; // Profiles hold z-scores for k-mers of each length in [mink, k]
+    uint8_t  canonical, metric;
+    uint16_t tables, bits;
+    u32      nnz;  // Coordinates per hyperplane
+    u64      n, d; // Profiles, and their length
+    u64      tag;
+    u64      planes_off, codes_off, ids_off, names_off, file_bytes;
+};
+
+struct Neighbour {
+    u32    id;
+    double sim;
+    bool operator<(const Neighbour &o) const {return sim > o.sim || (sim == o.sim && id < o.id);}
+};
+
+// Bucket codes of standardized profile p in every table, and optionally the projections themselves.
+template<typename FloatType>
+void lsh_codes(const u32 *planes, unsigned tables, unsigned bits, unsigned nnz, const FloatType *p, u32 *codes, double *proj=nullptr) {
+    for(unsigned t = 0; t < tables; ++t) {
+        u32 code = 0;
+        for(unsigned b = 0; b < bits; ++b) {
+            const u32 *pl = planes + (size_t(t) * bits + b) * nnz;
+            double s = 0.;
+            for(unsigned i = 0; i < nnz; ++i) s += pl[i] & KF_LSH_NEG ? -double(p[pl[i] ^ KF_LSH_NEG]): double(p[pl[i]]);
+            code |= u32(s >= 0.) << b;
+            if(proj) proj[t * bits + b] = s;
+        }
+        codes[t] = code;
+    }
+}
+
+// Writes an index over the rows of m, which must be standardized for metric (Pearson or cosine).
+// mink, k and canonical record how the profiles were counted, so that queries are profiled the same way.
+template<typename FloatType>
+void build_lsh_index(const std::string &path, const ProfileMatrix<FloatType> &m, const std::vector<std::string> &names,
+                     unsigned mink, unsigned k, bool canonical, Metric metric, u64 tag,
+                     unsigned tables=KF_LSH_TABLES, unsigned bits=KF_LSH_BITS, u64 seed=137) {
+    if(metric == EUCLIDEAN) throw std::runtime_error("LSH indexes support Pearson and cosine similarity only.");
+    if(!tables || !bits || bits > 32) throw std::runtime_error("LSH indexes need 1 to 32 bits per table.");
+    if(names.size() != m.size()) throw std::runtime_error("Need one name per profile.");
+    if(m.size() >= KF_LSH_NEG) throw std::runtime_error("Too many profiles for an LSH index.");
+    const size_t n = m.size(), d = m.dim();
+    const unsigned nnz = std::min<size_t>(d, std::max<size_t>(32, std::sqrt(double(d))));
+    LSHHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, KF_LSH, sizeof(KF_LSH));
+    h.version = KF_LSH_VERSION, h.mink = mink, h.k = k, h.canonical = canonical, h.metric = metric;
+    h.tables = tables, h.bits = bits, h.nnz = nnz, h.n = n, h.d = d, h.tag = tag;
+    std::vector<u32> planes(size_t(tables) * bits * nnz);
+    std::mt19937_64 mt(seed);
+    std::vector<u32> perm(d);
+    std::vector<size_t> swapped(nnz);
+    for(size_t i = 0; i < d; ++i) perm[i] = i;
+    for(size_t p = 0; p < size_t(tables) * bits; ++p) {
+        // nnz distinct coordinates by partial Fisher-Yates, each with a random sign. The swaps are
+        // undone afterwards rather than resetting all of perm for every hyperplane.
+        for(unsigned i = 0; i < nnz; ++i) {
+            std::swap(perm[i], perm[swapped[i] = i + mt() % (d - i)]);
+            planes[p * nnz + i] = perm[i] | (mt() & 1 ? KF_LSH_NEG: 0u);
+        }
+        for(unsigned i = nnz; i--;) std::swap(perm[i], perm[swapped[i]]);
+        std::sort(&planes[p * nnz], &planes[p * nnz + nnz], [](u32 x, u32 y) {return (x & ~KF_LSH_NEG) < (y & ~KF_LSH_NEG);});
+    }
+    std::vector<u32> codes(tables * n);
+    #pragma omp parallel for schedule(dynamic, 16)
+    for(size_t i = 0; i < n; ++i) {
+        std::vector<u32> c(tables);
+        lsh_codes(planes.data(), tables, bits, nnz, m.row(i), c.data());
+        for(unsigned t = 0; t < tables; ++t) codes[t * n + i] = c[t];
+    }
+    std::vector<u32> ids(tables * n);
+    #pragma omp parallel for
+    for(unsigned t = 0; t < tables; ++t) {
+        u32 *ti = &ids[t * n], *tc = &codes[t * n];
+        for(size_t i = 0; i < n; ++i) ti[i] = i;
+        std::sort(ti, ti + n, [tc](u32 x, u32 y) {return tc[x] < tc[y] || (tc[x] == tc[y] && x < y);});
+        std::vector<u32> sorted(n);
+        for(size_t i = 0; i < n; ++i) sorted[i] = tc[ti[i]];
+        std::copy(sorted.begin(), sorted.end(), tc);
+    }
+    size_t names_bytes = 0;
+    for(const auto &s: names) names_bytes += s.size() + 1;
+    h.planes_off = sizeof(h);
+    h.codes_off  = map_align(h.planes_off + planes.size() * sizeof(u32));
+    h.ids_off    = map_align(h.codes_off + codes.size() * sizeof(u32));
+    h.names_off  = map_align(h.ids_off + ids.size() * sizeof(u32));
+    h.file_bytes = h.names_off + names_bytes;
+    std::FILE *fp = std::fopen(path.data(), "wb");
+    if(fp == nullptr) throw std::runtime_error(std::string("Could not open file for output at ") + path);
+    static const char zeros[KF_MAP_ALIGN] {};
+    size_t off = 0;
+    bool ok = true;
+    auto put = [&](u64 at, const void *data, size_t nb) {
+        ok = ok && std::fwrite(zeros, 1, at - off, fp) == at - off && std::fwrite(data, 1, nb, fp) == nb;
+        off = at + nb;
+    };
+    put(0, &h, sizeof(h));
+    put(h.planes_off, planes.data(), planes.size() * sizeof(u32));
+    put(h.codes_off, codes.data(), codes.size() * sizeof(u32));
+    put(h.ids_off, ids.data(), ids.size() * sizeof(u32));
+    for(const auto &s: names) put(off, s.data(), s.size() + 1);
+    if(std::fclose(fp) || !ok) throw std::runtime_error(std::string("Could not write LSH index to ") + path);
+}
+
+// Length of the z-score profiles an index's header describes.
+static inline size_t lsh_profile_dim(const LSHHeader &h) {
+    size_t ret = 0;
+    for(unsigned k = h.mink; k <= std::min<unsigned>(h.k, 16); ++k) ret += zscore_size(k, h.canonical);
+    return ret;
+}
+
+// A mapped index, with the profiles it was built over (path.profiles).
+template<typename FloatType>
+class LSHIndex {
+    ReadOnlyMap file_;
+    std::unique_ptr<DiskMatrix<FloatType>> profiles_;
+    const u32   *planes_, *codes_, *ids_;
+    std::vector<const char *> names_;
+    const char *base() const {return static_cast<const char *>(file_.data());}
+public:
+    LSHIndex(const std::string &path): file_(path.data(), sizeof(LSHHeader)) {
+        const LSHHeader &h = header();
+        const char *err = nullptr;
+        if(std::memcmp(h.magic, KF_LSH, sizeof(KF_LSH)))                                err = "Unexpected magic string";
+        else if(h.version != KF_LSH_VERSION)                                             err = "Unsupported version or byte order";
+        else if(h.file_bytes != file_.size() || !h.bits || h.bits > 32 || !h.tables ||
+                h.planes_off + u64(h.tables) * h.bits * h.nnz * sizeof(u32) > h.codes_off ||
+                h.codes_off + h.tables * h.n * sizeof(u32) > h.ids_off ||
+                h.ids_off + h.tables * h.n * sizeof(u32) > h.names_off)                  err = "Size does not match header";
+        else if(h.mink < 3 || h.mink > h.k || h.k > 16 || h.d != lsh_profile_dim(h))      err = "K range does not match the profiles";
+        if(err) throw std::runtime_error(std::string(err) + " in LSH index at " + path);
+        planes_ = reinterpret_cast<const u32 *>(base() + h.planes_off);
+        codes_  = reinterpret_cast<const u32 *>(base() + h.codes_off);
+        ids_    = reinterpret_cast<const u32 *>(base() + h.ids_off);
+        for(const char *p = base() + h.names_off, *e = base() + h.file_bytes; p < e; p += std::strlen(p) + 1) {
+            if(!std::memchr(p, '\0', e - p)) throw std::runtime_error(std::string("Unterminated name in LSH index at ") + path);
+            names_.push_back(p);
+        }
+        if(names_.size() != h.n) throw std::runtime_error(std::string("Wrong number of names in LSH index at ") + path);
+        for(size_t i = 0; i < h.tables * h.bits * size_t(h.nnz); ++i)
+            if((planes_[i] & ~KF_LSH_NEG) >= h.d) throw std::runtime_error(std::string("Hyperplane out of range in LSH index at ") + path);
+        for(size_t i = 0; i < h.tables * h.n; ++i)
+            if(ids_[i] >= h.n) throw std::runtime_error(std::string("Id out of range in LSH index at ") + path);
+        profiles_.reset(new DiskMatrix<FloatType>(path + ".profiles", KF_PROF));
+        if(profiles_->rows() != h.n || profiles_->cols() != h.d || profiles_->header().tag != h.tag)
+            throw std::runtime_error(std::string("Profiles do not match the LSH index at ") + path);
+    }
+    const LSHHeader &header() const {return *reinterpret_cast<const LSHHeader *>(base());}
+    size_t size() const {return header().n;}
+    size_t dim()  const {return header().d;}
+    unsigned mink() const {return header().mink;}
+    unsigned k()  const {return header().k;}
+    bool canonical() const {return header().canonical;}
+    Metric metric() const {return Metric(header().metric);}
+    const char *name(size_t i) const {return names_[i];}
+    const FloatType *profile(size_t i) const {return profiles_->row(i);}
+
+    // Similarities of standardized q to the profiles in ids, best first, at most topk of them.
+    std::vector<Neighbour> rerank(const FloatType *q, const std::vector<u32> &ids, size_t topk) const {
+        std::vector<Neighbour> ret(ids.size());
+        for(size_t i = 0; i < ids.size(); ++i) {
+            const FloatType *r = profile(ids[i]);
+            double s = 0.;
+            #pragma omp simd reduction(+:s)
+            for(size_t j = 0; j < dim(); ++j) s += double(q[j]) * r[j];
+            ret[i] = Neighbour{ids[i], std::min(std::max(s, -1.), 1.)};
+        }
+        topk = std::min(topk, ret.size());
+        std::partial_sort(ret.begin(), ret.begin() + topk, ret.end());
+        ret.resize(topk);
+        return ret;
+    }
+    // Brute force over every profile.
+    std::vector<Neighbour> exact(const FloatType *q, size_t topk) const {
+        std::vector<u32> all(size());
+        for(size_t i = 0; i < all.size(); ++i) all[i] = i;
+        return rerank(q, all, topk);
+    }
+    // Approximate top-k neighbours of standardized q: probes its bucket in every table and the
+    // buckets across each of its probes least certain hyperplanes, then reranks what it finds.
+    // Falls back to brute force if that finds fewer than topk candidates.
+    std::vector<Neighbour> query(const FloatType *q, size_t topk, unsigned probes=2) const {
+        const LSHHeader &h = header();
+        std::vector<u32> codes(h.tables), order(h.bits), cand;
+        std::vector<double> proj(size_t(h.tables) * h.bits);
+        lsh_codes(planes_, h.tables, h.bits, h.nnz, q, codes.data(), proj.data());
+        probes = std::min<unsigned>(probes, h.bits);
+        for(unsigned t = 0; t < h.tables; ++t) {
+            const u32 *tc = codes_ + t * h.n, *ti = ids_ + t * h.n;
+            const double *tp = &proj[t * h.bits];
+            for(unsigned b = 0; b < h.bits; ++b) order[b] = b;
+            std::partial_sort(order.begin(), order.begin() + probes, order.end(),
+                              [tp](u32 x, u32 y) {return std::abs(tp[x]) < std::abs(tp[y]);});
+            for(unsigned p = 0; p <= probes; ++p) {
+                const u32 code = p ? codes[t] ^ (1u << order[p - 1]): codes[t];
+                const auto range = std::equal_range(tc, tc + h.n, code);
+                for(const u32 *c = range.first; c < range.second; ++c) cand.push_back(ti[c - tc]);
+            }
+        }
+        std::sort(cand.begin(), cand.end());
+        cand.erase(std::unique(cand.begin(), cand.end()), cand.end());
+        if(cand.size() < std::min(topk, size())) return exact(q, topk);
+        return rerank(q, cand, topk);
+    }
+};
+
+} // namespace freq
+
+} // namespace kf
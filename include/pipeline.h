@@ -0,0 +1,284 @@
+#pragma once
+#include "bgzf.h"
+#include "kfstats.h"
+#include "seqbatch.h"
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <sys/stat.h>
+#ifdef _OPENMP
+#  include <omp.h>
+#endif
+
+#ifndef KF_PIPE_CHUNK_BYTES
+#  define KF_PIPE_CHUNK_BYTES (1u << 22) // Decompressed bytes per buffer handed from inflate to parse
+#endif
+#ifndef KF_PIPE_CHUNKS
+#  define KF_PIPE_CHUNKS 4u              // Buffers between inflate and parse
+#endif
+#ifndef KF_PIPE_INFLATE_THREADS
+#  define KF_PIPE_INFLATE_THREADS 0u     // Most threads inflating one BGZF input; 0 for as many as are asked for
+#endif
+#ifndef KF_PIPE_BATCHES
+#  define KF_PIPE_BATCHES 3u             // SeqBatches between parse and count
+#endif
+
+namespace kf {
+
+// Fixed-capacity blocking queue. pop() returns false once the queue is closed and drained.
+template<typename T>
+class BoundedQueue {
+    std::mutex              m_;
+    std::condition_variable cv_;
+    std::vector<T>          buf_;
+    size_t head_ = 0, n_ = 0;
+    bool closed_ = false;
+public:
+    BoundedQueue(size_t capacity): buf_(capacity) {}
+    // Returns false, dropping x, if the queue has been closed.
+    bool push(T x) {
+        std::unique_lock<std::mutex> lock(m_);
+        cv_.wait(lock, [this]() {return n_ < buf_.size() || closed_;});
+        if(closed_) return false;
+        buf_[(head_ + n_++) % buf_.size()] = std::move(x);
+        cv_.notify_all();
+        return true;
+    }
+    bool pop(T &x) {
+        std::unique_lock<std::mutex> lock(m_);
+        cv_.wait(lock, [this]() {return n_ || closed_;});
+        if(!n_) return false;
+        x = std::move(buf_[head_]);
+        head_ = (head_ + 1) % buf_.size(), --n_;
+        cv_.notify_all();
+        return true;
+    }
+    void close() {
+        std::lock_guard<std::mutex> lock(m_);
+        closed_ = true;
+        cv_.notify_all();
+    }
+};
+
+// Reads FASTA/FASTQ (plain or gzipped) into SeqBatches on two threads: one inflates the file
+// into large buffers and the other parses them, so that the caller only counts.
+// BGZF input is inflated a buffer's worth of blocks at a time across nthreads; anything else
+// goes through a single gzread stream. Callers pass the threads they count on, so up to
+// 2 * nthreads threads are busy while both stages run at once. Counting waits on inflation when
+// it falls behind, which is when the team pays off; define KF_PIPE_INFLATE_THREADS to cap the
+// team where the oversubscription costs more than it gains.
+// Buffers and batches come from fixed pools and are handed back once used, which bounds memory
+// and keeps allocation off the hot path after the first few batches.
+class SeqPipeline {
+    using clk = std::chrono::steady_clock;
+    struct Chunk {
+        std::vector<char> data;
+        size_t n = 0;
+    };
+    std::unique_ptr<BGZFReader> bgzf_;
+    gzFile fp_; // Used unless the input is BGZF
+    unsigned nthreads_;
+    std::vector<Chunk>    chunks_;
+    std::vector<SeqBatch> batches_;
+    BoundedQueue<Chunk *>    free_chunks_, full_chunks_;
+    BoundedQueue<SeqBatch *> free_batches_, full_batches_;
+    std::exception_ptr err_;
+    std::mutex         err_mutex_;
+    PipelineStats      stats_;
+    clk::time_point    start_;
+    std::thread inflater_, parser_;
+    size_t max_bases_;
+    bool names_;
+
+    static double since(clk::time_point t) {return std::chrono::duration<double>(clk::now() - t).count();}
+    void fail() {
+        {
+            std::lock_guard<std::mutex> lock(err_mutex_);
+            if(!err_) err_ = std::current_exception();
+        }
+        shutdown();
+    }
+    void shutdown() {
+        free_chunks_.close(), full_chunks_.close(), free_batches_.close(), full_batches_.close();
+    }
+    void inflate_bgzf() {
+        std::vector<uint8_t> raw;
+        std::vector<BGZFReader::Block> blocks;
+        std::vector<z_stream> streams(nthreads_);
+        for(auto &zs: streams) std::memset(&zs, 0, sizeof(zs));
+        struct Cleanup {
+            std::vector<z_stream> &s;
+            ~Cleanup() {for(auto &zs: s) inflateEnd(&zs);}
+        } cleanup{streams};
+        for(auto &zs: streams)
+            if(inflateInit2(&zs, -15) != Z_OK) throw std::runtime_error("Could not initialize inflate stream.");
+        Chunk *c;
+        while(free_chunks_.pop(c)) {
+            KF_STAT(const auto t = clk::now());
+            const size_t n = bgzf_->next(raw, blocks, c->data.size());
+            if(n == 0) break;
+            std::exception_ptr err;
+            #pragma omp parallel for num_threads(nthreads_) schedule(dynamic)
+            for(size_t i = 0; i < blocks.size(); ++i) {
+#ifdef _OPENMP
+                z_stream &zs = streams[omp_get_thread_num()];
+#else
+                z_stream &zs = streams[0];
+#endif
+                try {
+                    BGZFReader::inflate_block(zs, raw.data(), blocks[i], c->data.data());
+                } catch(...) {
+                    #pragma omp critical
+                    err = std::current_exception();
+                }
+            }
+            if(err) std::rethrow_exception(err);
+            KF_STAT(stats_.inflate_time += since(t), stats_.bytes += n);
+            c->n = n;
+            if(!full_chunks_.push(c)) return;
+        }
+        full_chunks_.close();
+    }
+    void inflate() {
+        try {
+            if(bgzf_) {
+                inflate_bgzf();
+                return;
+            }
+            Chunk *c;
+            while(free_chunks_.pop(c)) {
+                KF_STAT(const auto t = clk::now());
+                const int n = gzread(fp_, c->data.data(), c->data.size());
+                KF_STAT(stats_.inflate_time += since(t));
+                if(n < 0) throw std::runtime_error("Could not decompress input.");
+                if(n == 0) break;
+                c->n = n;
+                KF_STAT(stats_.bytes += n);
+                if(!full_chunks_.push(c)) return;
+            }
+            full_chunks_.close();
+        } catch(...) {fail();}
+    }
+    void parse() {
+        try {
+            // START: between records; HEADER, PLUS: skipping the rest of a line;
+            // SEQ: reading sequence lines; QUAL: skipping quality values.
+            enum {START, HEADER, SEQ, PLUS, QUAL} state = START;
+            bool bol = true, in_record = false, naming = false; // naming: in a header, before any whitespace
+            KF_STAT(bool in_break = false);
+            size_t seqstart = 0, seqlen = 0, qlen = 0;
+            SeqBatch *batch;
+            if(!free_batches_.pop(batch)) return;
+            batch->clear();
+            auto end_record = [&]() -> bool {
+                batch->end_record(), in_record = false;
+                KF_STAT(++stats_.records);
+                seqlen = batch->bases() - seqstart;
+                if(batch->bases() < max_bases_) return true;
+                KF_STAT(stats_.bases += batch->bases());
+                if(!full_batches_.push(batch) || !free_batches_.pop(batch)) return false;
+                batch->clear();
+                return true;
+            };
+            Chunk *c;
+            while(full_chunks_.pop(c)) {
+                KF_STAT(const auto t = clk::now());
+                const char *p = c->data.data(), *const e = p + c->n;
+                while(p < e) {
+                    if(state == QUAL && bol && qlen >= seqlen) state = START;
+                    if(bol && (state == START || state == SEQ) && (*p == '>' || *p == '@')) {
+                        if(in_record && !end_record()) return;
+                        state = HEADER, in_record = true, naming = names_, seqstart = batch->bases(), ++p;
+                        KF_STAT(in_break = false);
+                        continue;
+                    }
+                    if(bol && state == SEQ && *p == '+') {
+                        if(!end_record()) return;
+                        state = PLUS, qlen = 0;
+                    }
+                    const char *nl = static_cast<const char *>(std::memchr(p, '\n', e - p)), *le = nl ? nl: e;
+                    if(naming) {
+                        // A name runs to the first whitespace, as kseq reads it, and may span chunks.
+                        const char *ne = p;
+                        while(ne < le && !std::isspace(static_cast<unsigned char>(*ne))) ++ne;
+                        batch->append_name(p, ne - p);
+                        naming = ne == le && !nl;
+                    }
+                    if(state == SEQ || state == QUAL) {
+                        const char *se = le;
+                        while(se > p && se[-1] == '\r') --se;
+                        if(state == SEQ) {
+                            batch->append(p, se - p);
+                            KF_STAT(stats_.nbreaks += count_breaks(p, se - p, in_break));
+                        }
+                        else             qlen += se - p;
+                    }
+                    if(nl && state == HEADER) state = SEQ;
+                    else if(nl && state == PLUS) state = QUAL;
+                    bol = nl != nullptr, p = nl ? nl + 1: e;
+                }
+                KF_STAT(stats_.parse_time += since(t));
+                if(!free_chunks_.push(c)) return;
+            }
+            if(in_record) {
+                batch->end_record();
+                KF_STAT(++stats_.records);
+            }
+            if(!batch->empty()) {
+                KF_STAT(stats_.bases += batch->bases());
+                if(!full_batches_.push(batch)) return;
+            }
+            full_batches_.close();
+        } catch(...) {fail();}
+    }
+public:
+    // Record names are kept in each batch if names is set.
+    SeqPipeline(const char *path, size_t max_bases=KF_BATCH_BASES, unsigned nthreads=1, bool names=false):
+        bgzf_(is_bgzf(path) ? new BGZFReader(path): nullptr), fp_(bgzf_ ? nullptr: gzopen(path, "rb")),
+        nthreads_(std::max(KF_PIPE_INFLATE_THREADS ? std::min(nthreads, unsigned(KF_PIPE_INFLATE_THREADS)): nthreads, 1u)),
+        chunks_(KF_PIPE_CHUNKS), batches_(KF_PIPE_BATCHES),
+        free_chunks_(KF_PIPE_CHUNKS), full_chunks_(KF_PIPE_CHUNKS),
+        free_batches_(KF_PIPE_BATCHES), full_batches_(KF_PIPE_BATCHES), start_(clk::now()), max_bases_(max_bases), names_(names)
+    {
+        if(fp_) gzbuffer(fp_, 1u << 17);
+        else if(!bgzf_) throw std::runtime_error(std::string("Could not open file at ") + path);
+        KF_STAT(struct stat st; if(::stat(path, &st) == 0) stats_.files = 1, stats_.bytes_in = st.st_size);
+        // A buffer must hold at least a whole BGZF block.
+        for(auto &c: chunks_) c.data.resize(bgzf_ ? std::max<size_t>(KF_PIPE_CHUNK_BYTES, BGZF_MAX_BLOCK): KF_PIPE_CHUNK_BYTES), free_chunks_.push(&c);
+        for(auto &b: batches_) b.seq_.reserve(max_bases + (max_bases >> 2)), free_batches_.push(&b);
+        inflater_ = std::thread(&SeqPipeline::inflate, this);
+        parser_   = std::thread(&SeqPipeline::parse, this);
+    }
+    ~SeqPipeline() {
+        shutdown();
+        inflater_.join(), parser_.join();
+        if(fp_) gzclose(fp_);
+    }
+    SeqPipeline(const SeqPipeline &) = delete;
+    SeqPipeline &operator=(const SeqPipeline &) = delete;
+    // Returns the next batch, or nullptr once the input is exhausted. Hand each back with release().
+    // Rethrows anything thrown while reading.
+    SeqBatch *next() {
+        SeqBatch *ret;
+        if(full_batches_.pop(ret)) return ret;
+        std::lock_guard<std::mutex> lock(err_mutex_);
+        if(err_) std::rethrow_exception(err_);
+        return nullptr;
+    }
+    void release(SeqBatch *batch) {free_batches_.push(batch);}
+    // Adds time spent by the consumer to the statistics.
+    void add_count_time(double t) {KF_STAT(stats_.count_time += t); (void)t;}
+    // Only complete once next() has returned nullptr.
+    PipelineStats stats() const {
+        PipelineStats ret(stats_);
+        KF_STAT(ret.wall_time = since(start_));
+        return ret;
+    }
+};
+
+} // namespace kf
@@ -0,0 +1,296 @@
+#pragma once
+#include "kfdist.h"
+#include "kfmap.h"
+#include <cerrno>
+#include <unordered_map>
+#include <sys/file.h>
+#if defined(__F16C__)
+#  include <immintrin.h>
+#endif
+
+#ifndef KF_PDB_MIN_ROWS
+#  define KF_PDB_MIN_ROWS 256u // Rows reserved when a database is created; capacity at least doubles when it runs out
+#endif
+#ifndef KF_PDB_APPEND
+#  define KF_PDB_APPEND 256u   // Inputs profiled in memory per append when filling a database from many inputs
+#endif
+
+namespace kf {
+
+namespace freq {
+
+// Profiles of many inputs in one file, appended to in place and mapped for reading:
+// a KF_MAP_ALIGN-byte header, then `capacity` rows of `stride` values each (float32, or
+// float16 to halve the size), then the names of the stored rows, NUL-terminated in row order.
+// Rows past `rows` are spare capacity, so appends write new rows and names past what readers
+// use and then commit them by rewriting the header. A crash mid-append leaves the previous
+// contents, and the next append writes over its leftovers. When the capacity runs out, the file
+// is copied into a larger one, which is renamed over it.
+// Appenders serialize on an flock of path.lock; readers take it shared while they open the file,
+// and copy the header, so that later appends do not change what they see.
+// Fields are in host byte order, so a file from a machine of the other endianness fails the
+// version check.
+static const char KF_PDB [] {'#', 'k', 'f', 'p', 'd', 'b', '\n', '\0'};
+static constexpr u32 KF_PDB_VERSION = 1;
+
+// Padded rather than aligned, so that readers can keep a copy of it without over-aligned new.
+struct ProfileDBHeader {
+    char     magic[sizeof(KF_PDB)];
+    u32      version;
+    uint16_t mink, maxk;
+    uint8_t  value_bytes; // 4: float32, 2: float16
+    uint8_t  canonical;
+    uint8_t  values;      // ProfileValues; 0, z-scores, in files from before it was recorded
+    uint8_t  reserved[5];
+    u64      dim, stride;  // Values per profile, and per row
+    u64      rows;         // Profiles stored
+    u64      capacity;     // Rows there is space for
+    u64      names_offset; // Byte offset of the names,
+    u64      names_bytes;  // and their length
+    u64      spare[7];     // Pads the header to 128 bytes, keeping rows aligned
+};
+static_assert(sizeof(ProfileDBHeader) % KF_MAP_ALIGN == 0, "Rows of a profile database must start aligned.");
+
+// IEEE half precision, rounding to nearest even. Values past the half range become infinite.
+static inline uint16_t float_to_half(float f) {
+    u32 x;
+    std::memcpy(&x, &f, sizeof(x));
+    const uint16_t sign = (x >> 16) & 0x8000u;
+    x &= 0x7FFFFFFFu;
+    if(x >= 0x7F800000u) return sign | 0x7C00u | (x > 0x7F800000u ? 0x200u: 0u);
+    if(x >= 0x477FF000u) return sign | 0x7C00u;
+    u32 h, rem, half;
+    if(x >= 0x38800000u) { // Normal
+        h = (x - 0x38000000u) >> 13, rem = x & 0x1FFFu, half = 0x1000u;
+    } else {               // Subnormal, or zero
+        if(x < 0x33000000u) return sign;
+        const u32 shift = 126 - (x >> 23), m = (x & 0x7FFFFFu) | 0x800000u;
+        h = m >> shift, rem = m & ((1u << shift) - 1), half = 1u << (shift - 1);
+    }
+    h += rem > half || (rem == half && (h & 1));
+    return sign | h;
+}
+static inline float half_to_float(uint16_t h) {
+    const u32 sign = u32(h & 0x8000u) << 16, e = (h >> 10) & 0x1Fu, m = h & 0x3FFu;
+    if(!e) {
+        const float f = std::ldexp(float(m), -24);
+        return sign ? -f: f;
+    }
+    const u32 x = sign | (e == 31 ? 0x7F800000u | (m << 13): ((e + 112) << 23) | (m << 13));
+    float ret;
+    std::memcpy(&ret, &x, sizeof(ret));
+    return ret;
+}
+template<typename FloatType>
+void to_half(const FloatType *in, uint16_t *out, size_t n) {
+    size_t i = 0;
+#if defined(__F16C__)
+    if(std::is_same<FloatType, float>::value)
+        for(; i + 8 <= n; i += 8)
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                             _mm256_cvtps_ph(_mm256_loadu_ps(reinterpret_cast<const float *>(in) + i), _MM_FROUND_TO_NEAREST_INT));
+#endif
+    for(; i < n; ++i) out[i] = float_to_half(in[i]);
+}
+template<typename FloatType>
+void from_half(const uint16_t *in, FloatType *out, size_t n) {
+    size_t i = 0;
+#if defined(__F16C__)
+    if(std::is_same<FloatType, float>::value)
+        for(; i + 8 <= n; i += 8)
+            _mm256_storeu_ps(reinterpret_cast<float *>(out) + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i))));
+#endif
+    for(; i < n; ++i) out[i] = half_to_float(in[i]);
+}
+
+// flock on path + ".lock", released on destruction.
+class DBLock {
+    int fd_;
+public:
+    DBLock(const std::string &path, bool exclusive): fd_(::open((path + ".lock").data(), O_RDWR | O_CREAT, 0644)) {
+        if(fd_ < 0) throw std::runtime_error(std::string("Could not open lock file for ") + path);
+        while(::flock(fd_, exclusive ? LOCK_EX: LOCK_SH)) {
+            if(errno == EINTR) continue;
+            ::close(fd_);
+            throw std::runtime_error(std::string("Could not lock ") + path);
+        }
+    }
+    DBLock(const DBLock &) = delete;
+    DBLock &operator=(const DBLock &) = delete;
+    ~DBLock() {::close(fd_);} // Closing releases the lock
+};
+
+static inline const char *check_db_header(const ProfileDBHeader &h, size_t file_bytes) {
+    if(std::memcmp(h.magic, KF_PDB, sizeof(KF_PDB))) return "Unexpected magic string";
+    if(h.version != KF_PDB_VERSION)                  return "Unsupported version or byte order";
+    if(h.value_bytes != 2 && h.value_bytes != 4)     return "Unsupported value width";
+    if(h.values > FREQUENCIES)                       return "Unsupported profile values";
+    if(h.stride < h.dim || h.rows > h.capacity || h.names_offset != sizeof(h) + h.capacity * h.stride * h.value_bytes ||
+       h.names_offset + h.names_bytes > file_bytes)  return "Size does not match header";
+    return nullptr;
+}
+
+// Read-only view of a profile database, as it was when opened.
+class ProfileDB {
+    std::unique_ptr<ReadOnlyMap> map_;
+    ProfileDBHeader h_;
+    std::vector<const char *> names_;
+    std::unordered_map<std::string, size_t> index_;
+    const char *rows_;
+public:
+    ProfileDB(const std::string &path) {
+        {
+            DBLock lock(path, false);
+            map_.reset(new ReadOnlyMap(path.data(), sizeof(ProfileDBHeader)));
+            std::memcpy(&h_, map_->data(), sizeof(h_));
+        }
+        if(const char *err = check_db_header(h_, map_->size()))
+            throw std::runtime_error(std::string(err) + " in profile database at " + path);
+        rows_ = static_cast<const char *>(map_->data()) + sizeof(ProfileDBHeader);
+        const char *p = static_cast<const char *>(map_->data()) + h_.names_offset, *const e = p + h_.names_bytes;
+        names_.reserve(h_.rows), index_.reserve(h_.rows);
+        while(names_.size() < h_.rows) {
+            const char *end = static_cast<const char *>(std::memchr(p, '\0', e - p));
+            if(end == nullptr) throw std::runtime_error(std::string("Truncated names in profile database at ") + path);
+            index_[p] = names_.size(); // A name appended again refers to its latest profile.
+            names_.push_back(p);
+            p = end + 1;
+        }
+    }
+    size_t size()   const {return h_.rows;}
+    size_t dim()    const {return h_.dim;}
+    size_t stride() const {return h_.stride;}
+    unsigned mink() const {return h_.mink;}
+    unsigned maxk() const {return h_.maxk;}
+    bool canonical() const {return h_.canonical;}
+    bool half()     const {return h_.value_bytes == 2;}
+    ProfileValues values() const {return ProfileValues(h_.values);}
+    const ProfileDBHeader &header() const {return h_;}
+    const char *name(size_t i) const {return names_[i];}
+    std::vector<std::string> names() const {return std::vector<std::string>(names_.begin(), names_.end());}
+    // Row of the profile named name, or size() if there is none.
+    size_t find(const std::string &name) const {
+        const auto it = index_.find(name);
+        return it == index_.end() ? size(): it->second;
+    }
+    // Stored values of row i: float or uint16_t, as half() says.
+    const void *row(size_t i) const {return rows_ + i * h_.stride * h_.value_bytes;}
+    template<typename FloatType>
+    void get(size_t i, FloatType *out) const {
+        if(half()) from_half(static_cast<const uint16_t *>(row(i)), out, dim());
+        else {
+            const float *r = static_cast<const float *>(row(i));
+            std::copy(r, r + dim(), out);
+        }
+    }
+    // Copies every profile into m, which must be size() x dim().
+    template<typename FloatType>
+    void load(ProfileMatrix<FloatType> &m) const {
+        if(m.size() != size() || m.dim() != dim()) throw std::runtime_error("Profile matrix does not match the database.");
+        #pragma omp parallel for schedule(static)
+        for(size_t i = 0; i < size(); ++i) get(i, m.row(i));
+    }
+};
+
+static inline void pwrite_all(int fd, const void *data, size_t nb, u64 off, const std::string &path) {
+    for(const char *p = static_cast<const char *>(data); nb;) {
+        const ssize_t w = ::pwrite(fd, p, nb, off);
+        if(w < 0 && errno == EINTR) continue;
+        if(w <= 0) throw std::runtime_error(std::string("Could not write profile database at ") + path);
+        p += w, nb -= w, off += w;
+    }
+}
+
+// Moves the database open at fd into a new file with space for capacity rows, renamed over path,
+// returning its descriptor. Called with the lock held.
+static inline int grow_db(int fd, ProfileDBHeader &h, u64 capacity, const std::string &path) {
+    const std::string tmp = path + ".tmp" + std::to_string(::getpid());
+    const int out = ::open(tmp.data(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(out < 0) throw std::runtime_error(std::string("Could not open file for output at ") + tmp);
+    ProfileDBHeader nh = h;
+    nh.capacity = capacity;
+    nh.names_offset = sizeof(nh) + capacity * h.stride * h.value_bytes;
+    std::vector<char> buf(1u << 20);
+    auto copy = [&](u64 from, u64 to, u64 nb) {
+        for(u64 done = 0; done < nb;) {
+            const ssize_t r = ::pread(fd, buf.data(), std::min<u64>(buf.size(), nb - done), from + done);
+            if(r <= 0) throw std::runtime_error(std::string("Could not read profile database at ") + path);
+            pwrite_all(out, buf.data(), r, to + done, tmp);
+            done += r;
+        }
+    };
+    // Spare rows stay sparse.
+    if(::ftruncate(out, nh.names_offset)) throw std::runtime_error(std::string("Could not allocate ") + tmp);
+    copy(sizeof(h), sizeof(nh), h.rows * h.stride * h.value_bytes);
+    copy(h.names_offset, nh.names_offset, h.names_bytes);
+    pwrite_all(out, &nh, sizeof(nh), 0, tmp);
+    if(::fsync(out) || std::rename(tmp.data(), path.data())) {
+        ::close(out);
+        throw std::runtime_error(std::string("Could not replace ") + path + " with " + tmp);
+    }
+    ::close(fd);
+    h = nh;
+    return out;
+}
+
+// Appends the profiles in the rows of m, named names, to the database at path, creating it if
+// need be. Every profile in a database has the same k range, strandedness, values and value
+// width; half selects float16 for a new database and must match an existing one. Safe to call
+// from several processes at once.
+template<typename FloatType>
+void append_profiles(const std::string &path, const ProfileMatrix<FloatType> &m, const std::vector<std::string> &names,
+                     unsigned mink, unsigned maxk, bool canonical, bool half=false, ProfileValues values=ZSCORES) {
+    if(names.size() != m.size()) throw std::runtime_error("Need one name per profile.");
+    for(const auto &n: names)
+        if(n.find('\0') != std::string::npos) throw std::runtime_error("Profile names cannot contain NUL.");
+    DBLock lock(path, true);
+    int fd = ::open(path.data(), O_RDWR | O_CREAT, 0644);
+    if(fd < 0) throw std::runtime_error(std::string("Could not open profile database at ") + path);
+    try {
+        struct stat st;
+        if(::fstat(fd, &st)) throw std::runtime_error(std::string("Could not stat ") + path);
+        ProfileDBHeader h;
+        std::memset(&h, 0, sizeof(h));
+        if(st.st_size == 0) {
+            std::memcpy(h.magic, KF_PDB, sizeof(KF_PDB));
+            h.version = KF_PDB_VERSION;
+            h.mink = mink, h.maxk = maxk, h.canonical = canonical, h.values = values, h.value_bytes = half ? 2: 4;
+            h.dim = m.dim(), h.stride = ProfileMatrix<float>::stride_for(m.dim());
+            h.capacity = ProfileMatrix<float>::padded_rows(std::max<size_t>(m.size(), KF_PDB_MIN_ROWS));
+            h.names_offset = sizeof(h) + h.capacity * h.stride * h.value_bytes;
+        } else {
+            if(::pread(fd, &h, sizeof(h), 0) != ssize_t(sizeof(h))) throw std::runtime_error(std::string("Truncated profile database at ") + path);
+            if(const char *err = check_db_header(h, st.st_size))
+                throw std::runtime_error(std::string(err) + " in profile database at " + path);
+            if(h.mink != mink || h.maxk != maxk || h.canonical != canonical || h.values != values || h.dim != m.dim() ||
+               (h.value_bytes == 2) != half)
+                throw std::runtime_error(std::string("Profiles do not match those in the database at ") + path);
+        }
+        // Rows past the last are read as padding by ProfileMatrix views, so keep a multiple of 4.
+        const u64 need = ProfileMatrix<float>::padded_rows(h.rows + m.size());
+        if(need > h.capacity) fd = grow_db(fd, h, std::max(need, 2 * h.capacity), path);
+        std::vector<char> buf(h.stride * h.value_bytes);
+        for(size_t i = 0; i < m.size(); ++i) {
+            if(half) to_half(m.row(i), reinterpret_cast<uint16_t *>(buf.data()), m.dim());
+            else     std::copy(m.row(i), m.row(i) + m.dim(), reinterpret_cast<float *>(buf.data()));
+            pwrite_all(fd, buf.data(), buf.size(), sizeof(h) + (h.rows + i) * buf.size(), path);
+        }
+        std::string blob;
+        for(const auto &n: names) blob.append(n.data(), n.size() + 1);
+        pwrite_all(fd, blob.data(), blob.size(), h.names_offset + h.names_bytes, path);
+        // New rows and names are on disk before the header points at them.
+        if(::fdatasync(fd)) throw std::runtime_error(std::string("Could not sync ") + path);
+        h.rows += m.size(), h.names_bytes += blob.size();
+        pwrite_all(fd, &h, sizeof(h), 0, path);
+        if(::ftruncate(fd, h.names_offset + h.names_bytes) || ::fsync(fd))
+            throw std::runtime_error(std::string("Could not sync ") + path);
+    } catch(...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+}
+
+} // namespace freq
+
+} // namespace kf
@@ -0,0 +1,170 @@
+#pragma once
+#include "kfreq.h"
+#include "kfdist.h"
+#include <chrono>
+
+#ifndef KF_RECORD_ROWS
+#  define KF_RECORD_ROWS 4096u // Records profiled per pass over a batch, bounding the rows held at once
+#endif
+
+namespace kf {
+
+namespace freq {
+
+// Profiles one record at a time, for profiles per contig rather than per file, reusing a few
+// small tables instead of a KFreqArray per record. Only the max k is counted; lower orders are
+// derived from it (see count_maxk), and only down to what the values need: k - 2 for z-scores.
+// Tables are indexed by the k-mer itself, and canonical profiles fold each k-mer's count with
+// its reverse complement's as they are written out, which gives what a canonical table holds.
+// Profiles are laid out as calc_zscores lays out z-scores, each k from mink to maxk in turn,
+// so that z-scores match those of a KFreqArray counting the record alone.
+// Meant for short k: every record costs O(4^maxk) on top of its length.
+template<typename FloatType>
+class RecordProfiler {
+    static_assert(std::is_floating_point<FloatType>::value, "Profiles need a floating-point type.");
+    struct Table {
+        unsigned k_;
+        u32 *cells;
+        void inc(size_t i) {++cells[i];}
+    };
+    unsigned mink_, maxk_, lo_; // lo_: the lowest k counted
+    bool canonical_;
+    ProfileValues values_;
+    size_t dim_;
+    std::vector<u32> cells_;                // Tables for k = lo_ to maxk_, back to back
+    std::vector<size_t> offsets_;           // Where table k - lo_ starts in cells_
+    std::vector<Table> tables_;
+    std::vector<std::vector<u32>> rc_;      // Reverse complement of every k-mer, per k, if canonical
+    std::vector<std::vector<u32>> kmers_;   // K-mers written per k in [mink, maxk], if canonical
+    std::vector<FloatType> lo_buf_, hi_buf_;
+    u32 *table(unsigned k) {return cells_.data() + offsets_[k - lo_];}
+    // Counts for k into out, as a canonical table would hold them if canonical, for every k-mer.
+    void expand(unsigned k, FloatType *out) {
+        const u32 *const c = table(k);
+        const size_t n = size_t(1) << (k << 1);
+        if(canonical_) {
+            const u32 *const rc = rc_[k - lo_].data();
+            for(size_t x = 0; x < n; ++x) out[x] = c[x] + c[rc[x]];
+        } else {
+            for(size_t x = 0; x < n; ++x) out[x] = c[x];
+        }
+    }
+public:
+    RecordProfiler(unsigned mink, unsigned maxk, bool canonical, ProfileValues values):
+        mink_(mink), maxk_(maxk), lo_(values == ZSCORES ? mink - 2: mink), canonical_(canonical), values_(values), dim_(0)
+    {
+        if(maxk > 16 || mink > maxk || (values == ZSCORES ? mink < 3: mink < 1))
+            throw std::runtime_error(std::string("Cannot profile records for k = ") + std::to_string(mink) + " to " + std::to_string(maxk));
+        for(unsigned k = lo_; k <= maxk; ++k) {
+            offsets_.push_back(cells_.size());
+            cells_.resize(cells_.size() + (size_t(1) << (k << 1)));
+            tables_.push_back(Table{k, nullptr});
+            if(canonical) {
+                rc_.emplace_back(size_t(1) << (k << 1));
+                for(u32 x = 0; x < rc_.back().size(); ++x) rc_.back()[x] = reverse_complement(x, k);
+            }
+        }
+        for(unsigned k = mink; k <= maxk; ++k) {
+            dim_ += zscore_size(k, canonical);
+            if(!canonical) continue;
+            kmers_.emplace_back();
+            for(u32 x = 0; x < (u64(1) << (k << 1)); ++x) if(is_canonical(x, k)) kmers_.back().push_back(x);
+        }
+        lo_buf_.resize(size_t(1) << ((maxk - 1) << 1)), hi_buf_.resize(lo_buf_.size());
+    }
+    size_t dim() const {return dim_;}
+    // Writes the profile of s[0, l) to out, dim() values.
+    void profile(const char *s, size_t l, FloatType *out) {
+        std::fill(cells_.begin(), cells_.end(), 0u);
+        for(size_t j = 0; j < tables_.size(); ++j) tables_[j].cells = cells_.data() + offsets_[j];
+        u32 *const top = table(maxk_);
+        count_maxk(tables_, s, l, [top](u32 v) {++top[v];});
+        // Each lower table is the one above summed over its last base, plus its edge k-mers.
+        for(unsigned k = maxk_; k-- > lo_;) {
+            u32 *const lo = table(k);
+            const u32 *const hi = table(k + 1);
+            for(size_t x = 0, n = size_t(1) << (k << 1); x < n; ++x)
+                lo[x] += hi[x << 2] + hi[(x << 2) | 1] + hi[(x << 2) | 2] + hi[(x << 2) | 3];
+        }
+        if(values_ == ZSCORES) expand(mink_ - 2, lo_buf_.data());
+        for(unsigned k = mink_; k <= maxk_; ++k) {
+            const size_t n = canonical_ ? kmers_[k - mink_].size(): size_t(1) << (k << 1);
+            const u32 *const km = canonical_ ? kmers_[k - mink_].data(): nullptr;
+            const u32 *const c = table(k), *const rc = canonical_ ? rc_[k - lo_].data(): nullptr;
+            if(values_ != ZSCORES) {
+                FloatType sum = 0;
+                for(size_t i = 0; i < n; ++i) {
+                    const u32 x = km ? km[i]: u32(i);
+                    sum += out[i] = rc ? c[x] + c[rc[x]]: c[x];
+                }
+                if(values_ == FREQUENCIES && sum > FloatType(0))
+                    for(size_t i = 0; i < n; ++i) out[i] /= sum;
+                out += n;
+                continue;
+            }
+            // Scored as calc_zscores scores, from the (k-2)- and (k-1)-mer counts expanded to every k-mer.
+            expand(k - 1, hi_buf_.data());
+            const FloatType *const L = hi_buf_.data(), *const M = lo_buf_.data();
+            const u32 m1 = (UINT32_C(1) << ((k - 1) << 1)) - 1, m2 = (UINT32_C(1) << ((k - 2) << 1)) - 1;
+            for(size_t i = 0; i < n; ++i) {
+                const u32 x = km ? km[i]: u32(i);
+                out[i] = markov_zscore<FloatType>(rc ? c[x] + c[rc[x]]: c[x], L[x >> 2], L[x & m1], M[(x >> 2) & m2]);
+            }
+            out += n;
+            std::swap(lo_buf_, hi_buf_);
+        }
+    }
+};
+
+// Profiles every record in paths, in order (see RecordProfiler). Each batch of records read (see
+// SeqPipeline) is profiled across nthreads, up to KF_RECORD_ROWS records at a time, whose rows
+// are handed to emit(batch, first, rows) as rows for records first, first + 1, ... of batch.
+// Adds to stats, if given. Returns the number of records profiled.
+template<typename FloatType, typename Emit>
+size_t profile_records(const std::vector<std::string> &paths, unsigned mink, unsigned maxk, bool canonical, ProfileValues values,
+                       unsigned nthreads, const Emit &emit, PipelineStats *stats=nullptr) {
+    nthreads = std::max(nthreads, 1u);
+    std::vector<RecordProfiler<FloatType>> profilers(nthreads, RecordProfiler<FloatType>(mink, maxk, canonical, values));
+    const size_t dim = profilers[0].dim();
+    ProfileMatrix<FloatType> buf(KF_RECORD_ROWS, dim);
+    size_t ret = 0;
+    for(const auto &path: paths) {
+        SeqPipeline pipe(path.data(), KF_BATCH_BASES, nthreads, true);
+        double emit_time = 0.;
+        while(SeqBatch *pb = pipe.next()) {
+            KF_STAT(const auto start = std::chrono::steady_clock::now());
+            const SeqBatch &batch = *pb;
+            for(size_t first = 0; first < batch.size(); first += KF_RECORD_ROWS) {
+                const size_t n = std::min(batch.size() - first, size_t(KF_RECORD_ROWS));
+                #pragma omp parallel for schedule(dynamic, 16) num_threads(nthreads)
+                for(size_t i = 0; i < n; ++i) {
+#ifdef _OPENMP
+                    const unsigned tid = omp_get_thread_num();
+#else
+                    const unsigned tid = 0;
+#endif
+                    profilers[tid].profile(batch.seq(first + i), batch.len(first + i), buf.row(i));
+                }
+                KF_STAT(const auto t = std::chrono::steady_clock::now());
+                const ProfileMatrix<FloatType> rows(n, dim, buf.row(0));
+                emit(batch, first, rows);
+                KF_STAT(emit_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count());
+            }
+            ret += batch.size();
+            KF_STAT(Progress::get().add_bases(batch.size(), batch.bases()));
+            pipe.release(pb);
+            KF_STAT(pipe.add_count_time(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()));
+        }
+        KF_STAT(Progress::get().add_file());
+        if(stats) {
+            PipelineStats s = pipe.stats();
+            s.count_time -= emit_time, s.emit_time += emit_time;
+            *stats += s;
+        }
+    }
+    return ret;
+}
+
+} // namespace freq
+
+} // namespace kf
@@ -0,0 +1,66 @@
+#pragma once
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+namespace kf {
+
+// Sizes of paths on disk, or 0 for any that cannot be stat'd.
+static inline std::vector<size_t> input_sizes(const std::vector<std::string> &paths) {
+    std::vector<size_t> ret(paths.size());
+    struct stat st;
+    for(size_t i = 0; i < paths.size(); ++i) ret[i] = ::stat(paths[i].data(), &st) == 0 ? st.st_size: 0;
+    return ret;
+}
+
+// Hands inputs out to nworkers by size. Inputs are dealt largest first, each to the queue with the
+// fewest bytes so far, so every queue starts balanced and in decreasing order. A worker takes the
+// largest input left in its own queue; once that is empty, it steals the largest input from the
+// queue with the most bytes left, so big inputs still start early when sizes mislead (compressed
+// and plain inputs mixed, say).
+class InputScheduler {
+    struct Queue {
+        std::mutex m;
+        std::deque<size_t> items;
+        size_t bytes = 0;
+    };
+    const std::vector<size_t> sizes_;
+    std::vector<Queue> queues_;
+    bool pop(Queue &q, size_t &i) {
+        std::lock_guard<std::mutex> lock(q.m);
+        if(q.items.empty()) return false;
+        i = q.items.front(), q.items.pop_front(), q.bytes -= sizes_[i];
+        return true;
+    }
+public:
+    InputScheduler(const std::vector<size_t> &sizes, unsigned nworkers): sizes_(sizes), queues_(std::max(nworkers, 1u)) {
+        std::vector<size_t> order(sizes.size());
+        std::iota(order.begin(), order.end(), size_t(0));
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {return sizes[a] > sizes[b];});
+        for(const size_t i: order) {
+            Queue &q = *std::min_element(queues_.begin(), queues_.end(), [](const Queue &a, const Queue &b) {return a.bytes < b.bytes;});
+            q.items.push_back(i), q.bytes += sizes[i];
+        }
+    }
+    size_t size(size_t i) const {return sizes_[i];}
+    // Sets i to worker tid's next input; returns false once every input has been handed out.
+    bool next(unsigned tid, size_t &i) {
+        if(pop(queues_[tid], i)) return true;
+        for(;;) {
+            Queue *victim = nullptr;
+            size_t most = 0;
+            for(auto &q: queues_) {
+                std::lock_guard<std::mutex> lock(q.m);
+                if(!q.items.empty() && (!victim || q.bytes > most)) victim = &q, most = q.bytes;
+            }
+            if(!victim) return false;
+            if(pop(*victim, i)) return true; // Otherwise emptied since; look again.
+        }
+    }
+};
+
+} // namespace kf
@@ -0,0 +1,104 @@
+#pragma once
+#include "kmerutil.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef KF_BATCH_BASES
+#  define KF_BATCH_BASES (1u << 22)
+#endif
+
+namespace kf {
+
+static inline void kseq_assign(kseq_t *ks, gzFile fp) {
+    if(!ks->f) ks->f = ks_init(fp);
+    else {
+        ks->f->is_eof = ks->f->begin = ks->f->end = 0;
+        ks->f->f = fp;
+    }
+    ks->last_char = 0;
+}
+
+static inline kseq_t kseq_init_stack() {
+    kseq_t ret;
+    std::memset(&ret, 0, sizeof(ret));
+    return ret;
+}
+static inline void kseq_destroy_stack(kseq_t &ks) {
+    free(ks.name.s); free(ks.comment.s); free(ks.seq.s); free(ks.qual.s);
+    ks_destroy(ks.f);
+}
+
+// A batch of records, stored back to back in one buffer so that it can be recycled between reads.
+// Record names are kept the same way by readers asked to keep them, and are empty otherwise.
+struct SeqBatch {
+    std::string         seq_;        // Concatenated sequences
+    std::vector<size_t> ends_;       // ends_[i] is one past the last base of record i in seq_
+    std::string         names_;      // Concatenated names, if kept
+    std::vector<size_t> name_ends_;  // As ends_, for names_
+
+    size_t size()  const {return ends_.size();}
+    bool   empty() const {return ends_.empty();}
+    size_t bases() const {return seq_.size();}
+    size_t start(size_t i) const {return i ? ends_[i - 1]: 0;}
+    const char *seq(size_t i) const {return seq_.data() + start(i);}
+    size_t len(size_t i) const {return ends_[i] - start(i);}
+    const char *name(size_t i) const {return names_.data() + (i ? name_ends_[i - 1]: 0);}
+    size_t name_len(size_t i) const {return name_ends_[i] - (i ? name_ends_[i - 1]: 0);}
+    void clear() {seq_.clear(); ends_.clear(); names_.clear(); name_ends_.clear();}
+    void add(const char *s, size_t l) {
+        append(s, l);
+        end_record();
+    }
+    void add(const char *name, size_t nl, const char *s, size_t l) {
+        append_name(name, nl);
+        add(s, l);
+    }
+    // Builds the current record piece by piece; end_record() completes it.
+    void append(const char *s, size_t l) {seq_.append(s, l);}
+    void append_name(const char *s, size_t l) {names_.append(s, l);}
+    void end_record() {ends_.push_back(seq_.size()), name_ends_.push_back(names_.size());}
+    // Returns the first record of the part-th of nparts ranges, split evenly by number of bases.
+    size_t split(unsigned part, unsigned nparts) const {
+        if(part == 0) return 0;
+        if(part >= nparts) return size();
+        const size_t target = bases() / nparts * part;
+        return std::upper_bound(ends_.begin(), ends_.end(), target) - ends_.begin();
+    }
+};
+
+// Fills SeqBatches from a file with kseq, reusing the caller's kseq_t if provided, and keeping
+// record names if asked.
+class KSeqBatchReader {
+    gzFile    fp_;
+    kseq_t   *ks_;
+    const bool destroy_;
+    const bool names_;
+public:
+    KSeqBatchReader(const char *path, kseq_t *ks=nullptr, bool names=false):
+        fp_(gzopen(path, "rb")), ks_(ks), destroy_(ks == nullptr), names_(names)
+    {
+        if(fp_ == nullptr) throw std::runtime_error(std::string("Could not open file at ") + path);
+        if(destroy_) ks_ = kseq_init(fp_);
+        else         kseq_assign(ks_, fp_);
+    }
+    ~KSeqBatchReader() {
+        if(destroy_) kseq_destroy(ks_);
+        gzclose(fp_);
+    }
+    KSeqBatchReader(const KSeqBatchReader &) = delete;
+    KSeqBatchReader &operator=(const KSeqBatchReader &) = delete;
+    // Returns false once the input is exhausted and no records were read.
+    bool next(SeqBatch &batch, size_t max_bases=KF_BATCH_BASES) {
+        batch.clear();
+        while(batch.bases() < max_bases && kseq_read(ks_) >= 0) {
+            if(names_) batch.add(ks_->name.s, ks_->name.l, ks_->seq.s, ks_->seq.l);
+            else       batch.add(ks_->seq.s, ks_->seq.l);
+        }
+        return !batch.empty();
+    }
+};
+
+} // namespace kf
@@ -0,0 +1,105 @@
+#pragma once
+#include "kfreq.h"
+#include <mutex>
+#include <vector>
+
+#ifndef KF_SHARED_SLICES
+#  define KF_SHARED_SLICES 64u          // Locks over a shared max-k table, each guarding a prefix slice; a power of 2
+#endif
+#ifndef KF_SHARED_BLOCK
+#  define KF_SHARED_BLOCK (1u << 16)    // k-mers each thread buffers before adding them to a shared table
+#endif
+
+namespace kf {
+
+namespace freq {
+
+// The max-k table of an input counted by several threads at once. Its cells are split by prefix
+// into KF_SHARED_SLICES slices, each added to only under its own lock. A compact table is promoted
+// to full-width cells first, since spilling would contend on one map and promoting would move
+// every cell while others count.
+template<typename SFType>
+class SharedTable {
+    static_assert((KF_SHARED_SLICES & (KF_SHARED_SLICES - 1)) == 0 && KF_SHARED_SLICES <= 64, "KF_SHARED_SLICES must be a power of 2 up to 64.");
+    SFType &top_;
+    std::vector<std::mutex> locks_;
+    unsigned shift_;
+public:
+    SharedTable(SFType &top): top_(top), locks_(KF_SHARED_SLICES), shift_(0) {
+        if(SFType::compact && !top.promoted()) top.promote();
+        const unsigned slice_bits = __builtin_ctz(KF_SHARED_SLICES);
+        unsigned bits = 0;
+        while((size_t(1) << bits) < top.size()) ++bits;
+        if(bits > slice_bits) shift_ = bits - slice_bits;
+    }
+    unsigned slice(u32 i) const {return i >> shift_;}
+    // Adds cells[0, n), all in slice s, blocking for its lock unless wait is false.
+    // Returns whether they were added.
+    bool add(unsigned s, const u32 *cells, size_t n, bool wait) {
+        std::unique_lock<std::mutex> lock(locks_[s], std::defer_lock);
+        if(wait) lock.lock();
+        else if(!lock.try_lock()) return false;
+        for(size_t i = 0; i < n; ++i) top_.inc_shared(cells[i]);
+        return true;
+    }
+};
+
+// One thread's share of counting into a SharedTable, in max-k-only mode (see count_maxk).
+// Max-k cells are buffered, sorted by slice and added a slice at a time, taking whichever slices
+// are free first. Lower-order cells, which only k-mers ending runs reach, are kept in edges()
+// for the table's owner to add once everyone is done.
+template<typename SFType>
+class SharedCounter {
+    struct EdgeList {
+        unsigned k_;
+        std::vector<u32> cells;
+        void inc(size_t i) {cells.push_back(i);}
+    };
+    SharedTable<SFType> &table_;
+    const bool canonical_;
+    std::vector<EdgeList> edges_;
+    std::vector<u32> buf_, tmp_, offsets_;
+    size_t n_ = 0;
+    void push(u32 cell) {
+        buf_[n_] = cell;
+        if(++n_ == buf_.size()) flush();
+    }
+public:
+    SharedCounter(SharedTable<SFType> &table, const std::vector<SFType> &freqs, bool canonical):
+        table_(table), canonical_(canonical), buf_(KF_SHARED_BLOCK), tmp_(KF_SHARED_BLOCK), offsets_(KF_SHARED_SLICES + 1)
+    {
+        for(const auto &sf: freqs) edges_.push_back(EdgeList{sf.k_, {}});
+    }
+    void process_seq(const char *s, size_t l) {
+        if(canonical_) count_maxk_canonical(edges_, s, l, [this](u32 v) {push(v);});
+        else           count_maxk(edges_, s, l, [this](u32 v) {push(v);});
+    }
+    void flush() {
+        if(!n_) return;
+        std::fill(offsets_.begin(), offsets_.end(), 0u);
+        for(size_t i = 0; i < n_; ++offsets_[table_.slice(buf_[i++]) + 1]);
+        for(size_t i = 1; i < offsets_.size(); ++i) offsets_[i] += offsets_[i - 1];
+        for(size_t i = 0; i < n_; ++i) tmp_[offsets_[table_.slice(buf_[i])]++] = buf_[i];
+        // offsets_[s] is now the end of slice s. Free slices first, then wait for the rest.
+        uint64_t left = 0;
+        for(unsigned s = 0; s < KF_SHARED_SLICES; ++s) {
+            const u32 begin = s ? offsets_[s - 1]: 0;
+            if(begin != offsets_[s] && !table_.add(s, tmp_.data() + begin, offsets_[s] - begin, false)) left |= uint64_t(1) << s;
+        }
+        for(unsigned s = 0; left && s < KF_SHARED_SLICES; ++s) {
+            const u32 begin = s ? offsets_[s - 1]: 0;
+            if(begin != offsets_[s] && (left >> s & 1)) table_.add(s, tmp_.data() + begin, offsets_[s] - begin, true);
+        }
+        n_ = 0;
+    }
+    // Lower-order cells for each table in freqs, in order; the max-k table's is empty.
+    std::vector<std::vector<u32>> edges() {
+        std::vector<std::vector<u32>> ret;
+        for(auto &e: edges_) ret.push_back(std::move(e.cells));
+        return ret;
+    }
+};
+
+} // namespace freq
+
+} // namespace kf
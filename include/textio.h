@@ -0,0 +1,160 @@
+#pragma once
+#include "kmerutil.h"
+#include "bgzf.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef KF_WRITE_CHUNK
+#  define KF_WRITE_CHUNK (1u << 18) // Counts formatted and deflated per task when writing text tables
+#endif
+
+namespace kf {
+
+static const char DIGIT_PAIRS[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static inline unsigned ndigits(uint64_t v) {
+    unsigned ret = 1;
+    for(;;) {
+        if(v < 10) return ret;
+        if(v < 100) return ret + 1;
+        if(v < 1000) return ret + 2;
+        if(v < 10000) return ret + 3;
+        v /= 10000, ret += 4;
+    }
+}
+
+// Writes v in decimal, as "%zu" would, to p; returns the end. Writes at most 20 characters.
+static inline char *u64toa(uint64_t v, char *p) {
+    char *const end = p + ndigits(v), *q = end;
+    while(v >= 100) {
+        const unsigned i = (v % 100) << 1;
+        v /= 100;
+        *--q = DIGIT_PAIRS[i + 1], *--q = DIGIT_PAIRS[i];
+    }
+    if(v >= 10) *--q = DIGIT_PAIRS[(v << 1) + 1], *--q = DIGIT_PAIRS[v << 1];
+    else        *--q = '0' + v;
+    return end;
+}
+
+static constexpr size_t FIXED6_MAX = 328; // Longest "%f" of a double, plus its terminator
+
+// Writes x as "%f" would (six decimals, the exact value rounded half to even), to p; returns the end.
+// x * 1e6 is split exactly into a product and its rounding error with an fma, which settles ties;
+// values too large for that, and infinities and NaNs, go through snprintf.
+static inline char *fixed6(double x, char *p) {
+    if(!(std::fabs(x) < 1e9)) return p + std::snprintf(p, FIXED6_MAX, "%f", x);
+    const double prod = x * 1e6, err = std::fma(x, 1e6, -prod);
+    double r = std::nearbyint(prod);
+    const double d = prod - r;
+    if(d == .5 && err > 0.) r += 1.;
+    else if(d == -.5 && err < 0.) r -= 1.;
+    if(std::signbit(x)) *p++ = '-';
+    const uint64_t q = std::fabs(r);
+    p = u64toa(q / 1000000, p);
+    *p++ = '.';
+    const unsigned frac = q % 1000000;
+    for(unsigned i = 0, div = 10000; i < 3; ++i, div /= 100) {
+        const unsigned j = ((frac / div) % 100) << 1;
+        *p++ = DIGIT_PAIRS[j], *p++ = DIGIT_PAIRS[j + 1];
+    }
+    return p;
+}
+
+// Buffers text for fp, writing it out a block at a time.
+class TextBuffer {
+    std::FILE *fp_;
+    std::vector<char> buf_;
+    size_t used_ = 0, written_ = 0;
+public:
+    TextBuffer(std::FILE *fp, size_t size=1 << 16): fp_(fp), buf_(std::max(size, FIXED6_MAX)) {}
+    // Space for n more characters, n at most the buffer size.
+    char *reserve(size_t n) {
+        if(used_ + n > buf_.size()) flush();
+        return buf_.data() + used_;
+    }
+    void commit(const char *end) {used_ = end - buf_.data();}
+    void put(char c) {*reserve(1) = c, ++used_;}
+    void put(const char *s, size_t n) {
+        if(n > buf_.size()) {
+            flush();
+            if(std::fwrite(s, 1, n, fp_) != n) throw std::runtime_error("Could not write text.");
+            written_ += n;
+        } else std::memcpy(reserve(n), s, n), used_ += n;
+    }
+    void put_fixed6(double x) {commit(fixed6(x, reserve(FIXED6_MAX)));}
+    void flush() {
+        if(used_ && std::fwrite(buf_.data(), 1, used_, fp_) != used_) throw std::runtime_error("Could not write text.");
+        written_ += used_, used_ = 0;
+    }
+    size_t written() const {return written_ + used_;}
+};
+
+// Writes header, then the text format(j, text) sets for each task j of ntasks, in order, to path
+// as BGZF. Tasks are formatted and deflated a task per thread, then written in order.
+template<typename Format>
+void write_bgzf_text(const char *path, const std::string &header, size_t ntasks, const Format &format, unsigned nthreads=1) {
+    std::FILE *fp = std::fopen(path, "wb");
+    if(fp == nullptr) throw std::runtime_error(std::string("Could not open file at ") + path);
+    if(!nthreads) nthreads = 1;
+    std::vector<std::vector<uint8_t>> out(nthreads);
+    bool ok = true;
+    {
+        BGZFDeflater zd;
+        zd.compress(header.data(), header.size(), out[0]);
+        ok = std::fwrite(out[0].data(), 1, out[0].size(), fp) == out[0].size();
+    }
+    #pragma omp parallel num_threads(nthreads)
+    {
+        BGZFDeflater zd;
+        std::vector<char> text;
+        for(size_t base = 0; base < ntasks; base += nthreads) {
+            const size_t end = std::min(ntasks, base + nthreads);
+            #pragma omp for schedule(static, 1)
+            for(size_t j = base; j < end; ++j) {
+                const char *p = format(j, text);
+                out[j - base].clear();
+                zd.compress(text.data(), p - text.data(), out[j - base]);
+            }
+            #pragma omp single
+            for(size_t j = base; j < end; ++j)
+                ok &= std::fwrite(out[j - base].data(), 1, out[j - base].size(), fp) == out[j - base].size();
+        }
+    }
+    ok &= std::fwrite(BGZF_EOF, 1, sizeof(BGZF_EOF), fp) == sizeof(BGZF_EOF);
+    ok &= std::fclose(fp) == 0;
+    if(!ok) throw std::runtime_error(std::string("Could not write to ") + path);
+}
+
+// Writes header, then each table's counts as "k: [c0|c1|...|cn]\n" (the text tables read by
+// KFreqArray and KFreqList), to path as BGZF, KF_WRITE_CHUNK counts to a task.
+template<typename Table>
+void write_text_tables(const char *path, const std::string &header, const std::vector<Table> &tables, unsigned nthreads=1) {
+    using CountType = typename std::decay<decltype(tables[0].get(0))>::type;
+    struct Task {size_t t, begin, end;};
+    std::vector<Task> tasks;
+    for(size_t t = 0; t < tables.size(); ++t)
+        for(size_t i = 0, n = tables[t].size(); i < n; i += KF_WRITE_CHUNK) tasks.push_back(Task{t, i, std::min(n, i + size_t(KF_WRITE_CHUNK))});
+    write_bgzf_text(path, header, tasks.size(), [&](size_t j, std::vector<char> &text) {
+        const Task &task = tasks[j];
+        const auto &sf = tables[task.t];
+        const size_t n = task.end - task.begin;
+        std::vector<CountType> counts(n);
+        sf.get_range(task.begin, n, counts.data());
+        text.resize(n * 21 + 16);
+        char *p = text.data();
+        if(!task.begin) p = u64toa(sf.k_, p), *p++ = ':', *p++ = ' ', *p++ = '[';
+        for(size_t i = 0; i < n; ++i) p = u64toa(counts[i], p), *p++ = '|';
+        if(task.end == sf.size()) p[-1] = ']', *p++ = '\n';
+        return static_cast<const char *>(p);
+    }, nthreads);
+}
+
+} // namespace kf
@@ -1,18 +1,246 @@
 #include "pybind11/pybind11.h"
-#include "include/kfreq.h"
+#include "pybind11/numpy.h"
+#include "pybind11/stl.h"
+#include "include/hashfreq.h"
+#include "include/kfprofile.h"
+#include "include/profiledb.h"
+#include "include/recprofile.h"
 
 namespace py = pybind11;
 using namespace kf;
 using namespace kf::freq;
 
 using kfs_t = KFreqArray<size_t>;
+
+// Table k of the object self as a NumPy array over its counts, without copying. The array keeps
+// self alive, and is read-only for tables opened from a mapped file.
+// Full-width tables never reallocate their counts, so views stay valid while the object lives.
+static py::array_t<size_t> table_view(py::object self, unsigned k) {
+    const auto &sf = self.cast<const kfs_t &>().table(k);
+    py::array_t<size_t> ret(sf.size(), sf.mapped() ? sf.map_: sf.data_.data(), self);
+    if(sf.mapped()) ret.attr("setflags")(py::arg("write") = false);
+    return ret;
+}
+static py::list table_views(py::object self) {
+    py::list ret;
+    for(unsigned k = 1, maxk = self.cast<const kfs_t &>().maxk(); k <= maxk; ++k) ret.append(table_view(self, k));
+    return ret;
+}
+
+// Entries of a sparse table for k as arrays of k-mers (2 bits per base, first base highest) and
+// their counts, sorted by k-mer.
+static py::tuple hashed_table(const KFH &kf, unsigned k) {
+    const auto entries(kf.table(k).table_.sorted());
+    py::array_t<uint64_t> keys(entries.size());
+    py::array_t<uint32_t> counts(entries.size());
+    uint64_t *kp = keys.mutable_data();
+    uint32_t *cp = counts.mutable_data();
+    for(const auto &e: entries) *kp++ = e.first, *cp++ = e.second;
+    return py::make_tuple(keys, counts);
+}
+
+// Profiles of every file in paths, as an n x profile_dim float32 matrix (see profile_files), and
+// optionally their pairwise similarities or distances as an n x n matrix, all counted and compared
+// without the GIL. The profiles are scored into the matrix's own buffer, laid out as a
+// ProfileMatrix view, then packed down to contiguous rows in place.
+static py::object profile(const std::vector<std::string> &paths, unsigned k, bool canonical, unsigned nthreads, unsigned mink,
+                          bool distances, const std::string &metric_name, unsigned cell_bits) {
+    if(k < 3 || k > 16) throw std::runtime_error("k must be between 3 and 16. Count larger k with kfh.");
+    if(!mink) mink = k;
+    if(mink < 3 || mink > k) throw std::runtime_error("mink must be between 3 and k.");
+    const Metric metric = metric_from_name(metric_name);
+    const size_t n = paths.size(), d = profile_dim(mink, k, canonical), stride = ProfileMatrix<float>::stride_for(d);
+    py::array_t<float> buf(ProfileMatrix<float>::padded_rows(n) * stride), dists;
+    if(distances) dists = py::array_t<float>({n, n});
+    float *const p = buf.mutable_data(), *const dp = distances ? dists.mutable_data(): nullptr;
+    {
+        py::gil_scoped_release release;
+#ifdef _OPENMP
+        omp_set_num_threads(std::max(nthreads, 1u));
+#endif
+        std::fill(p, p + buf.size(), 0.f);
+        ProfileMatrix<float> m(n, d, p);
+        profile_files(paths, mink, k, nthreads, canonical, true, cell_bits, &m);
+        if(distances) {
+            standardize(m, metric);
+            pairwise_block(m, metric, 0, n, 0, n, dp, n);
+        }
+        if(stride != d) for(size_t i = 1; i < n; ++i) std::memmove(p + i * d, m.row(i), d * sizeof(float));
+    }
+    py::array_t<float> profiles({n, d}, {d * sizeof(float), sizeof(float)}, p, buf);
+    if(distances) return py::make_tuple(profiles, dists);
+    return profiles;
+}
+
+// Profiles of every record in paths (see profile_records), as their names and an n x dim float32
+// matrix, profiled without the GIL. Rows are gathered into one vector, which the array then owns.
+static py::tuple records(const std::vector<std::string> &paths, unsigned k, bool canonical, unsigned nthreads, unsigned mink,
+                         const std::string &values_name) {
+    if(!mink) mink = k;
+    const ProfileValues values = values_from_name(values_name);
+    const size_t d = RecordProfiler<float>(mink, k, canonical, values).dim();
+    std::vector<std::string> names;
+    std::unique_ptr<std::vector<float>> rows(new std::vector<float>);
+    {
+        py::gil_scoped_release release;
+#ifdef _OPENMP
+        omp_set_num_threads(std::max(nthreads, 1u));
+#endif
+        profile_records<float>(paths, mink, k, canonical, values, nthreads,
+                               [&](const SeqBatch &batch, size_t first, const ProfileMatrix<float> &m) {
+            for(size_t i = 0; i < m.size(); ++i) {
+                names.emplace_back(batch.name(first + i), batch.name_len(first + i));
+                rows->insert(rows->end(), m.row(i), m.row(i) + d);
+            }
+        });
+    }
+    const size_t n = names.size();
+    float *const p = rows->data();
+    py::capsule owner(rows.release(), [](void *v) {delete static_cast<std::vector<float> *>(v);});
+    return py::make_tuple(names, py::array_t<float>({n, d}, {d * sizeof(float), sizeof(float)}, p, owner));
+}
+
+// Every profile in a database as an n x dim array over its mapping, without copying: float16 or
+// float32 as stored. The array keeps the database open.
+static py::array db_matrix(py::object self) {
+    const auto &db = self.cast<const ProfileDB &>();
+    const size_t vb = db.half() ? 2: 4;
+    py::array ret(py::dtype(db.half() ? "float16": "float32"), {db.size(), db.dim()}, {db.stride() * vb, vb}, db.row(0), self);
+    ret.attr("setflags")(py::arg("write") = false);
+    return ret;
+}
+
 PYBIND11_MODULE(kf, m) {
     m.doc() = "kmer histogram calculator";
     py::class_<kfs_t> (m, "kf")
-        .def(py::init<unsigned>())
+        .def(py::init<unsigned, bool, bool>(), py::arg("k"), py::arg("maxk_only") = false, py::arg("canonical") = false)
         .def(py::init<const char *>())
         .def("clear", &kfs_t::clear, "Clear all entries.")
-        .def("count", (size_t (kfs_t::*)(const std::string &)) &kfs_t::count, "Count stuff.")
-        .def("count", (size_t (kfs_t::*)(unsigned, std::size_t)) &kfs_t::count, "Count stuff.");
+        .def("count", (size_t (kfs_t::*)(const std::string &) const) &kfs_t::count, "Count stuff.")
+        .def("count", (size_t (kfs_t::*)(unsigned, std::size_t) const) &kfs_t::count, "Count stuff.")
+        // Counting releases the GIL, so Python threads can count into different objects at once.
+        .def("add", [](kfs_t &kf, const std::string &path, unsigned nthreads) {kf.add(path.data(), nullptr, nthreads);},
+             py::arg("path"), py::arg("nthreads") = 1, py::call_guard<py::gil_scoped_release>(),
+             "Count every sequence in a FASTA/FASTQ file, plain or gzipped.")
+        .def("process_seq", [](kfs_t &kf, const std::string &seq) {
+                py::gil_scoped_release release;
+                kf.process_seq(seq.data(), seq.size());
+             }, py::arg("seq"), "Count one sequence. Call finalize() before reading lower-order tables in maxk_only mode.")
+        .def("finalize", &kfs_t::finalize, py::call_guard<py::gil_scoped_release>())
+        .def("table", &table_view, py::arg("k"), "Counts for k as a NumPy array sharing this object's memory.")
+        .def("tables", &table_views, "Counts for every k from 1, as NumPy arrays sharing this object's memory.")
+        .def_property_readonly("maxk", &kfs_t::maxk)
+        .def_property_readonly("canonical", &kfs_t::canonical)
+        .def_property_readonly("mapped", &kfs_t::mapped);
+    // Sparse tables for k up to 32, in the format kfreq -c writes for k past 16.
+    py::class_<KFH>(m, "kfh")
+        .def(py::init<unsigned, unsigned>(), py::arg("k"), py::arg("nk") = 3, "Count k-mers for every k from k - nk + 1 to k.")
+        .def(py::init<const char *>(), py::arg("path"))
+        .def("clear", &KFH::clear, "Clear all entries.")
+        .def("count", (uint32_t (KFH::*)(const std::string &) const) &KFH::count, "Count of a k-mer, given as a string.")
+        .def("count", (uint32_t (KFH::*)(unsigned, u64) const) &KFH::count, py::arg("k"), py::arg("kmer"), "Count of a k-mer, given as an integer.")
+        .def("add", [](KFH &kf, const std::string &path, unsigned nthreads) {kf.add(path.data(), nullptr, nthreads);},
+             py::arg("path"), py::arg("nthreads") = 1, py::call_guard<py::gil_scoped_release>(),
+             "Count every sequence in a FASTA/FASTQ file, plain or gzipped.")
+        .def("process_seq", [](KFH &kf, const std::string &seq) {
+                py::gil_scoped_release release;
+                kf.process_seq(seq.data(), seq.size());
+             }, py::arg("seq"), "Count one sequence. Call finalize() before reading lower-order tables.")
+        .def("finalize", &KFH::finalize, py::call_guard<py::gil_scoped_release>())
+        .def("rc_collapse", &KFH::rc_collapse, py::call_guard<py::gil_scoped_release>(),
+             "Fold every table onto canonical k-mers, after which only other canonical tables can be added.")
+        .def("__iadd__", [](py::object self, const KFH &o) {
+                KFH &kf = self.cast<KFH &>();
+                {
+                    py::gil_scoped_release release;
+                    kf += o;
+                }
+                return self;
+             }, py::arg("other"), "Add another object's counts, over the same k and strandedness.")
+        .def("write", [](KFH &kf, const std::string &path, bool binary) {kf.write(path.data(), binary);},
+             py::arg("path"), py::arg("binary") = false, py::call_guard<py::gil_scoped_release>())
+        .def("table", [](KFH &kf, unsigned k) {
+                kf.finalize();
+                return hashed_table(kf, k);
+             }, py::arg("k"), "(kmers, counts) for k, sorted by k-mer.")
+        .def_property_readonly("mink", &KFH::mink)
+        .def_property_readonly("maxk", &KFH::maxk)
+        .def_property_readonly("canonical", &KFH::canonical);
+    py::class_<ProfileDB>(m, "ProfileDB")
+        .def(py::init<const std::string &>(), py::arg("path"), "Open the profile database at path, as it is now.")
+        .def("__len__", &ProfileDB::size)
+        .def("names", &ProfileDB::names)
+        .def("find", [](const ProfileDB &db, const std::string &name) -> py::object {
+                const size_t i = db.find(name);
+                if(i == db.size()) return py::none();
+                return py::int_(i);
+             }, py::arg("name"), "Row of the latest profile named name, or None.")
+        .def("get", [](const ProfileDB &db, const std::string &name) {
+                const size_t i = db.find(name);
+                if(i == db.size()) throw py::key_error(name);
+                py::array_t<float> ret(db.dim());
+                db.get(i, ret.mutable_data());
+                return ret;
+             }, py::arg("name"), "The profile named name, as float32.")
+        .def_property_readonly("matrix", &db_matrix, "Every profile, as a read-only array over the file.")
+        .def_property_readonly("dim", &ProfileDB::dim)
+        .def_property_readonly("mink", &ProfileDB::mink)
+        .def_property_readonly("maxk", &ProfileDB::maxk)
+        .def_property_readonly("canonical", &ProfileDB::canonical)
+        .def_property_readonly("half", &ProfileDB::half)
+        .def_property_readonly("values", [](const ProfileDB &db) {
+                return db.values() == COUNTS ? "counts": db.values() == FREQUENCIES ? "freqs": "zscores";
+             });
+    m.def("append_profiles", [](const std::string &path, py::array_t<float, py::array::c_style | py::array::forcecast> profiles,
+                                const std::vector<std::string> &names, unsigned k, unsigned mink, bool canonical, bool half) {
+            if(profiles.ndim() != 2) throw std::runtime_error("Profiles must be a 2-d array.");
+            const size_t n = profiles.shape(0), d = profiles.shape(1);
+            if(!mink) mink = k;
+            if(mink < 3 || mink > k || k > 16 || d != profile_dim(mink, k, canonical))
+                throw std::runtime_error("Profiles are not z-scores for k = mink to k.");
+            const float *p = profiles.data();
+            py::gil_scoped_release release;
+            ProfileMatrix<float> m(n, d);
+            for(size_t i = 0; i < n; ++i) std::copy(p + i * d, p + (i + 1) * d, m.row(i));
+            append_profiles(path, m, names, mink, k, canonical, half);
+          }, py::arg("path"), py::arg("profiles"), py::arg("names"), py::arg("k"), py::arg("mink") = 0, py::arg("canonical") = true,
+          py::arg("half") = false,
+          "Append rows of profiles (as from profile()) to the database at path, creating it if need be. Safe across processes.");
+    m.def("calc_zscores", [](kfs_t &kf, unsigned mink, unsigned maxk) {
+            if(!maxk) maxk = kf.maxk();
+            if(!mink) mink = maxk;
+            size_t n = 0;
+            for(unsigned k = mink; k <= maxk; ++k) n += zscore_size(k, kf.canonical());
+            py::array_t<double> ret(n);
+            double *out = ret.mutable_data();
+            {
+                py::gil_scoped_release release;
+                kf.finalize();
+                calc_zscores(kf, mink, maxk, out);
+            }
+            return ret;
+          }, py::arg("kf"), py::arg("mink") = 0, py::arg("maxk") = 0,
+          "Z-scores for every k from mink to maxk (both default to the max k), each k's after the last's.");
+    m.def("rc_collapse", [](py::object self) {
+            kfs_t &kf = self.cast<kfs_t &>();
+            if(kf.mapped()) throw std::runtime_error("Tables opened from a mapped file are read-only.");
+            {
+                py::gil_scoped_release release;
+                kf.finalize();
+                rc_collapse(kf);
+            }
+            return table_views(self);
+          }, py::arg("kf"), "Add each k-mer's count to its reverse complement's, in place. Returns the tables as from kf.tables().");
+    m.def("profile", &profile, py::arg("paths"), py::arg("k"), py::arg("canonical") = true, py::arg("nthreads") = 1,
+          py::arg("mink") = 0, py::arg("distances") = false, py::arg("metric") = "pearson", py::arg("cell_bits") = 16,
+          "Count and score every file in paths, as kfreq does, into one float32 matrix with a row per file: the z-scores\n"
+          "for every k from mink (default k) to k. With distances, returns (profiles, matrix) with the n x n similarities\n"
+          "(pearson, cosine) or distances (euclidean) between files; the profiles are then returned as compared,\n"
+          "standardized to unit length (and centred, for pearson). Runs on nthreads threads without the GIL.");
+    m.def("profile_records", &records, py::arg("paths"), py::arg("k") = 4, py::arg("canonical") = true, py::arg("nthreads") = 1,
+          py::arg("mink") = 0, py::arg("values") = "zscores",
+          "Profile every record (contig, read) in paths rather than every file: returns (names, profiles), with a float32 row\n"
+          "per record holding, for every k from mink (default k) to k, its z-scores, counts or freqs (counts over their sum),\n"
+          "as values says. Meant for short k, such as tetranucleotide profiles for binning. Runs on nthreads threads without the GIL.");
     m.def("str2kmer", &str2kmer<std::size_t>, "Convert a string into an index. Throws std::runtime_error if it contains illegal characters.");
 }
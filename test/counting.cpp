@@ -0,0 +1,204 @@
+#include "test.h"
+#include "kfreq.h"
+#include "sharedtable.h"
+
+using namespace kf;
+using namespace kf::freq;
+using namespace kf::test;
+
+namespace {
+
+std::vector<std::string> test_seqs(uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<std::string> ret;
+    for(const size_t n: {5000u, 20000u, 777u}) ret.push_back(random_seq(n, rng, 0.01));
+    for(const char *s: {"", "A", "AC", "ACGTN", "NNNN", "GATTACA", "acgtACGTnACGT"}) ret.push_back(s);
+    ret.push_back(std::string(3000, 'A')); // Saturates narrow cells
+    return ret;
+}
+
+// What a table for k should hold for the naive counts: each k-mer's count, or for canonical
+// tables that plus its reverse complement's (palindromes twice).
+uint64_t expected(const std::vector<uint64_t> &naive, u32 x, unsigned k, bool canonical) {
+    return canonical ? naive[x] + naive[reverse_complement(x, k)]: naive[x];
+}
+
+template<typename KFType>
+void check_counts(const KFType &kf, const std::vector<std::string> &seqs, bool canonical) {
+    for(unsigned k = kf.mink(); k <= kf.maxk(); ++k) {
+        const auto naive = naive_counts(seqs, k);
+        for(u32 x = 0; x < naive.size(); ++x) KF_CHECK(kf.count(k, x) == expected(naive, x, k, canonical));
+    }
+}
+
+} // namespace
+
+// Canonical tables give each reverse-complement pair one cell, numbering them 0 to canonical_size(k) - 1.
+KF_TEST(canonical_index) {
+    for(unsigned k = 1; k <= 10; ++k) {
+        std::vector<u32> owner(canonical_size(k), u32(-1));
+        for(u32 x = 0; x < (UINT32_C(1) << (k << 1)); ++x) {
+            const u32 rc = reverse_complement(x, k), i = canonical_index(x, k);
+            KF_CHECK(i < owner.size());
+            KF_CHECK(i == canonical_index(rc, k));
+            KF_CHECK(is_canonical(x, k) != is_canonical(rc, k) || x == rc);
+            if(is_canonical(x, k)) {
+                KF_CHECK(owner[i] == u32(-1));
+                owner[i] = x;
+            }
+        }
+        KF_CHECK(std::count(owner.begin(), owner.end(), u32(-1)) == 0);
+    }
+}
+
+// Counting every k directly and counting only the max k, then marginalizing, agree with brute force.
+KF_TEST(counts_match_naive) {
+    const auto seqs = test_seqs(1);
+    for(const bool maxk_only: {false, true}) {
+        for(const bool canonical: {false, true}) {
+            KFreqArray<u32> kfa(6, maxk_only, canonical);
+            count_seqs(kfa, seqs);
+            check_counts(kfa, seqs, canonical);
+            KFreqList<u32> kfl(7, 3, maxk_only, canonical);
+            count_seqs(kfl, seqs);
+            check_counts(kfl, seqs, canonical);
+        }
+    }
+}
+
+// Cache-blocked max-k counting (k 11 and 12 by default) gives the same tables as counting in place.
+KF_TEST(blocked_counts) {
+    const auto seqs = test_seqs(2);
+    for(const bool canonical: {false, true}) {
+        KFreqList<u32> blocked(11, 2, true, canonical), direct(11, 2, true, canonical);
+        direct.set_blocked(false);
+        KF_CHECK(blocked.blocked() && !direct.blocked());
+        count_seqs(blocked, seqs), count_seqs(direct, seqs);
+        for(unsigned k = 10; k <= 11; ++k)
+            for(size_t i = 0; i < blocked.table(k).size(); ++i) KF_CHECK(blocked.table(k).get(i) == direct.table(k).get(i));
+        check_counts(direct, seqs, canonical);
+    }
+}
+
+// Narrow cells spill saturated counts, and a table whose spills grow past its threshold is widened,
+// without changing any count.
+KF_TEST(compact_promotion) {
+    SubKFreq<u32, uint8_t> sf(10);
+    KF_CHECK(!sf.starts_wide() && !sf.promoted());
+    const size_t limit = sf.size() / KF_PROMOTE_FRACTION;
+    // A few saturated cells spill without promoting,
+    for(unsigned r = 0; r < 1000; ++r) sf.inc(7), sf.inc(8);
+    sf.add(9, 300), sf.set(10, 255), sf.set(11, 256);
+    KF_CHECK(!sf.promoted() && sf.spill_.size() == 4);
+    KF_CHECK(sf.get(7) == 1000 && sf.get(8) == 1000 && sf.get(9) == 300 && sf.get(10) == 255 && sf.get(11) == 256);
+    sf.set(11, 3);
+    KF_CHECK(sf.get(11) == 3 && sf.spill_.size() == 3);
+    // but enough of them widen the table.
+    for(size_t i = 100; i < 100 + limit; ++i) sf.set(i, 256 + i);
+    KF_CHECK(sf.promoted() && sf.spill_.empty() && sf.data_.empty());
+    KF_CHECK(sf.get(7) == 1000 && sf.get(9) == 300 && sf.get(11) == 3);
+    for(size_t i = 100; i < 100 + limit; ++i) KF_CHECK(sf.get(i) == 256 + i);
+    sf.inc(7);
+    KF_CHECK(sf.get(7) == 1001);
+    sf.clear();
+    KF_CHECK(!sf.promoted() && sf.get(7) == 0);
+
+    // Whole tables counted in 8- and 16-bit cells match full-width ones.
+    const auto seqs = test_seqs(3);
+    for(const bool canonical: {false, true}) {
+        KFreqArray<u32> wide(10, true, canonical);
+        KFreqArray<u32, uint8_t> narrow(10, true, canonical);
+        KFreqArray<u32, uint16_t> mid(10, true, canonical);
+        count_seqs(wide, seqs), count_seqs(narrow, seqs), count_seqs(mid, seqs);
+        for(unsigned k = 1; k <= 10; ++k)
+            for(size_t i = 0; i < wide.table(k).size(); ++i)
+                KF_CHECK(narrow.table(k).get(i) == wide.table(k).get(i) && mid.table(k).get(i) == wide.table(k).get(i));
+    }
+}
+
+// Threads sharing a compact max-k table count into full-width cells, matching a table counted alone.
+KF_TEST(shared_counts) {
+    const auto seqs = test_seqs(6);
+    for(const bool canonical: {false, true}) {
+        KFreqArray<u32, uint8_t> shared(10, true, canonical), alone(10, true, canonical);
+        KF_CHECK(!shared.freqs().back().promoted() && shared.max_bytes() >= 2 * shared.bytes());
+        {
+            SharedTable<SubKFreq<u32, uint8_t>> table(shared.freqs().back());
+            KF_CHECK(shared.freqs().back().promoted() && shared.freqs().back().bytes() == shared.freqs().back().max_bytes());
+            SharedCounter<SubKFreq<u32, uint8_t>> a(table, shared.freqs(), canonical), b(table, shared.freqs(), canonical);
+            for(size_t i = 0; i < seqs.size(); ++i) (i & 1 ? a: b).process_seq(seqs[i].data(), seqs[i].size());
+            a.flush(), b.flush();
+            for(auto *sc: {&a, &b}) {
+                const auto edges = sc->edges();
+                for(size_t j = 0; j < edges.size(); ++j) for(const u32 i: edges[j]) shared.freqs()[j].inc(i);
+            }
+        }
+        KF_CHECK(shared.freqs().back().spill_.empty());
+        shared.finalize(), count_seqs(alone, seqs);
+        for(unsigned k = 1; k <= 10; ++k)
+            for(size_t i = 0; i < alone.table(k).size(); ++i) KF_CHECK(shared.table(k).get(i) == alone.table(k).get(i));
+    }
+}
+
+// Tables written in the mapped format (and as text) read back with the same counts, mapped in place.
+KF_TEST(mapped_round_trip) {
+    const auto seqs = test_seqs(4);
+    for(const bool canonical: {false, true}) {
+        KFreqArray<u32, uint16_t> kfa(9, true, canonical);
+        KFreqList<u64> kfl(9, 4, true, canonical);
+        count_seqs(kfa, seqs), count_seqs(kfl, seqs);
+        const std::string bin = scratch("rt.kfa"), txt = scratch("rt.kfa.txt"), lbin = scratch("rt.kfl");
+        kfa.write(bin.data(), true), kfa.write(txt.data(), false, 3), kfl.write(lbin.data(), true);
+        KF_CHECK(is_mapped_file(bin.data()) && !is_mapped_file(txt.data()));
+        const KFreqArray<u32> mapped(bin.data()), text(txt.data());
+        const KFreqList<u64> lmapped(lbin.data());
+        KF_CHECK(mapped.mapped() && !text.mapped() && lmapped.mapped());
+        KF_CHECK(mapped.maxk() == 9 && mapped.canonical() == canonical && lmapped.mink() == 6 && lmapped.canonical() == canonical);
+        check_counts(mapped, seqs, canonical), check_counts(text, seqs, canonical), check_counts(lmapped, seqs, canonical);
+        bool threw = false;
+        try {KFreqArray<u32>(lbin.data());} catch(const std::runtime_error &) {threw = true;}
+        KF_CHECK(threw);
+    }
+}
+
+// Tables read back from a file, mapped or not, add like the tables they were written from,
+// whichever way the table added to was counted.
+KF_TEST(add_mapped_tables) {
+    const auto seqs = test_seqs(5);
+    std::vector<std::string> twice(seqs);
+    twice.insert(twice.end(), seqs.begin(), seqs.end());
+    for(const bool canonical: {false, true}) {
+        KFreqArray<u32> written(8, true, canonical);
+        count_seqs(written, seqs);
+        const std::string bin = scratch("add.kfa"), txt = scratch("add.kfa.txt");
+        written.write(bin.data(), true), written.write(txt.data());
+        for(const bool maxk_only: {false, true}) {
+            for(const char *path: {bin.data(), txt.data()}) {
+                KFreqArray<u32> sum(8, maxk_only, canonical);
+                KFreqArray<u32, uint8_t> compact(8, maxk_only, canonical);
+                count_seqs(sum, seqs), count_seqs(compact, seqs);
+                const KFreqArray<u32> read(path);
+                sum += read, compact += KFreqArray<u32, uint8_t>(path);
+                sum.finalize(), compact.finalize();
+                check_counts(sum, twice, canonical), check_counts(compact, twice, canonical);
+                // Counting more afterwards still completes the lower tables correctly.
+                for(const auto &s: seqs) sum.process_seq(s.data(), s.size());
+                sum.finalize();
+                std::vector<std::string> thrice(twice);
+                thrice.insert(thrice.end(), seqs.begin(), seqs.end());
+                check_counts(sum, thrice, canonical);
+            }
+        }
+        KFreqList<u32> lsum(8, 3, true, canonical);
+        count_seqs(lsum, seqs);
+        const std::string lbin = scratch("add.kfl");
+        lsum.write(lbin.data(), true);
+        lsum += KFreqList<u32>(lbin.data());
+        lsum.finalize();
+        check_counts(lsum, twice, canonical);
+        KFreqArray<u32> mapped(bin.data());
+        bool threw = false;
+        try {mapped += written;} catch(const std::runtime_error &) {threw = true;}
+        KF_CHECK(threw);
+    }
+}
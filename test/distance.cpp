@@ -0,0 +1,161 @@
+#include "test.h"
+#include "distmat.h"
+#include "kfreq.h"
+
+using namespace kf;
+using namespace kf::freq;
+using namespace kf::test;
+
+namespace {
+
+template<typename FloatType>
+std::vector<std::vector<FloatType>> random_rows(size_t n, size_t d, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::normal_distribution<double> norm;
+    std::vector<std::vector<FloatType>> ret(n, std::vector<FloatType>(d));
+    for(size_t i = 0; i < n; ++i) {
+        const double shift = norm(rng) * 5.;
+        for(auto &v: ret[i]) v = norm(rng) + shift;
+    }
+    if(n > 3) std::fill(ret[3].begin(), ret[3].end(), FloatType(2)); // Constant: similar to nothing
+    return ret;
+}
+
+template<typename FloatType>
+ProfileMatrix<FloatType> to_matrix(const std::vector<std::vector<FloatType>> &rows, size_t d) {
+    ProfileMatrix<FloatType> ret(rows.size(), d);
+    for(size_t i = 0; i < rows.size(); ++i) ret.set_row(i, rows[i]);
+    return ret;
+}
+
+template<typename FloatType>
+double naive_metric(const std::vector<FloatType> &a, const std::vector<FloatType> &b, Metric metric) {
+    double ab = 0., aa = 0., bb = 0., sq = 0.;
+    for(size_t i = 0; i < a.size(); ++i) ab += double(a[i]) * b[i], aa += double(a[i]) * a[i], bb += double(b[i]) * b[i],
+                                         sq += (double(a[i]) - b[i]) * (double(a[i]) - b[i]);
+    switch(metric) {
+        case PEARSON: {
+            const double r = pearsonr_naive(a, b);
+            return std::isfinite(r) ? r: 0.;
+        }
+        case COSINE: return aa > 0. && bb > 0. ? ab / std::sqrt(aa * bb): 0.;
+        default:     return std::sqrt(sq);
+    }
+}
+
+template<typename FloatType>
+void check_pairwise(double tol) {
+    // Over a KF_DIST_DEPTH slice deep and not a whole number of tiles or 4-row groups.
+    const size_t n = 45, d = KF_DIST_DEPTH + 77;
+    const auto rows = random_rows<FloatType>(n, d, 11);
+    for(const Metric metric: {PEARSON, COSINE, EUCLIDEAN}) {
+        auto m = to_matrix(rows, d);
+        const auto got = pairwise(m, metric);
+        for(size_t i = 0; i < n; ++i) {
+            for(size_t j = 0; j < n; ++j) {
+                const double want = naive_metric(rows[i], rows[j], metric);
+                KF_CHECK(std::fabs(got[i * n + j] - want) <= tol * std::max(1., std::fabs(want)));
+                KF_CHECK(got[i * n + j] == got[j * n + i]);
+            }
+        }
+    }
+}
+
+// Every value of a finished matrix, against all pairs computed in memory.
+template<typename FloatType>
+void check_disk_matrix(const std::string &path, const ProfileMatrix<FloatType> &m, Metric metric) {
+    const size_t n = m.size();
+    std::vector<FloatType> want(n * n);
+    pairwise_block(m, metric, 0, n, 0, n, want.data(), n);
+    const DiskMatrix<FloatType> mat(path, KF_DMAT);
+    KF_CHECK(mat.rows() == n && mat.cols() == n);
+    for(size_t i = 0; i < n; ++i) KF_CHECK(std::equal(want.begin() + i * n, want.begin() + (i + 1) * n, mat.row(i)));
+}
+
+} // namespace
+
+// The blocked, tiled all-pairs product gives each pair's similarity or distance as computed one pair at a time.
+KF_TEST(pairwise_matches_naive) {
+    check_pairwise<double>(1e-9);
+    check_pairwise<float>(2e-4);
+}
+
+// An interrupted matrix resumes from its checkpoint, shards merge into the whole matrix, and a
+// matrix from other inputs or settings starts over.
+KF_TEST(disk_matrix_resume_and_merge) {
+    const size_t n = KF_DISTMAT_BLOCK + 88, d = 24, nblocks = matrix_blocks(n).size();
+    KF_CHECK(nblocks == 3);
+    auto m = to_matrix(random_rows<float>(n, d, 12), d);
+    standardize(m, PEARSON);
+    const std::string path = scratch("resume.dmat");
+    // Half the blocks, as a run killed partway would leave them,
+    KF_CHECK(compute_blocks(m, PEARSON, 1, path, 0, 2) == 2);
+    KF_CHECK(BlockCheckpoint::load(checkpoint_path(path), nblocks) == std::vector<bool>({true, false, true}));
+    // then the rest.
+    KF_CHECK(compute_blocks(m, PEARSON, 1, path) == 1);
+    check_disk_matrix(path, m, PEARSON);
+    KF_CHECK(compute_blocks(m, PEARSON, 1, path) == 0);
+    KF_CHECK(compute_blocks(m, PEARSON, 2, path) == nblocks);
+    check_disk_matrix(path, m, PEARSON);
+
+    const std::string merged = scratch("merged.dmat");
+    for(unsigned s = 0; s < 2; ++s) compute_blocks(m, PEARSON, 1, shard_path(merged, s, 2), s, 2);
+    merge_shards<float>(merged, 2);
+    check_disk_matrix(merged, m, PEARSON);
+    KF_CHECK(compute_blocks(m, PEARSON, 1, merged) == 0);
+    // Shards missing a block are not merged.
+    compute_blocks(m, PEARSON, 1, shard_path(merged, 0, 3), 0, 3);
+    compute_blocks(m, PEARSON, 1, shard_path(merged, 1, 3), 1, 3);
+    compute_blocks(m, PEARSON, 1, shard_path(merged, 2, 3), 1, 3);
+    bool threw = false;
+    try {merge_shards<float>(merged, 3);} catch(const std::runtime_error &) {threw = true;}
+    KF_CHECK(threw);
+    check_disk_matrix(merged, m, PEARSON);
+}
+
+// Updating a finished matrix for inputs added, dropped and reordered gives the matrix computed afresh.
+KF_TEST(disk_matrix_update) {
+    const size_t n = KF_DISTMAT_BLOCK + 40, d = 40;
+    const auto rows = random_rows<double>(n + 70, d, 13);
+    std::vector<std::string> names;
+    for(size_t i = 0; i < rows.size(); ++i) names.push_back("g" + std::to_string(i));
+    const std::string path = scratch("update.dmat");
+    auto settings = [](const std::vector<std::string> &ns) {return u64(ns.size()) * 1000003u;};
+    for(const Metric metric: {PEARSON, EUCLIDEAN}) {
+        // The first n inputs, computed in full,
+        const std::vector<std::string> old_names(names.begin(), names.begin() + n);
+        const u64 old_tag = settings(old_names);
+        auto pfile = profile_file<double>(profiles_path(path), n, d, metric, old_tag, [&](ProfileMatrix<double> &view) {
+            for(size_t i = 0; i < n; ++i) view.set_row(i, rows[i]);
+        });
+        compute_blocks(ProfileMatrix<double>(n, d, pfile->row(0)), metric, old_tag, path);
+        write_names(path, old_names, old_tag);
+        // then updated: some dropped, some new ones spliced in, one swapped pair.
+        std::vector<size_t> order;
+        for(size_t i = 0; i < 3; ++i) order.push_back(i);
+        for(size_t i = n; i < n + 5; ++i) order.push_back(i);
+        order.push_back(5), order.push_back(4);
+        for(size_t i = 6; i < 100; ++i) order.push_back(i);
+        for(size_t i = 150; i < n + 70; ++i) order.push_back(i);
+        std::vector<std::string> new_names;
+        for(const size_t i: order) new_names.push_back(names[i]);
+        const u64 new_tag = settings(new_names);
+        const auto prev = previous_rows<double>(path, new_names, d, metric, settings);
+        KF_CHECK(prev.size() == order.size());
+        for(size_t i = 0; i < order.size(); ++i) KF_CHECK(prev[i] == (order[i] < n ? order[i]: KF_NEW_ROW));
+        auto upfile = update_profile_file<double>(path, prev, d, metric, new_tag, [&](ProfileMatrix<double> &view) {
+            for(size_t i = 0, r = 0; i < order.size(); ++i) if(order[i] >= n) view.set_row(r++, rows[order[i]]);
+        });
+        const ProfileMatrix<double> m(order.size(), d, upfile->row(0));
+        update_blocks(m, prev, metric, new_tag, path);
+        std::vector<std::vector<double>> fresh_rows;
+        for(const size_t i: order) fresh_rows.push_back(rows[i]);
+        auto fresh = to_matrix(fresh_rows, d);
+        standardize(fresh, metric);
+        check_disk_matrix(path, fresh, metric);
+        KF_CHECK(disk_matrix_matches<double>(path, KF_DMAT, order.size(), order.size(), metric, new_tag, KF_DISTMAT_BLOCK));
+        KF_CHECK(BlockCheckpoint(checkpoint_path(path), matrix_blocks(order.size()).size(), true).count() == matrix_blocks(order.size()).size());
+        // Names the matrix has never seen leave nothing to update from.
+        KF_CHECK(previous_rows<double>(path, {"x", "y"}, d, metric, settings).empty());
+    }
+}
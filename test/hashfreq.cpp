@@ -0,0 +1,101 @@
+#include "test.h"
+#include "hashfreq.h"
+
+using namespace kf;
+using namespace kf::freq;
+using namespace kf::test;
+
+namespace {
+
+template<typename KFType>
+void check_hashed(const KFType &kf, const std::vector<std::string> &seqs, unsigned times=1) {
+    for(unsigned k = kf.mink(); k <= kf.maxk(); ++k) {
+        const auto naive = naive_kmers(seqs, k, kf.canonical());
+        const auto got = kf.table(k).table_.sorted();
+        KF_CHECK(got.size() == naive.size());
+        auto it = naive.begin();
+        for(const auto &e: got) {
+            KF_CHECK(e.first == it->first && e.second == it->second * times);
+            ++it;
+        }
+    }
+}
+
+std::vector<std::string> hash_seqs() {
+    std::mt19937_64 rng(30);
+    std::vector<std::string> ret;
+    for(const size_t n: {20000u, 3000u, 500u}) ret.push_back(random_seq(n, rng, 0.002));
+    // Runs shorter than each k, and a palindrome for every even k.
+    for(const char *s: {"", "ACGTACGTACGTACGTACG", "ACGTNACGTACGTACGTACGTACGTACGTNacgt"}) ret.push_back(s);
+    std::string pal;
+    for(unsigned i = 0; i < 10; ++i) pal += "ACGT";
+    ret.push_back(pal);
+    ret.push_back(std::string(300, 'C'));
+    return ret;
+}
+
+} // namespace
+
+// Hashed tables for k past 16 hold exactly the k-mers a brute-force count finds, stranded or
+// folded onto canonical k-mers, counted in memory or from a file on several threads.
+KF_TEST(hashed_counts_match_naive) {
+    const auto seqs = hash_seqs();
+    KFH kf(21, 5);
+    count_seqs(kf, seqs);
+    check_hashed(kf, seqs);
+    const std::string pal = seqs[6].substr(1, 21);
+    KF_CHECK(kf.count(pal) == naive_kmers(seqs, 21, false)[str2kmer<u64>(pal)]);
+    const std::string path = scratch("h.fa.gz");
+    write_records(path, std::vector<std::string>(seqs.size(), "r"), seqs);
+    KFH fromfile(21, 5);
+    PipelineStats stats;
+    fromfile.add(path.data(), nullptr, 3, &stats);
+    check_hashed(fromfile, seqs);
+    kf.rc_collapse();
+    KF_CHECK(kf.canonical());
+    check_hashed(kf, seqs);
+    const std::string s = seqs[6].substr(1, 20);
+    std::string rc(s.rbegin(), s.rend());
+    for(auto &c: rc) c = "TGCA"[std::strchr("ACGT", c) - "ACGT"];
+    KF_CHECK(kf.count(s) == kf.count(rc) && kf.count(s) == naive_kmers(seqs, 20, true)[canonical_representation(str2kmer<u64>(s), 20)]);
+    bool threw = false;
+    try {kf.process_seq(s.data(), s.size());} catch(const std::runtime_error &) {threw = true;}
+    KF_CHECK(threw);
+}
+
+// Tables read back from either format add and count like the tables they were written from.
+KF_TEST(hashed_round_trip) {
+    const auto seqs = hash_seqs();
+    std::vector<std::string> twice(seqs);
+    twice.insert(twice.end(), seqs.begin(), seqs.end());
+    KFH kf(21, 3);
+    count_seqs(kf, seqs);
+    const std::string bin = scratch("h.kfh"), txt = scratch("h.kfh.txt"), cbin = scratch("hc.kfh");
+    kf.write(bin.data(), true), kf.write(txt.data(), false, 3);
+    for(const std::string &path: {bin, txt}) {
+        KFH read(path.data());
+        KF_CHECK(read.maxk() == 21 && read.nk() == 3 && !read.canonical());
+        check_hashed(read, seqs);
+        KFH sum(21, 3);
+        count_seqs(sum, seqs);
+        sum += read;
+        sum.finalize();
+        check_hashed(sum, twice);
+        // Counting more into a table read back still completes its lower tables.
+        count_seqs(read, seqs);
+        check_hashed(read, twice);
+        read += KFH(path.data());
+        read.finalize();
+        check_hashed(read, seqs, 3);
+    }
+    kf.rc_collapse();
+    kf.write(cbin.data(), true);
+    KFH canon(cbin.data());
+    KF_CHECK(canon.canonical());
+    check_hashed(canon, seqs);
+    canon += kf;
+    check_hashed(canon, seqs, 2);
+    bool threw = false;
+    try {canon += KFH(bin.data());} catch(const std::runtime_error &) {threw = true;}
+    KF_CHECK(threw);
+}
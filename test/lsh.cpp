@@ -0,0 +1,77 @@
+#include "test.h"
+#include "lsh.h"
+
+using namespace kf;
+using namespace kf::freq;
+using namespace kf::test;
+
+namespace {
+
+// Copies the index at path to a scratch file with its header changed by edit.
+template<typename Edit>
+std::string edited_index(const std::string &path, const std::string &name, const Edit &edit) {
+    const std::string ret = scratch(name);
+    std::FILE *in = std::fopen(path.data(), "rb");
+    KF_CHECK(in != nullptr);
+    std::vector<char> buf;
+    char chunk[4096];
+    for(size_t n; (n = std::fread(chunk, 1, sizeof(chunk), in)) > 0; buf.insert(buf.end(), chunk, chunk + n));
+    std::fclose(in);
+    edit(*reinterpret_cast<LSHHeader *>(buf.data()));
+    std::FILE *out = std::fopen(ret.data(), "wb");
+    KF_CHECK(out != nullptr && std::fwrite(buf.data(), 1, buf.size(), out) == buf.size() && !std::fclose(out));
+    KF_CHECK(!std::rename((path + ".profiles").data(), (ret + ".profiles").data()));
+    return ret;
+}
+
+bool index_rejected(const std::string &path) {
+    bool ret = false;
+    try {LSHIndex<float> index(path);} catch(const std::runtime_error &) {ret = true;}
+    return ret;
+}
+
+} // namespace
+
+// An index written and reopened finds each query's true nearest neighbour, as pairwise
+// similarities over the indexed profiles and the queries rank them, and refuses a header
+// from another version or whose k range does not give its profiles' length.
+KF_TEST(lsh_query_matches_pairwise) {
+    const unsigned mink = 4, k = 5;
+    const size_t n = 300, nq = 20, d = zscore_size(4, true) + zscore_size(5, true);
+    std::mt19937_64 rng(13);
+    std::normal_distribution<float> norm;
+    ProfileMatrix<float> all(n + nq, d);
+    for(size_t i = 0; i < n; ++i)
+        for(size_t j = 0; j < d; ++j) all.row(i)[j] = norm(rng);
+    // Queries are noisy copies of indexed profiles, so that each has a clear nearest neighbour.
+    for(size_t q = 0; q < nq; ++q)
+        for(size_t j = 0; j < d; ++j) all.row(n + q)[j] = all.row(q * 7)[j] + .3f * norm(rng);
+    const std::string path = scratch("index.lsh");
+    std::vector<std::string> names;
+    for(size_t i = 0; i < n; ++i) names.push_back("p" + std::to_string(i));
+    {
+        auto pfile = profile_file<float>(path + ".profiles", n, d, PEARSON, 5, [&](ProfileMatrix<float> &m) {
+            for(size_t i = 0; i < n; ++i) std::copy(all.row(i), all.row(i) + d, m.row(i));
+        });
+        build_lsh_index(path, ProfileMatrix<float>(n, d, pfile->row(0)), names, mink, k, true, PEARSON, 5);
+    }
+    const auto sims = pairwise(all, PEARSON);
+    {
+        const LSHIndex<float> index(path);
+        KF_CHECK(index.size() == n && index.dim() == d && index.mink() == mink && index.k() == k && index.canonical());
+        KF_CHECK(index.metric() == PEARSON && std::string(index.name(9)) == "p9");
+        for(size_t q = 0; q < nq; ++q) {
+            const float *row = &sims[(n + q) * (n + nq)];
+            const size_t best = std::max_element(row, row + n) - row;
+            KF_CHECK(best == q * 7);
+            const auto exact = index.exact(all.row(n + q), 1), approx = index.query(all.row(n + q), 1);
+            KF_CHECK(exact.size() == 1 && exact[0].id == best && std::abs(exact[0].sim - row[best]) < 1e-4);
+            KF_CHECK(approx.size() == 1 && approx[0].id == best);
+        }
+    }
+    KF_CHECK(!index_rejected(path));
+    KF_CHECK(index_rejected(edited_index(path, "version.lsh", [](LSHHeader &h) {++h.version;})));
+    KF_CHECK(index_rejected(edited_index(scratch("version.lsh"), "mink.lsh", [](LSHHeader &h) {--h.version, h.mink = 3;})));
+    KF_CHECK(!index_rejected(edited_index(scratch("mink.lsh"), "same.lsh", [](LSHHeader &h) {h.mink = 4;})));
+    KF_CHECK(index_rejected(edited_index(scratch("same.lsh"), "stranded.lsh", [](LSHHeader &h) {h.canonical = 0;})));
+}
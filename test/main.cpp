@@ -0,0 +1,34 @@
+#include "test.h"
+#include <cstring>
+#include <unistd.h>
+
+using namespace kf::test;
+
+// Runs every registered case, or those named on the command line, in a scratch directory
+// under $TMPDIR (or /tmp). Exits nonzero if any fails.
+int main(int argc, char **argv) {
+    const char *tmp = std::getenv("TMPDIR");
+    std::string dir = std::string(tmp && *tmp ? tmp: "/tmp") + "/kfunitXXXXXX";
+    if(::mkdtemp(&dir[0]) == nullptr) {
+        std::fprintf(stderr, "Could not make a scratch directory at %s\n", dir.data());
+        return EXIT_FAILURE;
+    }
+    scratch_dir() = dir;
+    size_t run = 0, failed = 0;
+    for(const Case &c: cases()) {
+        bool wanted = argc == 1;
+        for(int i = 1; i < argc; ++i) wanted |= std::strcmp(argv[i], c.name) == 0;
+        if(!wanted) continue;
+        ++run;
+        try {
+            c.fn();
+            std::fprintf(stderr, "ok\t%s\n", c.name);
+        } catch(const std::exception &e) {
+            ++failed;
+            std::fprintf(stderr, "FAIL\t%s\t%s\n", c.name, e.what());
+        }
+    }
+    std::system(("rm -rf '" + dir + "'").data());
+    std::fprintf(stderr, "%zu of %zu passed\n", run - failed, run);
+    return failed ? EXIT_FAILURE: EXIT_SUCCESS;
+}
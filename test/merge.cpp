@@ -0,0 +1,68 @@
+#include "test.h"
+#include "kfmerge.h"
+
+using namespace kf;
+using namespace kf::freq;
+using namespace kf::test;
+
+namespace {
+
+template<typename KFType>
+void check_same(const KFType &got, const KFType &want) {
+    for(unsigned k = want.mink(); k <= want.maxk(); ++k)
+        for(size_t i = 0; i < want.table(k).size(); ++i) KF_CHECK(got.table(k).get(i) == want.table(k).get(i));
+}
+
+template<typename KFType>
+bool merge_throws(const std::vector<std::string> &paths, KFType &out) {
+    try {merge_counts(paths, out, 2);} catch(const std::runtime_error &) {return true;}
+    return false;
+}
+
+} // namespace
+
+// Shards counted apart and written mapped or as text sum to what counting them together gives;
+// inputs that overflow, mix count widths, or hold other k ranges or strandedness are refused.
+KF_TEST(merge_matches_combined) {
+    std::mt19937_64 rng(23);
+    std::vector<std::string> seqs;
+    for(unsigned i = 0; i < 6; ++i) seqs.push_back(random_seq(3000, rng, 0.01));
+    seqs.push_back(std::string(2000, 'A'));
+    for(const bool canonical: {false, true}) {
+        std::vector<std::string> paths;
+        for(unsigned i = 0; i < 3; ++i) {
+            KFreqArray<u32> shard(7, false, canonical);
+            KFreqList<u32> lshard(7, 3, false, canonical);
+            count_seqs(shard, std::vector<std::string>(seqs.begin() + i * 2, i == 2 ? seqs.end(): seqs.begin() + i * 2 + 2));
+            count_seqs(lshard, std::vector<std::string>(seqs.begin() + i * 2, i == 2 ? seqs.end(): seqs.begin() + i * 2 + 2));
+            paths.push_back(scratch("m" + std::to_string(i) + ".kfa")), paths.push_back(paths.back() + ".kfl");
+            shard.write(paths[i * 2].data(), i != 1), lshard.write(paths[i * 2 + 1].data(), i != 1);
+        }
+        KFreqArray<u64> merged(7, false, canonical), combined(7, false, canonical);
+        KFreqList<u32> lmerged(7, 3, false, canonical), lcombined(7, 3, false, canonical);
+        merge_counts(std::vector<std::string>{paths[0], paths[2], paths[4]}, merged, 2);
+        merge_counts(std::vector<std::string>{paths[1], paths[3], paths[5]}, lmerged, 2);
+        count_seqs(combined, seqs), count_seqs(lcombined, seqs);
+        check_same(merged, combined), check_same(lmerged, lcombined);
+
+        // Two copies of a count near the top of 32 bits overflow a 32-bit sum, not a 64-bit one.
+        KFreqArray<u32> big(7, false, canonical);
+        big.freqs().back().data_[1] = UINT32_MAX - 10;
+        const std::string bigpath = scratch("big.kfa"), widepath = scratch("wide.kfa");
+        big.write(bigpath.data(), true);
+        KFreqArray<u32> narrow(7, false, canonical);
+        KFreqArray<u64> wide(7, false, canonical);
+        KF_CHECK(merge_throws(std::vector<std::string>{bigpath, bigpath}, narrow));
+        KF_CHECK(!merge_throws(std::vector<std::string>{bigpath, bigpath}, wide));
+        KF_CHECK(wide.table(7).get(1) == 2 * uint64_t(UINT32_MAX - 10));
+        wide.write(widepath.data(), true);
+        KFreqArray<u64> out(7, false, canonical);
+        KF_CHECK(merge_throws(std::vector<std::string>{paths[0], widepath}, out));
+        KFreqArray<u32> out32(7, false, canonical);
+        KF_CHECK(merge_throws(std::vector<std::string>{widepath}, out32));
+        KFreqArray<u64> other_k(6, false, canonical), other_strand(7, false, !canonical);
+        KF_CHECK(merge_throws(std::vector<std::string>{paths[0]}, other_k));
+        KF_CHECK(merge_throws(std::vector<std::string>{paths[0]}, other_strand));
+        KF_CHECK(merge_throws(std::vector<std::string>{paths[1]}, out));
+    }
+}
@@ -0,0 +1,104 @@
+#include "test.h"
+#include "kfreq.h"
+
+using namespace kf;
+using namespace kf::freq;
+using namespace kf::test;
+
+namespace {
+
+struct Records {
+    std::vector<std::string> names, seqs;
+    void add(const SeqBatch &b) {
+        for(size_t i = 0; i < b.size(); ++i) names.emplace_back(b.name(i), b.name_len(i)), seqs.emplace_back(b.seq(i), b.len(i));
+    }
+};
+
+Records read_kseq(const std::string &path) {
+    Records ret;
+    KSeqBatchReader reader(path.data(), nullptr, true);
+    SeqBatch batch;
+    while(reader.next(batch, 1000)) ret.add(batch);
+    return ret;
+}
+
+Records read_pipeline(const std::string &path, size_t max_bases, unsigned nthreads) {
+    Records ret;
+    SeqPipeline pipe(path.data(), max_bases, nthreads, true);
+    while(SeqBatch *b = pipe.next()) ret.add(*b), pipe.release(b);
+    return ret;
+}
+
+// Compresses the file at path to path + ".bgz" as BGZF.
+std::string to_bgzf(const std::string &path) {
+    std::FILE *in = std::fopen(path.data(), "rb");
+    std::string text;
+    char buf[1 << 16];
+    for(size_t n; (n = std::fread(buf, 1, sizeof(buf), in)) > 0;) text.append(buf, n);
+    std::fclose(in);
+    std::vector<uint8_t> out;
+    BGZFDeflater().compress(text.data(), text.size(), out);
+    out.insert(out.end(), BGZF_EOF, BGZF_EOF + sizeof(BGZF_EOF));
+    const std::string ret = path + ".bgz";
+    std::FILE *fp = std::fopen(ret.data(), "wb");
+    KF_CHECK(std::fwrite(out.data(), 1, out.size(), fp) == out.size());
+    std::fclose(fp);
+    KF_CHECK(is_bgzf(ret.data()));
+    return ret;
+}
+
+// Inputs spanning several of the pipeline's buffers, with records of every size from empty up.
+// Written once per run.
+const std::vector<std::string> &test_files() {
+    static std::vector<std::string> ret;
+    if(!ret.empty()) return ret;
+    std::mt19937_64 rng(9);
+    std::vector<std::string> names, seqs;
+    for(size_t i = 0; i < 400; ++i) {
+        const size_t n = i % 40 == 0 ? 400000 + (rng() % 100000): rng() % 3000;
+        names.push_back("rec" + std::to_string(i) + (i & 1 ? "/1": ""));
+        seqs.push_back(random_seq(n, rng, 0.001));
+    }
+    const std::vector<std::string> paths{scratch("p60.fa"), scratch("p7.fa"), scratch("p.fa.gz"), scratch("p.fq"), scratch("p.fq.gz")};
+    write_records(paths[0], names, seqs, false, 60);
+    write_records(paths[1], names, seqs, false, 7);
+    write_records(paths[2], names, seqs, false, 80);
+    write_records(paths[3], names, seqs, true);
+    write_records(paths[4], names, seqs, true);
+    ret = paths;
+    ret.push_back(to_bgzf(paths[0]));
+    ret.push_back(to_bgzf(paths[3]));
+    return ret;
+}
+
+} // namespace
+
+// SeqPipeline parses plain, gzipped and BGZF FASTA and FASTQ into the same records and names as kseq.
+KF_TEST(pipeline_matches_kseq) {
+    for(const auto &path: test_files()) {
+        const Records ref = read_kseq(path);
+        KF_CHECK(ref.seqs.size() == 400);
+        for(const size_t max_bases: {size_t(5000), size_t(KF_BATCH_BASES)}) {
+            for(const unsigned nthreads: {1u, 3u}) {
+                const Records got = read_pipeline(path, max_bases, nthreads);
+                KF_CHECK(got.names == ref.names);
+                KF_CHECK(got.seqs == ref.seqs);
+            }
+        }
+    }
+}
+
+// Counting an input on several threads gives the same tables as counting it on one.
+KF_TEST(parallel_add_matches_serial) {
+    const auto &paths = test_files();
+    for(const auto &path: {paths[2], paths.back()}) {
+        for(const bool canonical: {false, true}) {
+            KFreqArray<u32, uint16_t> serial(9, true, canonical), parallel(9, true, canonical);
+            serial.add(path.data());
+            PipelineStats stats;
+            parallel.add(path.data(), nullptr, 3, &stats);
+            for(unsigned k = 1; k <= 9; ++k)
+                for(size_t i = 0; i < serial.table(k).size(); ++i) KF_CHECK(serial.table(k).get(i) == parallel.table(k).get(i));
+        }
+    }
+}
@@ -0,0 +1,77 @@
+#include "test.h"
+#include "profiledb.h"
+#include <cmath>
+
+using namespace kf;
+using namespace kf::freq;
+using namespace kf::test;
+
+namespace {
+
+ProfileMatrix<float> random_profiles(size_t n, size_t dim, std::mt19937_64 &rng) {
+    ProfileMatrix<float> ret(n, dim);
+    std::normal_distribution<float> norm(0.f, 20.f);
+    for(size_t i = 0; i < n; ++i)
+        for(size_t j = 0; j < dim; ++j) ret.row(i)[j] = norm(rng);
+    return ret;
+}
+
+std::vector<std::string> profile_names(size_t first, size_t n) {
+    std::vector<std::string> ret;
+    for(size_t i = first; i < first + n; ++i) ret.push_back("p" + std::to_string(i));
+    return ret;
+}
+
+// Whether row i of db holds m's row r, exactly for float32 and to half precision for float16.
+bool same_row(const ProfileDB &db, size_t i, const ProfileMatrix<float> &m, size_t r) {
+    std::vector<float> got(db.dim());
+    db.get(i, got.data());
+    const float eps = std::ldexp(1.f, -11), tiny = std::ldexp(1.f, -24);
+    for(size_t j = 0; j < db.dim(); ++j) {
+        const float want = m.row(r)[j];
+        if(db.half() ? std::abs(got[j] - want) > std::abs(want) * eps + tiny: got[j] != want) return false;
+    }
+    return true;
+}
+
+} // namespace
+
+// Profiles appended read back after reopening, including past a growth of the file, to within
+// float16 rounding for half-width databases; a name appended twice finds its latest profile.
+KF_TEST(profiledb_append_reopen) {
+    std::mt19937_64 rng(19);
+    const size_t dim = 37, first = 100, second = KF_PDB_MIN_ROWS;
+    for(const bool half: {false, true}) {
+        const std::string path = scratch(half ? "h.pdb": "f.pdb");
+        const auto a = random_profiles(first, dim, rng), b = random_profiles(second, dim, rng);
+        append_profiles(path, a, profile_names(0, first), 3, 5, true, half, COUNTS);
+        {
+            const ProfileDB db(path);
+            KF_CHECK(db.size() == first && db.dim() == dim && db.half() == half && db.values() == COUNTS);
+            KF_CHECK(db.mink() == 3 && db.maxk() == 5 && db.canonical());
+            for(size_t i = 0; i < first; ++i) KF_CHECK(same_row(db, i, a, i) && db.find(db.name(i)) == i);
+        }
+        // A reader keeps what it opened while the file grows and is replaced under it.
+        const ProfileDB before(path);
+        const u64 capacity = before.header().capacity;
+        std::vector<std::string> names = profile_names(first, second);
+        names[7] = "p3";
+        append_profiles(path, b, names, 3, 5, true, half, COUNTS);
+        const ProfileDB db(path);
+        KF_CHECK(db.header().capacity > capacity && db.size() == first + second);
+        KF_CHECK(before.size() == first && same_row(before, first - 1, a, first - 1));
+        for(size_t i = 0; i < first; ++i) KF_CHECK(same_row(db, i, a, i));
+        for(size_t i = 0; i < second; ++i) KF_CHECK(same_row(db, first + i, b, i) && db.name(first + i) == names[i]);
+        KF_CHECK(db.find("p3") == first + 7 && db.find("p4") == 4 && db.find("absent") == db.size());
+        ProfileMatrix<float> all(db.size(), dim);
+        db.load(all);
+        KF_CHECK(std::equal(all.row(first + 7), all.row(first + 7) + dim, all.row(db.find("p3"))));
+        // Profiles that do not match the database are refused.
+        bool threw = false;
+        try {append_profiles(path, a, profile_names(0, first), 3, 5, true, !half, COUNTS);} catch(const std::runtime_error &) {threw = true;}
+        KF_CHECK(threw);
+        threw = false;
+        try {append_profiles(path, a, profile_names(0, first), 3, 5, false, half, COUNTS);} catch(const std::runtime_error &) {threw = true;}
+        KF_CHECK(threw && ProfileDB(path).size() == first + second);
+    }
+}
@@ -0,0 +1,37 @@
+#include "test.h"
+#include "scheduler.h"
+#include <atomic>
+#include <thread>
+
+using namespace kf;
+using namespace kf::test;
+
+// Workers taking inputs from their own queues and stealing from each other's, all at once, are
+// handed every input exactly once; a lone worker takes them largest first.
+KF_TEST(scheduler_hands_out_each_input_once) {
+    std::mt19937_64 rng(21);
+    for(const unsigned nworkers: {1u, 3u, 8u}) {
+        for(const size_t n: {size_t(0), size_t(5), size_t(2000)}) {
+            std::vector<size_t> sizes(n);
+            for(auto &s: sizes) s = rng() % 5 ? rng() % 100000: 0;
+            InputScheduler sched(sizes, nworkers);
+            std::vector<std::atomic<unsigned>> taken(n);
+            for(auto &t: taken) t = 0;
+            std::vector<std::vector<size_t>> order(nworkers);
+            std::vector<std::thread> threads;
+            for(unsigned tid = 0; tid < nworkers; ++tid)
+                threads.emplace_back([&, tid]() {
+                    for(size_t i; sched.next(tid, i);) ++taken[i], order[tid].push_back(i);
+                });
+            for(auto &t: threads) t.join();
+            for(const auto &t: taken) KF_CHECK(t == 1);
+            size_t total = 0;
+            for(const auto &o: order) total += o.size();
+            KF_CHECK(total == n);
+            size_t i;
+            KF_CHECK(!sched.next(0, i));
+            if(nworkers == 1)
+                for(size_t j = 1; j < order[0].size(); ++j) KF_CHECK(sizes[order[0][j - 1]] >= sizes[order[0][j]]);
+        }
+    }
+}
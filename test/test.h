@@ -0,0 +1,110 @@
+#pragma once
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+// Unit tests: each test/*.cpp registers its cases with KF_TEST, and test/main.cpp runs them all
+// (make unit && ./unit [name ...]). Checks throw, so a failing case stops at its first failure.
+namespace kf {
+
+namespace test {
+
+struct Case {
+    const char *name;
+    void (*fn)();
+};
+inline std::vector<Case> &cases() {
+    static std::vector<Case> ret;
+    return ret;
+}
+struct Register {
+    Register(const char *name, void (*fn)()) {cases().push_back(Case{name, fn});}
+};
+
+// Scratch directory for the run, made by main() and removed once every case has run.
+inline std::string &scratch_dir() {
+    static std::string ret;
+    return ret;
+}
+static inline std::string scratch(const std::string &name) {return scratch_dir() + '/' + name;}
+
+// Random bases, with runs of N mixed in at rate n_rate so that counting sees run ends.
+static inline std::string random_seq(size_t n, std::mt19937_64 &rng, double n_rate=0.) {
+    std::string ret(n, 'A');
+    std::uniform_real_distribution<double> u;
+    for(size_t i = 0; i < n; ++i) ret[i] = n_rate > 0. && u(rng) < n_rate ? 'N': "ACGT"[rng() & 3];
+    return ret;
+}
+
+// Writes records as FASTA (line width wrap) or FASTQ, gzipped if path ends in .gz.
+static inline void write_records(const std::string &path, const std::vector<std::string> &names, const std::vector<std::string> &seqs,
+                                 bool fastq=false, size_t wrap=60) {
+    gzFile fp = gzopen(path.data(), path.size() > 3 && path.compare(path.size() - 3, 3, ".gz") == 0 ? "wb": "wbT");
+    if(fp == nullptr) throw std::runtime_error(std::string("Could not open file at ") + path);
+    for(size_t i = 0; i < seqs.size(); ++i) {
+        gzprintf(fp, "%c%s comment %zu\n", fastq ? '@': '>', names[i].data(), i);
+        for(size_t j = 0; j < seqs[i].size(); j += fastq ? seqs[i].size(): wrap) {
+            const size_t n = fastq ? seqs[i].size(): std::min(wrap, seqs[i].size() - j);
+            gzwrite(fp, seqs[i].data() + j, n), gzputc(fp, '\n');
+        }
+        if(fastq) gzputs(fp, "+\n"), gzwrite(fp, std::string(seqs[i].size(), 'I').data(), seqs[i].size()), gzputc(fp, '\n');
+    }
+    gzclose(fp);
+}
+
+// Every k-mer lying within a run of ACGT (either case), by brute force, with how often it occurs;
+// if canonical, added to the lesser of it and its reverse complement (palindromes twice).
+static inline std::map<uint64_t, uint64_t> naive_kmers(const std::vector<std::string> &seqs, unsigned k, bool canonical=false) {
+    std::map<uint64_t, uint64_t> ret;
+    for(const auto &s: seqs) {
+        for(size_t i = 0; i + k <= s.size(); ++i) {
+            uint64_t v = 0, rc = 0;
+            unsigned j = 0;
+            for(; j < k; ++j) {
+                const char *p = std::strchr("ACGT", std::toupper(static_cast<unsigned char>(s[i + j])));
+                if(p == nullptr || !*p) break;
+                v = (v << 2) | (p - "ACGT"), rc |= uint64_t(3 - (p - "ACGT")) << (j << 1);
+            }
+            if(j < k) continue;
+            if(!canonical)    ++ret[v];
+            else if(v == rc)  ret[v] += 2;
+            else             ++ret[std::min(v, rc)];
+        }
+    }
+    return ret;
+}
+
+// naive_kmers as a dense table over all 4^k k-mers, for small k.
+static inline std::vector<uint64_t> naive_counts(const std::vector<std::string> &seqs, unsigned k) {
+    std::vector<uint64_t> ret(size_t(1) << (k << 1));
+    for(const auto &e: naive_kmers(seqs, k)) ret[e.first] = e.second;
+    return ret;
+}
+
+// Counts seqs into kf one at a time, then completes its lower-order tables.
+template<typename KFType>
+void count_seqs(KFType &kf, const std::vector<std::string> &seqs) {
+    for(const auto &s: seqs) kf.process_seq(s.data(), s.size());
+    kf.finalize();
+}
+
+} // namespace test
+
+} // namespace kf
+
+#define KF_TEST(name) \
+    static void kf_test_##name(); \
+    static const ::kf::test::Register kf_register_##name(#name, kf_test_##name); \
+    static void kf_test_##name()
+
+#define KF_CHECK(cond) do { \
+        if(!(cond)) throw std::runtime_error(std::string(__FILE__) + ':' + std::to_string(__LINE__) + ": " #cond); \
+    } while(0)
@@ -0,0 +1,55 @@
+#include "test.h"
+#include "textio.h"
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+using namespace kf;
+using namespace kf::test;
+
+namespace {
+
+void check_fixed6(double x) {
+    char got[FIXED6_MAX], want[FIXED6_MAX];
+    *fixed6(x, got) = '\0';
+    std::snprintf(want, sizeof(want), "%f", x);
+    if(std::strcmp(got, want))
+        throw std::runtime_error(std::string("fixed6 gave ") + got + " for " + want);
+}
+
+} // namespace
+
+// fixed6 writes what "%f" does, including ties, signed zeros and values past its fast path.
+KF_TEST(fixed6_matches_printf) {
+    std::mt19937_64 rng(20);
+    std::uniform_real_distribution<double> unit(-1., 1.);
+    for(int i = 0; i < 50000; ++i) {
+        const double u = unit(rng);
+        check_fixed6(u), check_fixed6(u * 1e3), check_fixed6(u * 1e8), check_fixed6(u * 1e-5), check_fixed6(u * 2e9);
+        double bits; // Any finite double
+        const uint64_t r = rng();
+        std::memcpy(&bits, &r, sizeof(bits));
+        if(std::isfinite(bits)) check_fixed6(bits);
+    }
+    // Dyadic values land exactly halfway between two outputs whenever x * 1e6 ends in .5.
+    for(int i = -(1 << 20); i < (1 << 20); ++i) check_fixed6(std::ldexp(double(i), -21)), check_fixed6(std::ldexp(double(i), -12) + 1e3);
+    for(const double x: {0., -0., 5e-7, -5e-7, 1.5e-6, 2.5e-6, 0.0000005, 999999999.9999995, 1e9, -1e9, 1e300, -1e-300,
+                         std::numeric_limits<double>::denorm_min(), std::numeric_limits<double>::max(),
+                         std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity(),
+                         std::numeric_limits<double>::quiet_NaN()})
+        check_fixed6(x);
+}
+
+KF_TEST(u64toa_matches_printf) {
+    std::mt19937_64 rng(21);
+    char got[24], want[24];
+    auto check = [&](uint64_t v) {
+        *u64toa(v, got) = '\0';
+        std::snprintf(want, sizeof(want), "%llu", static_cast<unsigned long long>(v));
+        KF_CHECK(std::strcmp(got, want) == 0);
+    };
+    for(uint64_t v = 0; v < 100000; ++v) check(v);
+    for(uint64_t p = 1; p && p <= UINT64_MAX / 10; p *= 10) check(p - 1), check(p), check(p + 1);
+    for(int i = 0; i < 100000; ++i) check(rng()), check(rng() >> (rng() & 63));
+    check(UINT64_MAX);
+}
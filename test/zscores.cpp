@@ -0,0 +1,106 @@
+#include "test.h"
+#include "recprofile.h"
+#include <cmath>
+
+using namespace kf;
+using namespace kf::freq;
+using namespace kf::test;
+
+namespace {
+
+// Short and sparse enough that many (k-2)-mers go unseen at the top k, with runs whose counts
+// leave a variance of 0.
+std::vector<std::string> zscore_seqs() {
+    std::mt19937_64 rng(14);
+    std::vector<std::string> ret;
+    for(const size_t n: {900u, 400u, 60u}) ret.push_back(random_seq(n, rng, 0.01));
+    ret.push_back(std::string(40, 'A'));
+    ret.push_back("ACACACACACACACACAC");
+    ret.push_back("GATTACAGATTACA");
+    return ret;
+}
+
+// The original scoring loop, ported as written: every k-mer for k from mink to maxk, or only
+// canonical k-mers, in order, for canonical tables. Counts how often each special case is hit.
+template<typename KFType>
+std::vector<double> naive_zscores(const KFType &kf, unsigned mink, unsigned maxk, size_t &nomid, size_t &novar) {
+    std::vector<double> ret;
+    for(unsigned k = mink; k <= maxk; ++k) {
+        const u32 mask1 = (UINT32_C(1) << ((k - 1) << 1)) - 1, mask2 = (UINT32_C(1) << ((k - 2) << 1)) - 1;
+        for(u32 i = 0; i < (UINT32_C(1) << (k << 1)); ++i) {
+            if(kf.canonical() && !is_canonical(i, k)) continue;
+            const double mid = kf.count(k - 2, (i >> 2) & mask2);
+            if(mid == 0.) {
+                ret.push_back(0.), ++nomid;
+                continue;
+            }
+            const double km1l = kf.count(k - 1, i & mask1), km1r = kf.count(k - 1, (i >> 2) & mask1);
+            const double fmid = 1. / mid, xp = km1l * km1r * fmid;
+            const double var = xp * (mid - km1l) * (mid - km1r) * fmid * fmid;
+            if(var == 0.) ret.push_back(1. / (mid * mid)), ++novar;
+            else          ret.push_back((kf.count(k, i) - xp) / var);
+        }
+    }
+    return ret;
+}
+
+template<typename KFType>
+void check_zscores(const KFType &kf, unsigned mink, unsigned maxk, size_t &nomid, size_t &novar) {
+    size_t n = 0;
+    const auto naive = naive_zscores(kf, mink, maxk, nomid, novar);
+    for(unsigned k = mink; k <= maxk; ++k) n += zscore_size(k, kf.canonical());
+    KF_CHECK(naive.size() == n);
+    std::vector<double> got(n);
+    calc_zscores(kf, mink, maxk, got.data());
+    for(size_t i = 0; i < n; ++i) KF_CHECK(std::abs(got[i] - naive[i]) <= 1e-9 * std::max(1., std::abs(naive[i])));
+}
+
+} // namespace
+
+// Z-scores over one k or a range of them, odd and even, stranded or canonical, match the
+// original formula, including k-mers whose middle was never seen and those with no variance.
+KF_TEST(zscores_match_naive) {
+    const auto seqs = zscore_seqs();
+    size_t nomid = 0, novar = 0;
+    for(const bool canonical: {false, true}) {
+        KFreqArray<u32> kfa(7, false, canonical);
+        count_seqs(kfa, seqs);
+        check_zscores(kfa, 3, 7, nomid, novar);
+        check_zscores(kfa, 4, 4, nomid, novar);
+        check_zscores(kfa, 5, 7, nomid, novar);
+        KFreqList<u32> kfl(8, 6, false, canonical);
+        count_seqs(kfl, seqs);
+        check_zscores(kfl, 5, 8, nomid, novar);
+        check_zscores(kfl, 6, 6, nomid, novar);
+        check_zscores(kfl, 7, 7, nomid, novar);
+    }
+    KF_CHECK(nomid > 0 && novar > 0);
+}
+
+// Each record's profile is what calc_zscores gives for a table counting that record alone,
+// stranded or canonical, including records with runs of N and records shorter than every k.
+KF_TEST(record_profiles_match_tables) {
+    std::mt19937_64 rng(25);
+    auto seqs = zscore_seqs();
+    for(unsigned i = 0; i < 50; ++i) seqs.push_back(random_seq(rng() % 300, rng, 0.02));
+    seqs.push_back("AC"), seqs.push_back("");
+    const std::string path = scratch("records.fa.gz");
+    write_records(path, std::vector<std::string>(seqs.size(), "r"), seqs);
+    for(const bool canonical: {false, true}) {
+        for(const unsigned mink: {3u, 5u}) {
+            const unsigned maxk = 6;
+            size_t seen = 0;
+            auto emit = [&](const SeqBatch &, size_t, const ProfileMatrix<double> &rows) {
+                for(size_t r = 0; r < rows.size(); ++r, ++seen) {
+                    KFreqArray<u32> kf(maxk, false, canonical);
+                    count_seqs(kf, std::vector<std::string>{seqs[seen]});
+                    std::vector<double> want(rows.dim());
+                    calc_zscores(kf, mink, maxk, want.data());
+                    KF_CHECK(std::equal(want.begin(), want.end(), rows.row(r)));
+                }
+            };
+            KF_CHECK(profile_records<double>(std::vector<std::string>{path}, mink, maxk, canonical, ZSCORES, 2, emit) == seqs.size());
+            KF_CHECK(seen == seqs.size());
+        }
+    }
+}